@@ -9,6 +9,31 @@ $CFLAGS += " -DRUBY_1_9" if RUBY_VERSION =~ /^1\.9/
 
 if !(os == 'mswin' or os == 'bccwin' or os == 'mingw')
   exit(1) if not have_header("termios.h") or not have_header("unistd.h")
+  # The optional receive thread
+  have_library("pthread", "pthread_create")
+  # Arbitrary baud rates on Linux
+  have_header("asm/termbits.h") if os == 'linux'
+  # SerialPort.list on Mac OS X
+  if os == 'darwin' and have_header("IOKit/IOKitLib.h")
+    $LDFLAGS += " -framework IOKit -framework CoreFoundation"
+  end
+else
+  # SerialPort.list, the registry is read without it
+  have_header("setupapi.h") and have_library("setupapi")
 end
 
+# Used to release the GVL around blocking reads and writes
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("rb_thread_blocking_region")
+
+# Waiting through the fiber scheduler on ports opened with :nonblock
+have_func("rb_io_wait", "ruby/io.h")
+
+# Readiness notification for SerialPort::Selector, poll() otherwise
+have_header("sys/epoll.h") or have_header("sys/event.h")
+
+# Growing a caller-supplied buffer in place
+have_func("rb_str_modify_expand")
+
 create_makefile('serialport')
@@ -23,16 +23,44 @@
 #if !defined(OS_MSWIN) && !defined(OS_BCCWIN) && !defined(OS_MINGW)
 
 #include <stdio.h>   /* Standard input/output definitions */
+#include <string.h>
 #include <unistd.h>  /* UNIX standard function definitions */
 #include <fcntl.h>   /* File control definitions */
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <poll.h>    /* Waiting for data with a timeout */
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>  /* writev */
+#include <sys/mman.h> /* Shared memory fan-out */
+#include <sys/stat.h>
+#include <sys/file.h> /* flock */
+#include <pthread.h> /* Receive thread */
+#include <signal.h>  /* Timed TIOCMIWAIT */
+#include <dirent.h>  /* Port enumeration */
+#include <limits.h>
+#include <stdlib.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#endif
 
 #if defined(OS_LINUX)
 #include <linux/serial.h>
+#if defined(HAVE_ASM_TERMBITS_H)
+#define HAVE_TERMIOS2 1
+#endif
 #elif defined(OS_DARWIN)
 #include <IOKit/serial/ioss.h>
+#if defined(HAVE_IOKIT_IOKITLIB_H)
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/serial/IOSerialKeys.h>
+#include <IOKit/IOBSD.h>
+#endif
 #endif
 
 #ifdef CRTSCTS
@@ -63,8 +91,75 @@ int get_fd_helper(obj)
 #endif
 }
 
-VALUE sp_create_impl(class, _port)
-   VALUE class, _port;
+#if defined(OS_LINUX)
+/*
+ * :nodoc: Set the transmit FIFO size the driver assumes for the UART.
+ *
+ * Returns 0 on success
+ */
+static int set_xmit_fifo_size(int fd, int size)
+{
+   struct serial_struct serial_info;
+
+   if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0)
+   {
+      return -1;
+   }
+
+   if (serial_info.xmit_fifo_size == size)
+   {
+      return 0;
+   }
+
+   serial_info.xmit_fifo_size = size;
+   return ioctl(fd, TIOCSSERIAL, &serial_info);
+}
+#endif
+
+static void modem_params_to_termios(VALUE self, int fd, struct termios *params,
+                                    int argc, VALUE *argv, int *custom_baud_rate);
+static void save_modem_params(VALUE self, int fd, struct termios *params,
+                              int custom_baud_rate);
+
+/* The port being opened by sp_create_impl */
+struct open_config
+{
+   VALUE sp;
+   int fd;
+   struct termios *params;
+   int argc;
+   VALUE *argv;
+};
+
+/*
+ * :nodoc: Apply the raw mode settings and the modem parameters of a port
+ * being opened in a single tcsetattr. Called under rb_protect.
+ */
+static VALUE configure_port(arg)
+   VALUE arg;
+{
+   struct open_config *config = (struct open_config *) arg;
+   int custom_baud_rate = 0;
+
+   if (config->argc == 0)
+   {
+      if (tcsetattr(config->fd, TCSANOW, config->params) == -1)
+      {
+         rb_sys_fail(sTcsetattr);
+      }
+      return Qnil;
+   }
+
+   modem_params_to_termios(config->sp, config->fd, config->params,
+                           config->argc, config->argv, &custom_baud_rate);
+   save_modem_params(config->sp, config->fd, config->params, custom_baud_rate);
+   return Qnil;
+}
+
+VALUE sp_create_impl(class, _port, options, argc, argv)
+   VALUE class, _port, options;
+   int argc;
+   VALUE *argv;
 {
 #ifdef RUBY_1_9
    rb_io_t *fp;
@@ -94,6 +189,10 @@ VALUE sp_create_impl(class, _port)
 #endif
    };
    struct termios params;
+   int tx_buffer;
+   int nonblock;
+   struct open_config config;
+   int state = 0;
 
    NEWOBJ(sp, struct RFile);
    rb_secure(4);
@@ -137,8 +236,23 @@ VALUE sp_create_impl(class, _port)
       rb_raise(rb_eArgError, "not a serial port");
    }
 
-   /* enable blocking read */
-   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+   /* enable blocking read, unless the waits are left to Ruby */
+   nonblock = RTEST(sp_open_option(options, "nonblock"));
+   if (!nonblock)
+   {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+   }
+
+   /* the tty layer sizes its receive buffer itself, rx_buffer is ignored */
+   sp_open_size_option(options, "rx_buffer", 0);
+   tx_buffer = sp_open_size_option(options, "tx_buffer", 0);
+#if defined(OS_LINUX)
+   if (tx_buffer > 0 && set_xmit_fifo_size(fd, tx_buffer) < 0)
+   {
+      close(fd);
+      rb_sys_fail(sIoctl);
+   }
+#endif
 
    if (tcgetattr(fd, &params) == -1)
    {
@@ -152,10 +266,16 @@ VALUE sp_create_impl(class, _port)
    params.c_cflag |= CLOCAL | CREAD;
    params.c_cflag &= ~HUPCL;
 
-   if (tcsetattr(fd, TCSANOW, &params) == -1)
+   config.sp = (VALUE) sp;
+   config.fd = fd;
+   config.params = &params;
+   config.argc = argc;
+   config.argv = argv;
+   rb_protect(configure_port, (VALUE) &config, &state);
+   if (state)
    {
       close(fd);
-      rb_sys_fail(sTcsetattr);
+      rb_jump_tag(state);
    }
 
 #ifdef RUBY_1_9
@@ -164,6 +284,7 @@ VALUE sp_create_impl(class, _port)
    fp->f = rb_fdopen(fd, "r+");
 #endif
    fp->mode = FMODE_READWRITE | FMODE_SYNC;
+   get_port_data((VALUE) sp)->nonblock = nonblock;
 
    return (VALUE) sp;
 }
@@ -171,7 +292,9 @@ VALUE sp_create_impl(class, _port)
 #if defined(OS_LINUX)
 
 /*
- * :nodoc: Set a non-standard baud rate on the termios provided.
+ * :nodoc: Set a non-standard baud rate on the termios provided. The exact
+ * rate is requested through termios2 where the kernel supports it,
+ * otherwise the closest ASYNC_SPD_CUST divisor is used.
  *
  * Returns 0 on success
  */
@@ -183,7 +306,14 @@ static int set_custom_baud_rate(int fd, int baud)
 
    if (baud <= 0) {
       rb_raise(rb_eArgError, "invalid baud rate");
-   } else if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0) {
+   }
+#ifdef HAVE_TERMIOS2
+   if (sp_set_termios2_speed(fd, baud) == 0) {
+      return 0;
+   }
+#endif
+
+   if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0) {
       rb_raise(rb_eArgError, "unable to execute TIOCGSERIAL ioctl for custom baud");
    } else if (baud > serial_info.baud_base) {
       rb_raise(rb_eArgError, "custom baud rate is too high");
@@ -215,6 +345,7 @@ static int set_custom_baud_rate(int fd, int baud)
 
 /*
  * :nodoc: Clear the custom baud rate fields from the provided termios.
+ * Drivers without TIOCGSERIAL can't have a custom divisor to clear.
  *
  * Returns 0 on success
  */
@@ -223,7 +354,7 @@ static int clear_custom_baud_rate(int fd)
    struct serial_struct serial_info;
 
    if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0) {
-      rb_raise(rb_eArgError, "unable to execute TIOCGSERIAL ioctl for custom baud");
+      return 0;
    }
 
    if (!(serial_info.flags & ASYNC_SPD_CUST) &&
@@ -244,24 +375,27 @@ static int clear_custom_baud_rate(int fd)
 }
 
 /*
- * :nodoc: Returns the baud rate of the file descriptor provided only if it
- * is set as a custom baud rate.
+ * :nodoc: Returns the baud rate of the file descriptor provided when the
+ * termios speed code doesn't tell it: a custom divisor, or else the
+ * exact rate reported by termios2.
  *
- * Returns 0 if a custom baud rate is not set
+ * Returns 0 if the rate is unknown
  */
 static int get_custom_baud_rate(int fd)
 {
    struct serial_struct serial_info;
 
-   if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0) {
-      return 0;
-   } else if (!(serial_info.flags & ASYNC_SPD_CUST)) {
-      return 0;
-   } else if (serial_info.custom_divisor > 0) {
+   if (ioctl(fd, TIOCGSERIAL, &serial_info) == 0 &&
+       (serial_info.flags & ASYNC_SPD_CUST) &&
+       serial_info.custom_divisor > 0) {
       return serial_info.baud_base / serial_info.custom_divisor;
-   } else {
-      return 0;
    }
+
+#ifdef HAVE_TERMIOS2
+   return sp_get_termios2_speed(fd);
+#else
+   return 0;
+#endif
 }
 
 #elif defined(OS_DARWIN)
@@ -319,12 +453,163 @@ static int get_custom_baud_rate(VALUE self)
 
 #endif
 
-VALUE sp_set_modem_params_impl(argc, argv, self)
-   int argc;
-   VALUE *argv, self;
+/*
+ * :nodoc: Decode the settings held in params.
+ */
+static void termios_to_modem_params(fd, params, mp)
+   int fd;
+   struct termios *params;
+   struct modem_params *mp;
+{
+   switch (cfgetospeed(params))
+   {
+      case B50:    mp->data_rate = 50; break;
+      case B75:    mp->data_rate = 75; break;
+      case B110:   mp->data_rate = 110; break;
+      case B134:   mp->data_rate = 134; break;
+      case B150:   mp->data_rate = 150; break;
+      case B200:   mp->data_rate = 200; break;
+      case B300:   mp->data_rate = 300; break;
+      case B600:   mp->data_rate = 600; break;
+      case B1200:  mp->data_rate = 1200; break;
+      case B1800:  mp->data_rate = 1800; break;
+      case B2400:  mp->data_rate = 2400; break;
+      case B4800:  mp->data_rate = 4800; break;
+      case B9600:  mp->data_rate = 9600; break;
+      case B19200: mp->data_rate = 19200; break;
+#if defined(OS_LINUX)
+      /* B38400 is also what selects the custom divisor */
+      case B38400:
+         mp->data_rate = get_custom_baud_rate(fd);
+         if (mp->data_rate == 0)
+         {
+            mp->data_rate = 38400;
+         }
+         break;
+#else
+      case B38400: mp->data_rate = 38400; break;
+#endif
+#ifdef B57600
+      case B57600: mp->data_rate = 57600; break;
+#endif
+#ifdef B76800
+      case B76800: mp->data_rate = 76800; break;
+#endif
+#ifdef B115200
+      case B115200: mp->data_rate = 115200; break;
+#endif
+#ifdef B230400
+      case B230400: mp->data_rate = 230400; break;
+#endif
+#if defined(OS_LINUX)
+      default:
+         mp->data_rate = get_custom_baud_rate(fd);
+         break;
+#elif defined(OS_DARWIN)
+      default:
+         mp->data_rate = get_custom_baud_rate(self);
+         break;
+#endif
+   }
+
+   switch(params->c_cflag & CSIZE)
+   {
+      case CS5:
+         mp->data_bits = 5;
+         break;
+      case CS6:
+         mp->data_bits = 6;
+         break;
+      case CS7:
+         mp->data_bits = 7;
+         break;
+      case CS8:
+         mp->data_bits = 8;
+         break;
+      default:
+         mp->data_bits = 0;
+         break;
+   }
+
+   mp->stop_bits = (params->c_cflag & CSTOPB ? 2 : 1);
+
+   if (!(params->c_cflag & PARENB))
+   {
+      mp->parity = NONE;
+   }
+   else if (params->c_cflag & PARODD)
+   {
+      mp->parity = ODD;
+   }
+   else
+   {
+      mp->parity = EVEN;
+   }
+
+   mp->flow_control = NONE;
+
+#ifdef HAVE_FLOWCONTROL_HARD
+   if (params->c_cflag & CRTSCTS)
+   {
+      mp->flow_control += HARD;
+   }
+#endif
+
+   if (params->c_iflag & (IXON | IXOFF | IXANY))
+   {
+      mp->flow_control += SOFT;
+   }
+
+   if (params->c_cc[VTIME] == 0 && params->c_cc[VMIN] == 0)
+   {
+      mp->read_timeout = -1;
+   }
+   else
+   {
+      mp->read_timeout = params->c_cc[VTIME] * 100;
+   }
+}
+
+/*
+ * :nodoc: Map a read timeout in milliseconds and the minimum number of
+ * bytes per read onto VTIME and VMIN.
+ */
+static void set_read_timeout_params(params, timeout, min_bytes)
+   struct termios *params;
+   int timeout;
+   int min_bytes;
 {
+   if (timeout < 0)
+   {
+      params->c_cc[VTIME] = 0;
+      params->c_cc[VMIN] = 0;
+   }
+   else if (timeout == 0)
+   {
+      params->c_cc[VTIME] = 0;
+      params->c_cc[VMIN] = (min_bytes > 1 ? min_bytes : 1);
+   }
+   else
+   {
+      /* with VMIN > 0, VTIME is the gap allowed between two bytes */
+      params->c_cc[VTIME] = (timeout + 50) / 100;
+      params->c_cc[VMIN] = min_bytes;
+   }
+}
+
+/*
+ * :nodoc: Put the modem parameters of SerialPort#set_modem_params into
+ * params, without applying them. A rate without a B constant is left in
+ * custom_baud_rate for save_modem_params.
+ */
+static void modem_params_to_termios(self, fd, params, argc, argv, custom_baud_rate)
+   VALUE self;
    int fd;
-   struct termios params;
+   struct termios *params;
+   int argc;
+   VALUE *argv;
+   int *custom_baud_rate;
+{
    VALUE _data_rate, _data_bits, _parity, _stop_bits;
    VALUE _flow_control, _read_timeout;
    int use_hash = 0;
@@ -332,15 +617,8 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
    int flow_control, read_timeout;
    _data_rate = _data_bits = _parity = _stop_bits = Qnil;
    _flow_control = _read_timeout = Qnil;
-#if defined(OS_LINUX) || defined(OS_DARWIN)
-   int custom_baud_rate = 0;
-#endif
-
-   if (argc == 0)
-   {
-      return self;
-   }
 
+   *custom_baud_rate = 0;
    if (argc == 1 && T_HASH == TYPE(argv[0]))
    {
       use_hash = 1;
@@ -352,15 +630,9 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
       _read_timeout = rb_hash_aref(argv[0], sReadTimeout);
    }
 
-   fd = get_fd_helper(self);
-   if (tcgetattr(fd, &params) == -1)
-   {
-      rb_sys_fail(sTcgetattr);
-   }
-
 #if defined(OS_DARWIN)
-   custom_baud_rate = get_custom_baud_rate(self);
-   clear_custom_baud_rate(self, &params);
+   *custom_baud_rate = get_custom_baud_rate(self);
+   clear_custom_baud_rate(self, params);
 #endif
 
    if (!use_hash)
@@ -410,10 +682,10 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
 #endif
       default:
 #if defined(OS_LINUX) || defined(OS_DARWIN)
-         custom_baud_rate = FIX2INT(_data_rate);
-         if (custom_baud_rate <= 0) {
+         *custom_baud_rate = FIX2INT(_data_rate);
+         if (*custom_baud_rate <= 0) {
             rb_raise(rb_eArgError, "invalid baud rate");
-         } else if (custom_baud_rate > 24000000) {
+         } else if (*custom_baud_rate > 24000000) {
             rb_raise(rb_eArgError, "baud rate too high");
          }
          /* data_rate must be set to B38400 for Linux to honor custom rates */
@@ -431,8 +703,8 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
     */
    clear_custom_baud_rate(fd);
 #endif
-   cfsetispeed(&params, data_rate);
-   cfsetospeed(&params, data_rate);
+   cfsetispeed(params, data_rate);
+   cfsetospeed(params, data_rate);
 
    SetDataBits:
 
@@ -465,8 +737,8 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
          rb_raise(rb_eArgError, "unknown character size");
          break;
    }
-   params.c_cflag &= ~CSIZE;
-   params.c_cflag |= data_bits;
+   params->c_cflag &= ~CSIZE;
+   params->c_cflag |= data_bits;
 
    SetStopBits:
 
@@ -485,10 +757,10 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
    switch(FIX2INT(_stop_bits))
    {
       case 1:
-         params.c_cflag &= ~CSTOPB;
+         params->c_cflag &= ~CSTOPB;
          break;
       case 2:
-         params.c_cflag |= CSTOPB;
+         params->c_cflag |= CSTOPB;
          break;
       default:
          rb_raise(rb_eArgError, "unknown number of stop bits");
@@ -499,7 +771,7 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
 
    if (!use_hash)
    {
-      _parity = (argc >= 4 ? argv[3] : ((params.c_cflag & CSIZE) == CS8 ?
+      _parity = (argc >= 4 ? argv[3] : ((params->c_cflag & CSIZE) == CS8 ?
                INT2FIX(NONE) : INT2FIX(EVEN)));
    }
 
@@ -513,17 +785,17 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
    switch(FIX2INT(_parity))
    {
       case EVEN:
-         params.c_cflag |= PARENB;
-         params.c_cflag &= ~PARODD;
+         params->c_cflag |= PARENB;
+         params->c_cflag &= ~PARODD;
          break;
 
       case ODD:
-         params.c_cflag |= PARENB;
-         params.c_cflag |= PARODD;
+         params->c_cflag |= PARENB;
+         params->c_cflag |= PARODD;
          break;
 
       case NONE:
-         params.c_cflag &= ~PARENB;
+         params->c_cflag &= ~PARENB;
          break;
 
       default:
@@ -557,11 +829,11 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
    if (flow_control & HARD)
    {
 #ifdef HAVE_FLOWCONTROL_HARD
-      params.c_cflag |= CRTSCTS;
+      params->c_cflag |= CRTSCTS;
    }
    else
    {
-      params.c_cflag &= ~CRTSCTS;
+      params->c_cflag &= ~CRTSCTS;
    }
 #else
       rb_raise(rb_eIOError, "Hardware flow control not supported");
@@ -570,11 +842,11 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
 
    if (flow_control & SOFT)
    {
-      params.c_iflag |= (IXON | IXOFF | IXANY);
+      params->c_iflag |= (IXON | IXOFF | IXANY);
    }
    else
    {
-      params.c_iflag &= ~(IXON | IXOFF | IXANY);
+      params->c_iflag &= ~(IXON | IXOFF | IXANY);
    }
 
    SetReadTimeout:
@@ -586,31 +858,29 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
 
    if (NIL_P(_read_timeout))
    {
-      goto SaveSettings;
+      return;
    }
 
    Check_Type(_read_timeout, T_FIXNUM);
    read_timeout = FIX2INT(_read_timeout);
 
-   if (read_timeout < 0)
-   {
-      params.c_cc[VTIME] = 0;
-      params.c_cc[VMIN] = 0;
-   }
-   else if (read_timeout == 0)
-   {
-      params.c_cc[VTIME] = 0;
-      params.c_cc[VMIN] = 1;
-   }
-   else
-   {
-      params.c_cc[VTIME] = (read_timeout + 50) / 100;
-      params.c_cc[VMIN] = 0;
-   }
+   set_read_timeout_params(params, read_timeout,
+                           get_port_data(self)->read_min_bytes);
+}
 
-   SaveSettings:
+/*
+ * :nodoc: Apply params filled in by modem_params_to_termios and cache
+ * the resulting modem parameters.
+ */
+static void save_modem_params(self, fd, params, custom_baud_rate)
+   VALUE self;
+   int fd;
+   struct termios *params;
+   int custom_baud_rate;
+{
+   struct modem_params mp;
 
-   if (tcsetattr(fd, TCSANOW, &params) == -1)
+   if (tcsetattr(fd, TCSANOW, params) == -1)
    {
       rb_sys_fail(sTcsetattr);
    }
@@ -627,6 +897,39 @@ VALUE sp_set_modem_params_impl(argc, argv, self)
    }
 #endif
 
+   termios_to_modem_params(fd, params, &mp);
+#if defined(OS_DARWIN)
+   /* params still holds the placeholder speed set by clear_custom_baud_rate */
+   if (custom_baud_rate != 0)
+   {
+      mp.data_rate = custom_baud_rate;
+   }
+#endif
+   cache_modem_params(self, &mp);
+}
+
+VALUE sp_set_modem_params_impl(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   int fd;
+   struct termios params;
+   int custom_baud_rate;
+
+   if (argc == 0)
+   {
+      return self;
+   }
+
+   fd = get_fd_helper(self);
+   if (tcgetattr(fd, &params) == -1)
+   {
+      rb_sys_fail(sTcgetattr);
+   }
+
+   modem_params_to_termios(self, fd, &params, argc, argv, &custom_baud_rate);
+   save_modem_params(self, fd, &params, custom_baud_rate);
+
    return argv[0];
 }
 
@@ -643,102 +946,7 @@ void get_modem_params_impl(self, mp)
       rb_sys_fail(sTcgetattr);
    }
 
-   switch (cfgetospeed(&params))
-   {
-      case B50:    mp->data_rate = 50; break;
-      case B75:    mp->data_rate = 75; break;
-      case B110:   mp->data_rate = 110; break;
-      case B134:   mp->data_rate = 134; break;
-      case B150:   mp->data_rate = 150; break;
-      case B200:   mp->data_rate = 200; break;
-      case B300:   mp->data_rate = 300; break;
-      case B600:   mp->data_rate = 600; break;
-      case B1200:  mp->data_rate = 1200; break;
-      case B1800:  mp->data_rate = 1800; break;
-      case B2400:  mp->data_rate = 2400; break;
-      case B4800:  mp->data_rate = 4800; break;
-      case B9600:  mp->data_rate = 9600; break;
-      case B19200: mp->data_rate = 19200; break;
-      case B38400: mp->data_rate = 38400; break;
-#ifdef B57600
-      case B57600: mp->data_rate = 57600; break;
-#endif
-#ifdef B76800
-      case B76800: mp->data_rate = 76800; break;
-#endif
-#ifdef B115200
-      case B115200: mp->data_rate = 115200; break;
-#endif
-#ifdef B230400
-      case B230400: mp->data_rate = 230400; break;
-#endif
-#if defined(OS_LINUX)
-      default:
-         mp->data_rate = get_custom_baud_rate(fd);
-         break;
-#elif defined(OS_DARWIN)
-      default:
-         mp->data_rate = get_custom_baud_rate(self);
-         break;
-#endif
-   }
-
-   switch(params.c_cflag & CSIZE)
-   {
-      case CS5:
-         mp->data_bits = 5;
-         break;
-      case CS6:
-         mp->data_bits = 6;
-         break;
-      case CS7:
-         mp->data_bits = 7;
-         break;
-      case CS8:
-         mp->data_bits = 8;
-         break;
-      default:
-         mp->data_bits = 0;
-         break;
-   }
-
-   mp->stop_bits = (params.c_cflag & CSTOPB ? 2 : 1);
-
-   if (!(params.c_cflag & PARENB))
-   {
-      mp->parity = NONE;
-   }
-   else if (params.c_cflag & PARODD)
-   {
-      mp->parity = ODD;
-   }
-   else
-   {
-      mp->parity = EVEN;
-   }
-
-   mp->flow_control = NONE;
-
-#ifdef HAVE_FLOWCONTROL_HARD
-   if (params.c_cflag & CRTSCTS)
-   {
-      mp->flow_control += HARD;
-   }
-#endif
-
-   if (params.c_iflag & (IXON | IXOFF | IXANY))
-   {
-      mp->flow_control += SOFT;
-   }
-
-   if (params.c_cc[VTIME] == 0 && params.c_cc[VMIN] == 0)
-   {
-      mp->read_timeout = -1;
-   }
-   else
-   {
-      mp->read_timeout = params.c_cc[VTIME] * 100;
-   }
+   termios_to_modem_params(fd, &params, mp);
 }
 
 VALUE sp_set_flow_control_impl(self, val)
@@ -747,6 +955,7 @@ VALUE sp_set_flow_control_impl(self, val)
    int fd;
    int flowc;
    struct termios params;
+   struct modem_params mp;
 
    Check_Type(val, T_FIXNUM);
 
@@ -794,15 +1003,22 @@ VALUE sp_set_flow_control_impl(self, val)
       rb_sys_fail(sTcsetattr);
    }
 
+   termios_to_modem_params(fd, &params, &mp);
+   cache_modem_params(self, &mp);
+
    return val;
 }
 
-VALUE sp_get_flow_control_impl(self)
-   VALUE self;
+VALUE sp_set_read_timeout_impl(self, val)
+   VALUE self, val;
 {
-   int ret;
+   int timeout;
    int fd;
    struct termios params;
+   struct modem_params mp;
+
+   Check_Type(val, T_FIXNUM);
+   timeout = FIX2INT(val);
 
    fd = get_fd_helper(self);
    if (tcgetattr(fd, &params) == -1)
@@ -810,97 +1026,213 @@ VALUE sp_get_flow_control_impl(self)
       rb_sys_fail(sTcgetattr);
    }
 
-   ret = 0;
+   set_read_timeout_params(&params, timeout,
+                           get_port_data(self)->read_min_bytes);
 
-#ifdef HAVE_FLOWCONTROL_HARD
-   if (params.c_cflag & CRTSCTS)
+   if (tcsetattr(fd, TCSANOW, &params) == -1)
    {
-      ret += HARD;
+      rb_sys_fail(sTcsetattr);
    }
-#endif
 
-   if (params.c_iflag & (IXON | IXOFF | IXANY))
-   {
-      ret += SOFT;
-   }
+   termios_to_modem_params(fd, &params, &mp);
+   cache_modem_params(self, &mp);
 
-   return INT2FIX(ret);
+   return val;
 }
 
-VALUE sp_set_read_timeout_impl(self, val)
+VALUE sp_set_write_timeout_impl(self, val)
    VALUE self, val;
 {
-   int timeout;
-   int fd;
-   struct termios params;
+   rb_notimplement();
+   return self;
+}
 
-   Check_Type(val, T_FIXNUM);
-   timeout = FIX2INT(val);
+VALUE sp_get_write_timeout_impl(self)
+   VALUE self;
+{
+   rb_notimplement();
+   return self;
+}
+
+#if defined(OS_LINUX)
+
+VALUE sp_set_low_latency_impl(self, val)
+   VALUE self, val;
+{
+   struct serial_struct serial_info;
+   int fd;
 
    fd = get_fd_helper(self);
-   if (tcgetattr(fd, &params) == -1)
+   if (ioctl(fd, TIOCGSERIAL, &serial_info) < 0)
    {
-      rb_sys_fail(sTcgetattr);
+      rb_sys_fail(sIoctl);
    }
 
-   if (timeout < 0)
+   if (RTEST(val))
    {
-      params.c_cc[VTIME] = 0;
-      params.c_cc[VMIN] = 0;
-   }
-   else if (timeout == 0)
-   {
-      params.c_cc[VTIME] = 0;
-      params.c_cc[VMIN] = 1;
+      serial_info.flags |= ASYNC_LOW_LATENCY;
    }
    else
    {
-      params.c_cc[VTIME] = (timeout + 50) / 100;
-      params.c_cc[VMIN] = 0;
+      serial_info.flags &= ~ASYNC_LOW_LATENCY;
    }
 
-   if (tcsetattr(fd, TCSANOW, &params) == -1)
+   if (ioctl(fd, TIOCSSERIAL, &serial_info) < 0)
    {
-      rb_sys_fail(sTcsetattr);
+      rb_sys_fail(sIoctl);
    }
 
    return val;
 }
 
-VALUE sp_get_read_timeout_impl(self)
+VALUE sp_get_low_latency_impl(self)
    VALUE self;
 {
-   int fd;
-   struct termios params;
-
-   fd = get_fd_helper(self);
-   if (tcgetattr(fd, &params) == -1)
-   {
-      rb_sys_fail(sTcgetattr);
-   }
+   struct serial_struct serial_info;
 
-   if (params.c_cc[VTIME] == 0 && params.c_cc[VMIN] == 0)
+   if (ioctl(get_fd_helper(self), TIOCGSERIAL, &serial_info) < 0)
    {
-      return INT2FIX(-1);
+      rb_sys_fail(sIoctl);
    }
 
-   return INT2FIX(params.c_cc[VTIME] * 100);
+   return (serial_info.flags & ASYNC_LOW_LATENCY) ? Qtrue : Qfalse;
 }
 
-VALUE sp_set_write_timeout_impl(self, val)
+#else
+
+VALUE sp_set_low_latency_impl(self, val)
    VALUE self, val;
 {
    rb_notimplement();
    return self;
 }
 
-VALUE sp_get_write_timeout_impl(self)
+VALUE sp_get_low_latency_impl(self)
    VALUE self;
 {
    rb_notimplement();
    return self;
 }
 
+#endif
+
+#if defined(OS_LINUX) && defined(TIOCSRS485)
+
+void sp_set_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   struct serial_rs485 conf;
+   int fd = get_fd_helper(self);
+
+   /* keep fields this file doesn't know about */
+   if (ioctl(fd, TIOCGRS485, &conf) < 0)
+   {
+      memset(&conf, 0, sizeof(conf));
+   }
+
+   conf.flags &= ~(SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND | SER_RS485_RTS_AFTER_SEND);
+   conf.flags |= (rs->enabled ? SER_RS485_ENABLED : 0) |
+                 (rs->rts_on_send ? SER_RS485_RTS_ON_SEND : 0) |
+                 (rs->rts_after_send ? SER_RS485_RTS_AFTER_SEND : 0);
+   conf.delay_rts_before_send = rs->delay_before;
+   conf.delay_rts_after_send = rs->delay_after;
+
+   if (ioctl(fd, TIOCSRS485, &conf) < 0)
+   {
+      rb_sys_fail(sIoctl);
+   }
+}
+
+void sp_get_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   struct serial_rs485 conf;
+
+   if (ioctl(get_fd_helper(self), TIOCGRS485, &conf) < 0)
+   {
+      rb_sys_fail(sIoctl);
+   }
+
+   rs->enabled = (conf.flags & SER_RS485_ENABLED) != 0;
+   rs->rts_on_send = (conf.flags & SER_RS485_RTS_ON_SEND) != 0;
+   rs->rts_after_send = (conf.flags & SER_RS485_RTS_AFTER_SEND) != 0;
+   rs->delay_before = conf.delay_rts_before_send;
+   rs->delay_after = conf.delay_rts_after_send;
+}
+
+#else
+
+void sp_set_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   rb_notimplement();
+}
+
+void sp_get_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   rb_notimplement();
+}
+
+#endif
+
+static int send_break(int fd, long break_us, long mab_us);
+
+/* The break alone, see send_break */
+struct break_args
+{
+   int fd;
+   long break_us;
+   long mab_us;
+   int result;
+   int error;
+};
+
+static void *break_func(ptr)
+   void *ptr;
+{
+   struct break_args *b = (struct break_args *) ptr;
+
+   b->result = send_break(b->fd, b->break_us, b->mab_us);
+   b->error = errno;
+
+   return NULL;
+}
+
+void sp_send_break_impl(self, break_us, mab_us)
+   VALUE self;
+   long break_us, mab_us;
+{
+   struct break_args b;
+
+   b.fd = get_fd_helper(self);
+   b.break_us = break_us;
+   b.mab_us = mab_us;
+
+   for (;;)
+   {
+      sp_blocking_call(break_func, &b);
+      if (b.result == 0)
+      {
+         return;
+      }
+
+      /* only tcdrain is interrupted, before the break started */
+      if (b.error != EINTR)
+      {
+         errno = b.error;
+         rb_sys_fail(sIoctl);
+      }
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+}
+
 VALUE sp_break_impl(self, time)
    VALUE self, time;
 {
@@ -939,43 +1271,100 @@ void get_line_signals_helper_impl(obj, ls)
    ls->ri  = (status & TIOCM_RI ? 1 : 0);
 }
 
+/*
+ * :nodoc: Convert TIOCM_* bits to LINE_* bits.
+ */
+static int tiocm_to_lines(status)
+   int status;
+{
+   return (status & TIOCM_RTS ? LINE_RTS : 0) |
+          (status & TIOCM_DTR ? LINE_DTR : 0) |
+          (status & TIOCM_CTS ? LINE_CTS : 0) |
+          (status & TIOCM_DSR ? LINE_DSR : 0) |
+          (status & TIOCM_CD ? LINE_DCD : 0) |
+          (status & TIOCM_RI ? LINE_RI : 0);
+}
+
+/*
+ * :nodoc: Raise the TIOCM_* lines in set and lower those in clear.
+ */
+static void modify_lines(fd, set, clear)
+   int fd, set, clear;
+{
+#if defined(TIOCMBIS) && defined(TIOCMBIC)
+   if (set != 0 && ioctl(fd, TIOCMBIS, &set) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+   if (clear != 0 && ioctl(fd, TIOCMBIC, &clear) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+#else
+   int status;
+
+   if (ioctl(fd, TIOCMGET, &status) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+
+   status = (status | set) & ~clear;
+
+   if (ioctl(fd, TIOCMSET, &status) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+#endif
+}
+
 VALUE set_signal_impl(obj, val, sig)
    VALUE obj,val;
    int sig;
 {
-   int status;
    int fd;
    int set;
 
    Check_Type(val, T_FIXNUM);
    fd = get_fd_helper(obj);
 
-   if (ioctl(fd, TIOCMGET, &status) == -1)
-   {
-      rb_sys_fail(sIoctl);
-   }
-
    set = FIX2INT(val);
 
    if (set == 0)
    {
-      status &= ~sig;
+      modify_lines(fd, 0, sig);
    }
    else if (set == 1)
    {
-      status |= sig;
+      modify_lines(fd, sig, 0);
    }
    else
    {
       rb_raise(rb_eArgError, "invalid value");
    }
 
-   if (ioctl(fd, TIOCMSET, &status) == -1)
+   return val;
+}
+
+int sp_get_signal_bits_impl(self)
+   VALUE self;
+{
+   int status;
+
+   if (ioctl(get_fd_helper(self), TIOCMGET, &status) == -1)
    {
       rb_sys_fail(sIoctl);
    }
 
-   return val;
+   return tiocm_to_lines(status);
+}
+
+void sp_set_signal_bits_impl(self, set, clear)
+   VALUE self;
+   int set, clear;
+{
+   modify_lines(get_fd_helper(self),
+                (set & LINE_RTS ? TIOCM_RTS : 0) | (set & LINE_DTR ? TIOCM_DTR : 0),
+                (clear & LINE_RTS ? TIOCM_RTS : 0) | (clear & LINE_DTR ? TIOCM_DTR : 0));
 }
 
 VALUE sp_set_rts_impl(self, val)
@@ -1009,4 +1398,2360 @@ VALUE sp_get_dtr_impl(self)
    return INT2FIX(ls.dtr);
 }
 
+/*
+ * :nodoc: Milliseconds (with a fractional part) from an arbitrary fixed
+ * point, for deadlines.
+ */
+static double monotonic_ms(void)
+{
+#if defined(CLOCK_MONOTONIC)
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+   {
+      return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+   }
+#endif
+   {
+      struct timeval tv;
+
+      gettimeofday(&tv, NULL);
+      return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+   }
+}
+
+/*
+ * :nodoc: Nanoseconds on the clock of Process.clock_gettime with
+ * CLOCK_MONOTONIC, for receive timestamps.
+ */
+static LONG_LONG monotonic_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+   struct timespec ts;
+
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+   {
+      return (LONG_LONG) ts.tv_sec * 1000000000 + ts.tv_nsec;
+   }
+#endif
+   {
+      struct timeval tv;
+
+      gettimeofday(&tv, NULL);
+      return (LONG_LONG) tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+   }
+}
+
+/*
+ * :nodoc: Whole milliseconds left until deadline, rounded up so that a
+ * wait never ends early. Returns 0 once the deadline has passed.
+ */
+static int ms_until(double deadline)
+{
+   double left = deadline - monotonic_ms();
+
+   if (left <= 0)
+   {
+      return 0;
+   }
+
+   return (int) ceil(left);
+}
+
+/*
+ * :nodoc: Store the time timeout milliseconds from now in *until, for
+ * pthread_cond_timedwait().
+ */
+static void timespec_in(timeout, until)
+   int timeout;
+   struct timespec *until;
+{
+   struct timeval now;
+   long usec;
+
+   gettimeofday(&now, NULL);
+   usec = now.tv_usec + (timeout % 1000) * 1000L;
+   until->tv_sec = now.tv_sec + timeout / 1000 + usec / 1000000;
+   until->tv_nsec = (usec % 1000000) * 1000;
+}
+
+struct blocking_io
+{
+   int fd;
+   short events;    /* POLLIN to read, POLLOUT to write */
+   char *buf;
+   long len;
+   struct iovec *iov;   /* writev() these instead of buf when set */
+   int iovcnt;
+   int timeout;
+   long result;
+   int error;
+   int timed_out;
+   struct port_data *pd;   /* counters and capture of the port */
+   VALUE port;          /* waited for by nonblock_io */
+   LONG_LONG stamp;     /* when the read returned, see monotonic_ns */
+   long break_us;       /* send a break first if > 0, see send_break */
+   long mab_us;
+};
+
+#if defined(TIOCSBRK) && defined(TIOCCBRK)
+
+/* the last stretch of a break is timed by spinning, past the timer slack */
+#define BREAK_SPIN_NS 100000
+
+/*
+ * :nodoc: Wait until monotonic_ns reaches deadline, sleeping for most of
+ * the time and spinning for the rest. Signals don't cut it short.
+ */
+static void wait_until_ns(deadline)
+   LONG_LONG deadline;
+{
+   struct timespec ts;
+   LONG_LONG left;
+
+   while ((left = deadline - monotonic_ns()) > 0)
+   {
+      if (left > BREAK_SPIN_NS)
+      {
+         left -= BREAK_SPIN_NS;
+         ts.tv_sec = (time_t) (left / 1000000000);
+         ts.tv_nsec = (long) (left % 1000000000);
+         nanosleep(&ts, NULL);
+      }
+   }
+}
+
+/*
+ * :nodoc: Once the output has drained, hold the line in break for
+ * break_us microseconds, then at mark for mab_us. Returns -1 with errno
+ * set on failure. Called with the GVL released.
+ */
+static int send_break(fd, break_us, mab_us)
+   int fd;
+   long break_us, mab_us;
+{
+   LONG_LONG start;
+
+   if (tcdrain(fd) == -1 || ioctl(fd, TIOCSBRK) == -1)
+   {
+      return -1;
+   }
+   start = monotonic_ns();
+   wait_until_ns(start + (LONG_LONG) break_us * 1000);
+
+   if (ioctl(fd, TIOCCBRK) == -1)
+   {
+      return -1;
+   }
+   if (mab_us > 0)
+   {
+      wait_until_ns(monotonic_ns() + (LONG_LONG) mab_us * 1000);
+   }
+
+   return 0;
+}
+
+#else
+
+static int send_break(fd, break_us, mab_us)
+   int fd;
+   long break_us, mab_us;
+{
+   errno = ENOTTY;
+   return -1;
+}
+
+#endif
+
+/*
+ * :nodoc: write() or writev() for blocking_io_func and nonblock_io. The
+ * port has O_NONBLOCK set meanwhile, see do_blocking_io, so it never
+ * blocks.
+ */
+static ssize_t nonblock_write(io)
+   struct blocking_io *io;
+{
+   if (io->iov != NULL)
+   {
+      return writev(io->fd, io->iov, io->iovcnt);
+   }
+
+   return write(io->fd, io->buf, io->len);
+}
+
+/*
+ * :nodoc: Wait for the port and do a single read or write. Called with the
+ * GVL released, so it must not touch any Ruby object.
+ */
+static void *blocking_io_func(ptr)
+   void *ptr;
+{
+   struct blocking_io *io = (struct blocking_io *) ptr;
+   struct pollfd pfd;
+   int rc;
+
+   io->timed_out = 0;
+
+   if (io->break_us > 0)
+   {
+      /* in the same call as the write, so it follows the break closely */
+      if (send_break(io->fd, io->break_us, io->mab_us) == -1)
+      {
+         io->result = -1;
+         io->error = errno;
+         return NULL;
+      }
+      io->break_us = 0;
+   }
+
+   pfd.fd = io->fd;
+   pfd.events = io->events;
+   pfd.revents = 0;
+
+   rc = poll(&pfd, 1, io->timeout);
+   if (rc <= 0)
+   {
+      io->result = -1;
+      io->error = errno;
+      io->timed_out = (rc == 0);
+      return NULL;
+   }
+
+   if (io->events & POLLIN)
+   {
+      io->result = read(io->fd, io->buf, io->len);
+      io->error = errno;
+      io->stamp = monotonic_ns();
+   }
+   else
+   {
+      io->result = nonblock_write(io);
+      io->error = errno;
+   }
+
+   return NULL;
+}
+
+/*
+ * :nodoc: Hand the data of a successful write to the capture of the port.
+ */
+static void capture_write(io)
+   struct blocking_io *io;
+{
+   LONG_LONG now = monotonic_ns();
+   long left = io->result, n;
+   int i;
+
+   if (io->iov == NULL)
+   {
+      sp_capture_record(io->pd, CAPTURE_TX, io->buf, left, now);
+      return;
+   }
+
+   for (i = 0; i < io->iovcnt && left > 0; i++)
+   {
+      n = (long) io->iov[i].iov_len < left ? (long) io->iov[i].iov_len : left;
+      sp_capture_record(io->pd, CAPTURE_TX, io->iov[i].iov_base, n, now);
+      left -= n;
+   }
+}
+
+/*
+ * :nodoc: Add the outcome of one blocking_io_func call to the port's
+ * counters and capture.
+ */
+static void count_io(io)
+   struct blocking_io *io;
+{
+   struct port_stats *st = &io->pd->stats;
+
+   if (io->timed_out)
+   {
+      st->timeouts++;
+   }
+   else if (io->result >= 0)
+   {
+      if (io->events & POLLIN)
+      {
+         st->reads++;
+         st->bytes_in += io->result;
+         if (io->result < io->len)
+         {
+            st->short_reads++;
+         }
+         if (io->pd->capture != NULL)
+         {
+            sp_capture_record(io->pd, CAPTURE_RX, io->buf, io->result, io->stamp);
+         }
+         if (io->pd->share != NULL)
+         {
+            sp_share_publish(io->pd, io->buf, io->result);
+         }
+      }
+      else
+      {
+         st->writes++;
+         st->bytes_out += io->result;
+         if (io->pd->capture != NULL)
+         {
+            capture_write(io);
+         }
+      }
+   }
+   else if (io->error == EAGAIN)
+   {
+      st->eagain++;
+   }
+   else if (io->error == EINTR)
+   {
+      st->eintr++;
+   }
+}
+
+#ifdef HAVE_RB_IO_WAIT
+
+/*
+ * :nodoc: do_blocking_io on a port opened with :nonblock. The read or
+ * write is tried with the GVL held, O_NONBLOCK keeps it from blocking,
+ * and the port is waited for with rb_io_wait, which hands the wait to the
+ * fiber scheduler of the thread when there is one. The deadline is kept
+ * here rather than by VMIN and VTIME.
+ */
+static void nonblock_io(io, timeout)
+   struct blocking_io *io;
+   int timeout;
+{
+   double deadline = monotonic_ms() + timeout;
+   double left;
+   VALUE wait_timeout, ready = Qfalse;
+   int events = (io->events & POLLIN ? RUBY_IO_READABLE : RUBY_IO_WRITABLE);
+
+   for (;;)
+   {
+      io->timed_out = 0;
+
+      if (io->events & POLLIN)
+      {
+         io->result = read(io->fd, io->buf, io->len);
+         io->error = errno;
+         io->stamp = monotonic_ns();
+
+         /* with VMIN and VTIME at 0 an idle tty reads 0 bytes, not EAGAIN */
+         if (io->result == 0 && !RTEST(ready))
+         {
+            io->result = -1;
+            io->error = EAGAIN;
+         }
+      }
+      else
+      {
+         io->result = nonblock_write(io);
+         io->error = errno;
+      }
+      count_io(io);
+
+      if (io->result >= 0)
+      {
+         return;
+      }
+
+      if (io->error == EINTR)
+      {
+         rb_thread_check_ints();
+         continue;
+      }
+      if (io->error != EAGAIN && io->error != EWOULDBLOCK)
+      {
+         errno = io->error;
+         rb_sys_fail(io->events & POLLIN ? "read" : "write");
+      }
+
+      wait_timeout = Qnil;
+      if (timeout >= 0)
+      {
+         left = deadline - monotonic_ms();
+         if (left <= 0)
+         {
+            io->timed_out = 1;
+            io->pd->stats.timeouts++;
+            return;
+         }
+         wait_timeout = rb_float_new(left / 1000.0);
+      }
+
+      ready = rb_io_wait(io->port, INT2NUM(events), wait_timeout);
+   }
+}
+
+#endif
+
+/*
+ * :nodoc: Run blocking_io_func until it succeeds or the deadline passes,
+ * restarting after interrupts once pending Ruby interrupts are handled.
+ */
+static void run_blocking_io(io, timeout)
+   struct blocking_io *io;
+   int timeout;
+{
+   double deadline = monotonic_ms() + timeout;
+
+#ifdef HAVE_RB_IO_WAIT
+   /* a break holds the thread anyway, blocking_io_func sends it */
+   if (io->pd->nonblock && io->break_us == 0)
+   {
+      nonblock_io(io, timeout);
+      return;
+   }
+#endif
+
+   for (;;)
+   {
+      io->timeout = (timeout < 0 ? -1 : ms_until(deadline));
+
+      sp_blocking_call(blocking_io_func, io);
+      count_io(io);
+
+      if (io->result >= 0 || io->timed_out)
+      {
+         return;
+      }
+
+      if (io->error != EINTR && io->error != EAGAIN)
+      {
+         errno = io->error;
+         rb_sys_fail(io->events & POLLIN ? "read" : "write");
+      }
+
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+}
+
+struct io_guard
+{
+   struct blocking_io *io;
+   int timeout;
+};
+
+static VALUE io_guard_body(arg)
+   VALUE arg;
+{
+   struct io_guard *g = (struct io_guard *) arg;
+
+   run_blocking_io(g->io, g->timeout);
+   return Qnil;
+}
+
+/*
+ * :nodoc: Set VMIN of the port to vmin, leaving the other settings as
+ * they are now.
+ */
+static void set_vmin(fd, vmin)
+   int fd;
+   int vmin;
+{
+   struct termios params;
+
+   if (tcgetattr(fd, &params) == 0)
+   {
+      params.c_cc[VMIN] = vmin;
+      tcsetattr(fd, TCSANOW, &params);
+   }
+}
+
+static VALUE io_guard_ensure(arg)
+   VALUE arg;
+{
+   struct io_guard *g = (struct io_guard *) arg;
+   struct port_data *pd = g->io->pd;
+   int flags;
+
+   if (g->io->events & POLLIN)
+   {
+      if (--pd->vmin_users == 0 && pd->vmin_saved > 1)
+      {
+         set_vmin(g->io->fd, pd->vmin_saved);
+      }
+   }
+   else if (--pd->nonblock_writers == 0 && pd->nonblock_set)
+   {
+      pd->nonblock_set = 0;
+      flags = fcntl(g->io->fd, F_GETFL, 0);
+      if (flags != -1)
+      {
+         fcntl(g->io->fd, F_SETFL, flags & ~O_NONBLOCK);
+      }
+   }
+   return Qnil;
+}
+
+/*
+ * :nodoc: run_blocking_io, with the port set up for the call meanwhile.
+ *
+ * Reads run with VMIN at most 1. With VTIME at 0 poll() only reports a
+ * tty readable once VMIN bytes are queued, so SerialPort#read_min_bytes
+ * would hold the native readers past their deadlines; it is meant for the
+ * IO read methods.
+ *
+ * Writes run with O_NONBLOCK set. A tty opened for blocking I/O only
+ * returns from write() once all of buf is queued, which a stalled flow
+ * control would delay past the deadline. The flag is shared by every
+ * thread using the port; IO#read and the native readers wait and retry
+ * on EAGAIN, so they are not disturbed by it.
+ *
+ * Overlapping calls share one change, undone when the last of them
+ * returns.
+ */
+static void do_blocking_io(io, timeout)
+   struct blocking_io *io;
+   int timeout;
+{
+   struct port_data *pd = io->pd;
+   struct termios params;
+   struct io_guard g;
+   int flags;
+
+   if (io->events & POLLIN)
+   {
+      if (pd->read_min_bytes <= 1)
+      {
+         run_blocking_io(io, timeout);
+         return;
+      }
+
+      if (pd->vmin_users++ == 0)
+      {
+         pd->vmin_saved = 0;
+         if (tcgetattr(io->fd, &params) == 0 && params.c_cc[VMIN] > 1)
+         {
+            pd->vmin_saved = params.c_cc[VMIN];
+            params.c_cc[VMIN] = 1;
+            tcsetattr(io->fd, TCSANOW, &params);
+         }
+      }
+   }
+   else
+   {
+      if (pd->nonblock)
+      {
+         run_blocking_io(io, timeout);
+         return;
+      }
+
+      if (pd->nonblock_writers++ == 0)
+      {
+         flags = fcntl(io->fd, F_GETFL, 0);
+         pd->nonblock_set = (flags != -1 && !(flags & O_NONBLOCK) &&
+                             fcntl(io->fd, F_SETFL, flags | O_NONBLOCK) == 0);
+      }
+   }
+
+   g.io = io;
+   g.timeout = timeout;
+   rb_ensure(io_guard_body, (VALUE) &g, io_guard_ensure, (VALUE) &g);
+}
+
+/*
+ * :nodoc: sp_read_impl on a port without a receive thread, storing when
+ * the data arrived in *stamp.
+ */
+static long direct_read(self, pd, buf, len, timeout, stamp)
+   VALUE self;
+   struct port_data *pd;
+   char *buf;
+   long len;
+   int timeout;
+   LONG_LONG *stamp;
+{
+   struct blocking_io io;
+
+   io.fd = get_fd_helper(self);
+   io.pd = pd;
+   io.port = self;
+   io.break_us = 0;
+   io.events = POLLIN;
+   io.iov = NULL;
+   io.buf = buf;
+   io.len = len;
+
+   do_blocking_io(&io, timeout);
+
+   if (io.timed_out)
+   {
+      return 0;
+   }
+
+   *stamp = io.stamp;
+
+   /* poll reported the port readable, so no data means hangup */
+   return (io.result == 0 ? -1 : io.result);
+}
+
+long sp_read_impl(self, buf, len, timeout)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout;
+{
+   struct port_data *pd = get_port_data(self);
+   LONG_LONG stamp;
+   long n;
+
+   if (pd->ring != NULL)
+   {
+      n = sp_ring_read(pd->ring, buf, len, timeout);
+      if (n == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return n;
+   }
+
+   return direct_read(self, pd, buf, len, timeout, &stamp);
+}
+
+long sp_read_stamped_impl(self, buf, len, timeout, stamps, offset)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout;
+   VALUE stamps;
+   long offset;
+{
+   struct port_data *pd = get_port_data(self);
+   LONG_LONG stamp;
+   long n;
+
+   if (pd->ring != NULL)
+   {
+      n = sp_ring_read_stamped(pd->ring, buf, len, timeout, stamps, offset);
+      if (n == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return n;
+   }
+
+   n = direct_read(self, pd, buf, len, timeout, &stamp);
+   if (n > 0)
+   {
+      sp_stamp_append(stamps, offset + n, stamp);
+   }
+
+   return n;
+}
+
+long sp_write_impl(self, buf, len, timeout)
+   VALUE self;
+   const char *buf;
+   long len;
+   int timeout;
+{
+   return sp_break_write_impl(self, buf, len, 0, 0, timeout);
+}
+
+long sp_break_write_impl(self, buf, len, break_us, mab_us, timeout)
+   VALUE self;
+   const char *buf;
+   long len;
+   long break_us, mab_us;
+   int timeout;
+{
+   struct blocking_io io;
+   long written = 0;
+   double deadline = monotonic_ms() + timeout;
+   struct port_data *pd = get_port_data(self);
+
+   io.fd = get_fd_helper(self);
+   io.pd = pd;
+   io.port = self;
+   io.break_us = break_us;
+   io.mab_us = mab_us;
+   io.events = POLLOUT;
+   io.iov = NULL;
+
+   if (len == 0 && break_us > 0)
+   {
+      sp_send_break_impl(self, break_us, mab_us);
+   }
+
+   while (written < len)
+   {
+      io.buf = (char *) buf + written;
+      io.len = len - written;
+
+      do_blocking_io(&io, timeout);
+      if (io.timed_out)
+      {
+         break;
+      }
+      written += io.result;
+
+      if (timeout >= 0)
+      {
+         timeout = ms_until(deadline);
+      }
+   }
+
+   return written;
+}
+
+/* iovecs passed to one writev() */
+#if defined(IOV_MAX) && IOV_MAX < 64
+   #define WRITEV_BATCH IOV_MAX
+#else
+   #define WRITEV_BATCH 64
+#endif
+
+long sp_writev_impl(self, strs, timeout)
+   VALUE self, strs;
+   int timeout;
+{
+   struct blocking_io io;
+   struct iovec iov[WRITEV_BATCH];
+   long i = 0, j, n = RARRAY_LEN(strs), off = 0, done, written = 0;
+   double deadline = monotonic_ms() + timeout;
+   VALUE str;
+   struct port_data *pd = get_port_data(self);
+
+   io.fd = get_fd_helper(self);
+   io.pd = pd;
+   io.port = self;
+   io.break_us = 0;
+   io.events = POLLOUT;
+   io.iov = iov;
+
+   while (i < n)
+   {
+      /* the next batch, starting off bytes into strs[i] */
+      for (j = i, io.iovcnt = 0; j < n && io.iovcnt < WRITEV_BATCH; j++, io.iovcnt++)
+      {
+         str = rb_ary_entry(strs, j);
+         iov[io.iovcnt].iov_base = RSTRING_PTR(str) + (j == i ? off : 0);
+         iov[io.iovcnt].iov_len = RSTRING_LEN(str) - (j == i ? off : 0);
+      }
+
+      do_blocking_io(&io, timeout);
+      if (io.timed_out)
+      {
+         break;
+      }
+      written += io.result;
+
+      done = off + io.result;
+      while (i < n && done >= RSTRING_LEN(rb_ary_entry(strs, i)))
+      {
+         done -= RSTRING_LEN(rb_ary_entry(strs, i));
+         i++;
+      }
+      off = done;
+
+      if (timeout >= 0)
+      {
+         timeout = ms_until(deadline);
+      }
+   }
+
+   return written;
+}
+
+long sp_read_timed_impl(self, buf, len, timeout, interval)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout, interval;
+{
+   struct blocking_io io;
+   long got = 0;
+   double deadline = monotonic_ms() + timeout;
+   int wait;
+   struct port_data *pd = get_port_data(self);
+
+   if (pd->ring != NULL)
+   {
+      got = sp_ring_read_timed(pd->ring, buf, len, timeout, interval);
+      if (got == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return got;
+   }
+
+   io.fd = get_fd_helper(self);
+   io.pd = pd;
+   io.port = self;
+   io.break_us = 0;
+   io.events = POLLIN;
+   io.iov = NULL;
+
+   while (got < len)
+   {
+      wait = (timeout < 0 ? -1 : ms_until(deadline));
+
+      /* once data flows, also stop when the line stays idle too long */
+      if (got > 0 && interval >= 0 && (wait < 0 || interval < wait))
+      {
+         wait = interval;
+      }
+
+      io.buf = buf + got;
+      io.len = len - got;
+
+      do_blocking_io(&io, wait);
+      if (io.timed_out)
+      {
+         break;
+      }
+      else if (io.result == 0)
+      {
+         if (got == 0)
+         {
+            return -1;
+         }
+         break;
+      }
+
+      got += io.result;
+   }
+
+   return got;
+}
+
+long sp_bytes_available_impl(self)
+   VALUE self;
+{
+   int n = 0;
+
+   if (ioctl(get_fd_helper(self), FIONREAD, &n) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+
+   return n;
+}
+
+/*
+ * Selector back end: epoll on Linux, kqueue on the BSDs and Mac OS X,
+ * plain poll() elsewhere.
+ */
+struct selector_wait
+{
+   long backend;
+   intptr_t *handles;
+   long n;
+   int timeout;
+   int result;
+   int error;
+#if defined(HAVE_SYS_EPOLL_H)
+   struct epoll_event *events;
+#elif defined(HAVE_SYS_EVENT_H)
+   struct kevent *events;
+#else
+   struct pollfd *fds;
+#endif
+};
+
+void sp_selector_init_impl(sel)
+   struct selector *sel;
+{
+#if defined(HAVE_SYS_EPOLL_H)
+   sel->backend = epoll_create(64);
+   if (sel->backend == -1)
+   {
+      rb_sys_fail("epoll_create");
+   }
+   fcntl(sel->backend, F_SETFD, FD_CLOEXEC);
+#elif defined(HAVE_SYS_EVENT_H)
+   sel->backend = kqueue();
+   if (sel->backend == -1)
+   {
+      rb_sys_fail("kqueue");
+   }
+   fcntl(sel->backend, F_SETFD, FD_CLOEXEC);
+#else
+   sel->backend = -1;
+#endif
+}
+
+void sp_selector_close_impl(sel)
+   struct selector *sel;
+{
+   if (sel->backend != -1)
+   {
+      close(sel->backend);
+      sel->backend = -1;
+   }
+}
+
+intptr_t sp_selector_add_impl(sel, port)
+   struct selector *sel;
+   VALUE port;
+{
+   int fd = get_fd_helper(port);
+#if defined(HAVE_SYS_EPOLL_H)
+   struct epoll_event ev;
+
+   memset(&ev, 0, sizeof(ev));
+   ev.events = EPOLLIN;
+   ev.data.fd = fd;
+   if (epoll_ctl(sel->backend, EPOLL_CTL_ADD, fd, &ev) == -1)
+   {
+      rb_sys_fail("epoll_ctl");
+   }
+#elif defined(HAVE_SYS_EVENT_H)
+   struct kevent kev;
+
+   EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+   if (kevent(sel->backend, &kev, 1, NULL, 0, NULL) == -1)
+   {
+      rb_sys_fail("kevent");
+   }
+#endif
+
+   return fd;
+}
+
+void sp_selector_remove_impl(sel, handle)
+   struct selector *sel;
+   intptr_t handle;
+{
+   /* fails harmlessly if the descriptor was closed meanwhile */
+#if defined(HAVE_SYS_EPOLL_H)
+   struct epoll_event ev;
+
+   epoll_ctl(sel->backend, EPOLL_CTL_DEL, (int) handle, &ev);
+#elif defined(HAVE_SYS_EVENT_H)
+   struct kevent kev;
+
+   EV_SET(&kev, handle, EVFILT_READ, EV_DELETE, 0, 0, 0);
+   kevent(sel->backend, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/*
+ * :nodoc: Wait for readiness, with the GVL released.
+ */
+static void *selector_wait_func(ptr)
+   void *ptr;
+{
+   struct selector_wait *w = (struct selector_wait *) ptr;
+#if defined(HAVE_SYS_EPOLL_H)
+   w->result = epoll_wait(w->backend, w->events, w->n + 1, w->timeout);
+#elif defined(HAVE_SYS_EVENT_H)
+   struct timespec ts;
+
+   ts.tv_sec = w->timeout / 1000;
+   ts.tv_nsec = (w->timeout % 1000) * 1000000L;
+   w->result = kevent(w->backend, NULL, 0, w->events, w->n + 1,
+                      w->timeout < 0 ? NULL : &ts);
+#else
+   w->result = poll(w->fds, w->n, w->timeout);
+#endif
+   w->error = errno;
+
+   return NULL;
+}
+
+static void mark_ready(w, fd, ready)
+   struct selector_wait *w;
+   intptr_t fd;
+   char *ready;
+{
+   long i;
+
+   for (i = 0; i < w->n; i++)
+   {
+      if (w->handles[i] == fd)
+      {
+         ready[i] = 1;
+      }
+   }
+}
+
+long sp_selector_event_size_impl(void)
+{
+#if defined(HAVE_SYS_EPOLL_H)
+   return sizeof(struct epoll_event);
+#elif defined(HAVE_SYS_EVENT_H)
+   return sizeof(struct kevent);
+#else
+   return sizeof(struct pollfd);
+#endif
+}
+
+long sp_selector_wait_impl(sel, handles, n, timeout, ready, events)
+   struct selector *sel;
+   intptr_t *handles;
+   long n;
+   int timeout;
+   char *ready;
+   char *events;
+{
+   struct selector_wait w;
+   double deadline = monotonic_ms() + timeout;
+   long i, count = 0;
+
+   w.backend = sel->backend;
+   w.handles = handles;
+   w.n = n;
+#if defined(HAVE_SYS_EPOLL_H)
+   w.events = (struct epoll_event *) events;
+#elif defined(HAVE_SYS_EVENT_H)
+   w.events = (struct kevent *) events;
+#else
+   w.fds = (struct pollfd *) events;
+   for (i = 0; i < n; i++)
+   {
+      w.fds[i].fd = handles[i];
+      w.fds[i].events = POLLIN;
+      w.fds[i].revents = 0;
+   }
+#endif
+
+   for (;;)
+   {
+      w.timeout = (timeout < 0 ? -1 : ms_until(deadline));
+
+      sp_blocking_call(selector_wait_func, &w);
+
+      if (w.result >= 0)
+      {
+         break;
+      }
+
+      if (w.error != EINTR)
+      {
+         errno = w.error;
+         rb_sys_fail("select");
+      }
+
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+
+#if defined(HAVE_SYS_EPOLL_H)
+   for (i = 0; i < w.result; i++)
+   {
+      mark_ready(&w, w.events[i].data.fd, ready);
+   }
+#elif defined(HAVE_SYS_EVENT_H)
+   for (i = 0; i < w.result; i++)
+   {
+      mark_ready(&w, (intptr_t) w.events[i].ident, ready);
+   }
+#else
+   for (i = 0; i < n; i++)
+   {
+      if (w.fds[i].revents)
+      {
+         ready[i] = 1;
+      }
+   }
+#endif
+
+   for (i = 0; i < n; i++)
+   {
+      count += ready[i];
+   }
+
+   return count;
+}
+
+#define SIGNAL_POLL_MS  10
+
+struct signal_wait
+{
+   int fd;
+   int mask;            /* LINE_* bits to watch */
+   int timeout;
+   int use_miwait;      /* sleep in TIOCMIWAIT instead of polling */
+   int expired;         /* the timer of timed_miwait ended the wait */
+   int changed;
+   int error;
+   int start_lines;
+#ifdef TIOCGICOUNT
+   int have_icount;
+   struct serial_icounter_struct start;
+#endif
+};
+
+/*
+ * :nodoc: The watched lines that changed since the wait started, or -1
+ * with errno set. The counters also catch pulses, such as a ring, that
+ * are over by the time we look.
+ */
+static int line_changes(w)
+   struct signal_wait *w;
+{
+   int status, changed;
+#ifdef TIOCGICOUNT
+   struct serial_icounter_struct now;
+
+   if (w->have_icount)
+   {
+      if (ioctl(w->fd, TIOCGICOUNT, &now) == -1)
+      {
+         return -1;
+      }
+
+      changed = (now.cts != w->start.cts ? LINE_CTS : 0) |
+                (now.dsr != w->start.dsr ? LINE_DSR : 0) |
+                (now.dcd != w->start.dcd ? LINE_DCD : 0) |
+                (now.rng != w->start.rng ? LINE_RI : 0);
+      return changed & w->mask;
+   }
+#endif
+
+   if (ioctl(w->fd, TIOCMGET, &status) == -1)
+   {
+      return -1;
+   }
+
+   return (tiocm_to_lines(status) ^ w->start_lines) & w->mask;
+}
+
+#if defined(TIOCMIWAIT) && defined(SIGVTALRM)
+
+#define HAVE_TIMED_MIWAIT
+
+struct miwait_timer
+{
+   pthread_t waiter;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   struct timespec until;
+   int done;
+   int expired;
+};
+
+/*
+ * :nodoc: Whether a SIGVTALRM sent to a thread ends its TIOCMIWAIT with
+ * EINTR. Ruby's handler, which its own unblocking function relies on, is
+ * installed without SA_RESTART.
+ */
+static int miwait_can_expire(void)
+{
+   struct sigaction sa;
+
+   return (sigaction(SIGVTALRM, NULL, &sa) == 0 && !(sa.sa_flags & SA_RESTART) &&
+           sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN);
+}
+
+/*
+ * :nodoc: Interrupt the waiter once the deadline has passed. The signal
+ * is repeated until the waiter is done, as the first one may come before
+ * it has entered the ioctl.
+ */
+static void *miwait_timer_func(ptr)
+   void *ptr;
+{
+   struct miwait_timer *t = (struct miwait_timer *) ptr;
+
+   pthread_mutex_lock(&t->lock);
+   while (!t->done)
+   {
+      if (pthread_cond_timedwait(&t->cond, &t->lock, &t->until) == ETIMEDOUT)
+      {
+         t->expired = 1;
+         pthread_kill(t->waiter, SIGVTALRM);
+         timespec_in(1, &t->until);
+      }
+   }
+   pthread_mutex_unlock(&t->lock);
+
+   return NULL;
+}
+
+/*
+ * :nodoc: TIOCMIWAIT ended by a timer thread after w->timeout
+ * milliseconds, setting w->expired.
+ */
+static int timed_miwait(w, bits)
+   struct signal_wait *w;
+   int bits;
+{
+   struct miwait_timer t;
+   pthread_t thread;
+   int rc, err;
+
+   t.waiter = pthread_self();
+   t.done = 0;
+   t.expired = 0;
+   timespec_in(w->timeout, &t.until);
+   pthread_mutex_init(&t.lock, NULL);
+   pthread_cond_init(&t.cond, NULL);
+
+   err = pthread_create(&thread, NULL, miwait_timer_func, &t);
+   if (err != 0)
+   {
+      pthread_mutex_destroy(&t.lock);
+      pthread_cond_destroy(&t.cond);
+      errno = err;
+      return -1;
+   }
+
+   rc = ioctl(w->fd, TIOCMIWAIT, bits);
+   err = errno;
+
+   pthread_mutex_lock(&t.lock);
+   t.done = 1;
+   pthread_cond_signal(&t.cond);
+   pthread_mutex_unlock(&t.lock);
+   pthread_join(thread, NULL);
+   pthread_mutex_destroy(&t.lock);
+   pthread_cond_destroy(&t.cond);
+
+   w->expired = t.expired;
+   errno = err;
+   return rc;
+}
+
+#endif
+
+/*
+ * :nodoc: Wait for a line change, with the GVL released. Interrupts end
+ * the wait with EINTR.
+ */
+static void *signal_wait_func(ptr)
+   void *ptr;
+{
+   struct signal_wait *w = (struct signal_wait *) ptr;
+   double deadline = monotonic_ms() + w->timeout;
+   struct timespec ts;
+   int left;
+
+   w->changed = 0;
+   w->error = 0;
+
+#ifdef TIOCMIWAIT
+   if (w->use_miwait)
+   {
+      int bits = (w->mask & LINE_CTS ? TIOCM_CTS : 0) |
+                 (w->mask & LINE_DSR ? TIOCM_DSR : 0) |
+                 (w->mask & LINE_DCD ? TIOCM_CD : 0) |
+                 (w->mask & LINE_RI ? TIOCM_RNG : 0);
+      int rc;
+
+      w->expired = 0;
+#ifdef HAVE_TIMED_MIWAIT
+      if (w->timeout >= 0)
+      {
+         rc = (w->timeout > 0 ? timed_miwait(w, bits) : 0);
+      }
+      else
+#endif
+      {
+         rc = ioctl(w->fd, TIOCMIWAIT, bits);
+      }
+
+      if (rc == -1 && !(errno == EINTR && w->expired))
+      {
+         w->error = errno;
+         return NULL;
+      }
+
+      w->changed = line_changes(w);
+      if (w->changed == 0 && (w->expired || w->timeout == 0))
+      {
+         /* timed out */
+         return NULL;
+      }
+      else if (w->changed == 0)
+      {
+         /* the driver saw a change that is already undone */
+         w->changed = w->mask;
+      }
+      else if (w->changed < 0)
+      {
+         w->error = errno;
+         w->changed = 0;
+      }
+      return NULL;
+   }
+#endif
+
+   for (;;)
+   {
+      w->changed = line_changes(w);
+      if (w->changed != 0)
+      {
+         if (w->changed < 0)
+         {
+            w->error = errno;
+            w->changed = 0;
+         }
+         return NULL;
+      }
+
+      left = (w->timeout < 0 ? SIGNAL_POLL_MS : ms_until(deadline));
+      if (left == 0)
+      {
+         return NULL;
+      }
+
+      ts.tv_sec = 0;
+      ts.tv_nsec = (left < SIGNAL_POLL_MS ? left : SIGNAL_POLL_MS) * 1000000L;
+      if (nanosleep(&ts, NULL) == -1 && errno == EINTR)
+      {
+         w->error = EINTR;
+         return NULL;
+      }
+   }
+}
+
+int sp_wait_signal_change_impl(self, mask, timeout)
+   VALUE self;
+   int mask, timeout;
+{
+   struct signal_wait w;
+   double deadline = monotonic_ms() + timeout;
+   int status;
+
+   w.fd = get_fd_helper(self);
+   w.mask = mask;
+#ifdef HAVE_TIMED_MIWAIT
+   w.use_miwait = (timeout < 0 || miwait_can_expire());
+#else
+   w.use_miwait = (timeout < 0);
+#endif
+
+   if (ioctl(w.fd, TIOCMGET, &status) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+   w.start_lines = tiocm_to_lines(status);
+#ifdef TIOCGICOUNT
+   w.have_icount = (ioctl(w.fd, TIOCGICOUNT, &w.start) == 0);
+#endif
+
+   for (;;)
+   {
+      w.timeout = (timeout < 0 ? -1 : ms_until(deadline));
+
+      sp_blocking_call(signal_wait_func, &w);
+
+      if (w.changed)
+      {
+         return w.changed;
+      }
+
+      if (w.error == EINTR)
+      {
+#ifdef RUBY_1_9
+         rb_thread_check_ints();
+#endif
+         continue;
+      }
+
+      if (w.error != 0 && w.use_miwait)
+      {
+         /* the driver can't wait for line changes, poll instead */
+         w.use_miwait = 0;
+         continue;
+      }
+
+      if (w.error != 0)
+      {
+         errno = w.error;
+         rb_sys_fail(sIoctl);
+      }
+
+      return 0;
+   }
+}
+
+#if defined(TIOCGICOUNT)
+
+VALUE sp_get_line_counters_impl(self)
+   VALUE self;
+{
+   struct serial_icounter_struct ic;
+   VALUE hash;
+
+   if (ioctl(get_fd_helper(self), TIOCGICOUNT, &ic) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+
+   hash = rb_hash_new();
+   rb_hash_aset(hash, sCts, INT2NUM(ic.cts));
+   rb_hash_aset(hash, sDsr, INT2NUM(ic.dsr));
+   rb_hash_aset(hash, sDcd, INT2NUM(ic.dcd));
+   rb_hash_aset(hash, sRi, INT2NUM(ic.rng));
+   rb_hash_aset(hash, rb_str_new2("rx"), INT2NUM(ic.rx));
+   rb_hash_aset(hash, rb_str_new2("tx"), INT2NUM(ic.tx));
+   rb_hash_aset(hash, rb_str_new2("frame"), INT2NUM(ic.frame));
+   rb_hash_aset(hash, rb_str_new2("overrun"), INT2NUM(ic.overrun));
+   rb_hash_aset(hash, rb_str_new2("parity"), INT2NUM(ic.parity));
+   rb_hash_aset(hash, rb_str_new2("break"), INT2NUM(ic.brk));
+   rb_hash_aset(hash, rb_str_new2("buf_overrun"), INT2NUM(ic.buf_overrun));
+
+   return hash;
+}
+
+int sp_get_line_errors_impl(self, st)
+   VALUE self;
+   struct port_stats *st;
+{
+   struct serial_icounter_struct ic;
+
+   if (ioctl(get_fd_helper(self), TIOCGICOUNT, &ic) == -1)
+   {
+      return 0;
+   }
+
+   st->frame = ic.frame;
+   st->parity = ic.parity;
+   st->overrun = ic.overrun + ic.buf_overrun;
+   return 1;
+}
+
+#else
+
+VALUE sp_get_line_counters_impl(self)
+   VALUE self;
+{
+   rb_notimplement();
+   return self;
+}
+
+int sp_get_line_errors_impl(self, st)
+   VALUE self;
+   struct port_stats *st;
+{
+   return 0;
+}
+
+#endif
+
+long sp_output_queue_impl(self)
+   VALUE self;
+{
+#ifdef TIOCOUTQ
+   int n;
+
+   if (ioctl(get_fd_helper(self), TIOCOUTQ, &n) == -1)
+   {
+      rb_sys_fail(sIoctl);
+   }
+
+   return n;
+#else
+   rb_notimplement();
+   return 0;
+#endif
+}
+
+#define DRAIN_POLL_MS  2
+
+struct drain_wait
+{
+   int fd;
+   int timeout;
+   int done;
+   int error;
+};
+
+/*
+ * :nodoc: tcdrain() with the GVL released. tcdrain has no timeout, so
+ * with one the output queue is polled until it empties and tcdrain only
+ * waits for the last bytes in the UART.
+ */
+static void *drain_func(ptr)
+   void *ptr;
+{
+   struct drain_wait *w = (struct drain_wait *) ptr;
+   double deadline = monotonic_ms() + w->timeout;
+   struct timespec ts;
+   int queued, left;
+
+   w->done = 0;
+   w->error = 0;
+
+#ifdef TIOCOUTQ
+   while (w->timeout >= 0)
+   {
+      if (ioctl(w->fd, TIOCOUTQ, &queued) == -1)
+      {
+         w->error = errno;
+         return NULL;
+      }
+      if (queued == 0)
+      {
+         break;
+      }
+
+      left = ms_until(deadline);
+      if (left == 0)
+      {
+         return NULL;
+      }
+
+      ts.tv_sec = 0;
+      ts.tv_nsec = (left < DRAIN_POLL_MS ? left : DRAIN_POLL_MS) * 1000000L;
+      if (nanosleep(&ts, NULL) == -1 && errno == EINTR)
+      {
+         w->error = EINTR;
+         return NULL;
+      }
+   }
+#endif
+
+   if (tcdrain(w->fd) == -1)
+   {
+      w->error = errno;
+      return NULL;
+   }
+
+   w->done = 1;
+   return NULL;
+}
+
+int sp_drain_impl(self, timeout)
+   VALUE self;
+   int timeout;
+{
+   struct drain_wait w;
+   double deadline = monotonic_ms() + timeout;
+
+   w.fd = get_fd_helper(self);
+
+#ifndef TIOCOUTQ
+   if (timeout >= 0)
+   {
+      rb_notimplement();
+   }
+#endif
+
+   for (;;)
+   {
+      w.timeout = (timeout < 0 ? -1 : ms_until(deadline));
+
+      sp_blocking_call(drain_func, &w);
+
+      if (w.error == EINTR)
+      {
+#ifdef RUBY_1_9
+         rb_thread_check_ints();
+#endif
+         continue;
+      }
+      if (w.error != 0)
+      {
+         errno = w.error;
+         rb_sys_fail("tcdrain");
+      }
+
+      return w.done;
+   }
+}
+
+void sp_flush_impl(self, input, output)
+   VALUE self;
+   int input, output;
+{
+   int queue = (input && output ? TCIOFLUSH : (input ? TCIFLUSH : TCOFLUSH));
+
+   if (tcflush(get_fd_helper(self), queue) == -1)
+   {
+      rb_sys_fail("tcflush");
+   }
+}
+
+double sp_monotonic_ms_impl(void)
+{
+   return monotonic_ms();
+}
+
+LONG_LONG sp_monotonic_ns_impl(void)
+{
+   return monotonic_ns();
+}
+
+/*
+ * Receive thread: drains the port into the ring as soon as data arrives.
+ * It only reads what FIONREAD reports as queued, so VMIN and VTIME never
+ * hold up a read and the port's flags are left alone. A pipe wakes it up
+ * to exit, or once Ruby has made room in a full ring. The thread reads a
+ * dup() of the descriptor, closed once it has exited, so a port that is
+ * garbage collected without SerialPort#close never has its descriptor
+ * number reused under the thread.
+ */
+struct rx_thread
+{
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int fd;
+   int wake[2];
+};
+
+struct ring_wait
+{
+   struct rx_ring *ring;
+   int timeout;
+   int interrupted;
+};
+
+/*
+ * :nodoc: Wake Ruby if it waits for data.
+ */
+static void rx_notify(ring)
+   struct rx_ring *ring;
+{
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+
+   SP_MEMORY_BARRIER();
+   if (ring->waiting)
+   {
+      pthread_mutex_lock(&t->lock);
+      pthread_cond_broadcast(&t->cond);
+      pthread_mutex_unlock(&t->lock);
+   }
+}
+
+/*
+ * :nodoc: Empty the wake pipe, which poll() has reported readable.
+ */
+static void rx_drain_wake(t)
+   struct rx_thread *t;
+{
+   char buf[16];
+   ssize_t rc;
+
+   rc = read(t->wake[0], buf, sizeof(buf));
+   (void) rc;
+}
+
+static void *rx_thread_func(ptr)
+   void *ptr;
+{
+   struct rx_ring *ring = (struct rx_ring *) ptr;
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   struct pollfd pfd[2];
+   unsigned long head, space, off;
+   ssize_t n;
+   int queued;
+
+   pfd[0].fd = t->fd;
+   pfd[0].events = POLLIN;
+   pfd[1].fd = t->wake[0];
+   pfd[1].events = POLLIN;
+
+   while (!ring->stop)
+   {
+      head = ring->head;
+      space = ring->mask + 1 - (head - ring->tail);
+      if (space == 0)
+      {
+         /*
+          * Full, leave the data to the driver until Ruby catches up. Once
+          * full is seen, taking data out of the ring writes to the pipe.
+          */
+         ring->full = 1;
+         SP_MEMORY_BARRIER();
+         if (ring->head == ring->tail + ring->mask + 1 && !ring->stop)
+         {
+            pfd[1].revents = 0;
+            if (poll(pfd + 1, 1, -1) > 0)
+            {
+               rx_drain_wake(t);
+            }
+         }
+         ring->full = 0;
+         continue;
+      }
+
+      pfd[0].revents = 0;
+      pfd[1].revents = 0;
+      if (poll(pfd, 2, -1) < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         ring->error = errno;
+         break;
+      }
+      if (pfd[1].revents)
+      {
+         rx_drain_wake(t);
+         continue;
+      }
+
+      off = head & ring->mask;
+      if (space > ring->mask + 1 - off)
+      {
+         space = ring->mask + 1 - off;
+      }
+
+      /*
+       * Read no more than is queued, so the read returns at once. With
+       * nothing queued the port hung up or failed, and a one byte read
+       * returns the end of file or the error.
+       */
+      if (ioctl(t->fd, FIONREAD, &queued) == 0)
+      {
+         if (queued == 0 && !(pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+         {
+            continue;
+         }
+         if ((unsigned long) queued < space)
+         {
+            space = (queued > 0 ? queued : 1);
+         }
+      }
+
+      n = read(t->fd, ring->buf + off, space);
+      if (n > 0)
+      {
+         ring->reads++;
+         sp_ring_stamp(ring, head + n, monotonic_ns());
+         SP_MEMORY_BARRIER();
+         ring->head = head + n;
+         rx_notify(ring);
+      }
+      else if (n == 0)
+      {
+         ring->eof = 1;
+         break;
+      }
+      else if (errno != EINTR && errno != EAGAIN)
+      {
+         ring->error = errno;
+         break;
+      }
+   }
+
+   rx_notify(ring);
+   return NULL;
+}
+
+void sp_rx_thread_start_impl(self, ring)
+   VALUE self;
+   struct rx_ring *ring;
+{
+   struct rx_thread *t;
+   int err;
+
+   t = ALLOC(struct rx_thread);
+   t->fd = dup(get_fd_helper(self));
+   if (t->fd == -1)
+   {
+      err = errno;
+      xfree(t);
+      sp_ring_free(ring);
+      errno = err;
+      rb_sys_fail("dup");
+   }
+   if (pipe(t->wake) == -1)
+   {
+      err = errno;
+      close(t->fd);
+      xfree(t);
+      sp_ring_free(ring);
+      errno = err;
+      rb_sys_fail("pipe");
+   }
+
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->cond, NULL);
+   ring->impl = t;
+
+   err = pthread_create(&t->thread, NULL, rx_thread_func, ring);
+   if (err != 0)
+   {
+      close(t->fd);
+      close(t->wake[0]);
+      close(t->wake[1]);
+      pthread_mutex_destroy(&t->lock);
+      pthread_cond_destroy(&t->cond);
+      xfree(t);
+      sp_ring_free(ring);
+      errno = err;
+      rb_sys_fail("pthread_create");
+   }
+}
+
+void sp_rx_thread_stop_impl(ring, port_open)
+   struct rx_ring *ring;
+   int port_open;
+{
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   ssize_t rc;
+
+   ring->stop = 1;
+   SP_MEMORY_BARRIER();
+   rc = write(t->wake[1], "", 1);
+   pthread_join(t->thread, NULL);
+
+   close(t->fd);
+   close(t->wake[0]);
+   close(t->wake[1]);
+   pthread_mutex_destroy(&t->lock);
+   pthread_cond_destroy(&t->cond);
+   xfree(t);
+   (void) rc;
+   (void) port_open;
+}
+
+void sp_rx_thread_space_impl(ring)
+   struct rx_ring *ring;
+{
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   ssize_t rc;
+
+   rc = write(t->wake[1], "", 1);
+   (void) rc;
+}
+
+/*
+ * :nodoc: Wait for the receive thread, with the GVL released.
+ */
+static void *ring_wait_func(ptr)
+   void *ptr;
+{
+   struct ring_wait *w = (struct ring_wait *) ptr;
+   struct rx_ring *ring = w->ring;
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   struct timespec until;
+
+   if (w->timeout >= 0)
+   {
+      timespec_in(w->timeout, &until);
+   }
+
+   pthread_mutex_lock(&t->lock);
+   ring->waiting = 1;
+   SP_MEMORY_BARRIER();
+   while (ring->head == ring->tail && !ring->eof && !ring->error && !w->interrupted)
+   {
+      if (w->timeout < 0)
+      {
+         pthread_cond_wait(&t->cond, &t->lock);
+      }
+      else if (pthread_cond_timedwait(&t->cond, &t->lock, &until) == ETIMEDOUT)
+      {
+         break;
+      }
+   }
+   ring->waiting = 0;
+   pthread_mutex_unlock(&t->lock);
+
+   return NULL;
+}
+
+static void ring_wait_ubf(ptr)
+   void *ptr;
+{
+   struct ring_wait *w = (struct ring_wait *) ptr;
+   struct rx_thread *t = (struct rx_thread *) w->ring->impl;
+
+   pthread_mutex_lock(&t->lock);
+   w->interrupted = 1;
+   pthread_cond_broadcast(&t->cond);
+   pthread_mutex_unlock(&t->lock);
+}
+
+int sp_ring_wait_impl(ring, timeout)
+   struct rx_ring *ring;
+   int timeout;
+{
+   struct ring_wait w;
+   double deadline = monotonic_ms() + timeout;
+
+   w.ring = ring;
+   for (;;)
+   {
+      if (ring->head != ring->tail || ring->eof)
+      {
+         return 1;
+      }
+      if (ring->error)
+      {
+         errno = ring->error;
+         rb_sys_fail("read");
+      }
+
+      w.timeout = (timeout < 0 ? -1 : ms_until(deadline));
+      if (w.timeout == 0)
+      {
+         return 0;
+      }
+      w.interrupted = 0;
+
+      sp_blocking_call_ubf(ring_wait_func, &w, ring_wait_ubf, &w);
+
+#ifdef RUBY_1_9
+      if (w.interrupted)
+      {
+         rb_thread_check_ints();
+      }
+#endif
+   }
+}
+
+/*
+ * Port enumeration for SerialPort.list: sysfs on Linux, IOKit on Mac OS
+ * X, the device names in /dev elsewhere. No port is opened.
+ */
+static VALUE new_port_entry(path)
+   const char *path;
+{
+   VALUE hash = rb_hash_new();
+
+   rb_hash_aset(hash, rb_str_new2("path"), rb_str_new2(path));
+   rb_hash_aset(hash, rb_str_new2("description"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("manufacturer"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("serial_number"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("vid"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("pid"), Qnil);
+
+   return hash;
+}
+
+#if defined(OS_LINUX)
+
+#define SYSFS_TTY "/sys/class/tty"
+
+/*
+ * :nodoc: First line of the sysfs attribute dir/name, nil if absent.
+ */
+static VALUE sysfs_attr(dir, name)
+   const char *dir, *name;
+{
+   char path[PATH_MAX], buf[256];
+   FILE *fp;
+   size_t n;
+
+   snprintf(path, sizeof(path), "%s/%s", dir, name);
+   fp = fopen(path, "r");
+   if (fp == NULL)
+   {
+      return Qnil;
+   }
+   n = fread(buf, 1, sizeof(buf) - 1, fp);
+   fclose(fp);
+
+   buf[n] = '\0';
+   buf[strcspn(buf, "\n")] = '\0';
+
+   return buf[0] == '\0' ? Qnil : rb_str_new2(buf);
+}
+
+static VALUE sysfs_hex_attr(dir, name)
+   const char *dir, *name;
+{
+   VALUE str = sysfs_attr(dir, name);
+
+   return NIL_P(str) ? Qnil : INT2FIX(strtol(RSTRING_PTR(str), NULL, 16));
+}
+
+/*
+ * :nodoc: Fill in the USB attributes of a tty whose device is dev, found
+ * in the first parent directory with an idVendor.
+ */
+static void usb_attrs(hash, dev)
+   VALUE hash;
+   const char *dev;
+{
+   char dir[PATH_MAX], *slash;
+
+   snprintf(dir, sizeof(dir), "%s", dev);
+   while ((slash = strrchr(dir, '/')) != NULL && slash != dir)
+   {
+      *slash = '\0';
+      if (!NIL_P(sysfs_attr(dir, "idVendor")))
+      {
+         rb_hash_aset(hash, rb_str_new2("vid"), sysfs_hex_attr(dir, "idVendor"));
+         rb_hash_aset(hash, rb_str_new2("pid"), sysfs_hex_attr(dir, "idProduct"));
+         rb_hash_aset(hash, rb_str_new2("serial_number"), sysfs_attr(dir, "serial"));
+         rb_hash_aset(hash, rb_str_new2("manufacturer"), sysfs_attr(dir, "manufacturer"));
+         rb_hash_aset(hash, rb_str_new2("description"), sysfs_attr(dir, "product"));
+         return;
+      }
+   }
+}
+
+VALUE sp_list_impl(void)
+{
+   VALUE ports = rb_ary_new();
+   char path[PATH_MAX], dev[PATH_MAX], *base, *p;
+   struct dirent *entry;
+   DIR *dir;
+   VALUE hash;
+
+   dir = opendir(SYSFS_TTY);
+   if (dir == NULL)
+   {
+      return ports;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      if (entry->d_name[0] == '.')
+      {
+         continue;
+      }
+
+      /* consoles and pseudo terminals have no device */
+      snprintf(path, sizeof(path), SYSFS_TTY "/%s/device", entry->d_name);
+      if (realpath(path, dev) == NULL)
+      {
+         continue;
+      }
+
+      /* the 8250 driver registers placeholders for absent legacy ports */
+      base = strrchr(dev, '/');
+      if (base != NULL && strcmp(base + 1, "serial8250") == 0)
+      {
+         continue;
+      }
+
+      /* sysfs writes the / of names in subdirectories of /dev as ! */
+      snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+      for (p = path; *p != '\0'; p++)
+      {
+         if (*p == '!')
+         {
+            *p = '/';
+         }
+      }
+
+      hash = new_port_entry(path);
+      usb_attrs(hash, dev);
+      rb_ary_push(ports, hash);
+   }
+   closedir(dir);
+
+   return ports;
+}
+
+#elif defined(OS_DARWIN) && defined(HAVE_IOKIT_IOKITLIB_H)
+
+static VALUE cf_to_value(ref)
+   CFTypeRef ref;
+{
+   char buf[1024];
+   SInt32 n;
+   VALUE val = Qnil;
+
+   if (ref == NULL)
+   {
+      return Qnil;
+   }
+
+   if (CFGetTypeID(ref) == CFStringGetTypeID() &&
+       CFStringGetCString((CFStringRef) ref, buf, sizeof(buf), kCFStringEncodingUTF8))
+   {
+      val = rb_str_new2(buf);
+   }
+   else if (CFGetTypeID(ref) == CFNumberGetTypeID() &&
+            CFNumberGetValue((CFNumberRef) ref, kCFNumberSInt32Type, &n))
+   {
+      val = INT2FIX(n);
+   }
+
+   CFRelease(ref);
+   return val;
+}
+
+/*
+ * :nodoc: A property of the USB device a serial service belongs to, nil
+ * if it isn't one.
+ */
+static VALUE usb_property(service, key)
+   io_object_t service;
+   const char *key;
+{
+   CFStringRef name = CFStringCreateWithCString(kCFAllocatorDefault, key,
+                                                kCFStringEncodingUTF8);
+   CFTypeRef ref;
+
+   ref = IORegistryEntrySearchCFProperty(service, kIOServicePlane, name,
+                                         kCFAllocatorDefault,
+                                         kIORegistryIterateRecursively |
+                                         kIORegistryIterateParents);
+   CFRelease(name);
+
+   return cf_to_value(ref);
+}
+
+VALUE sp_list_impl(void)
+{
+   VALUE ports = rb_ary_new();
+   CFMutableDictionaryRef match;
+   io_iterator_t iter;
+   io_object_t service;
+   VALUE path, hash;
+
+   match = IOServiceMatching(kIOSerialBSDServiceValue);
+   if (match == NULL ||
+       IOServiceGetMatchingServices(MACH_PORT_NULL, match, &iter) != KERN_SUCCESS)
+   {
+      return ports;
+   }
+
+   while ((service = IOIteratorNext(iter)) != 0)
+   {
+      /* the cu.* device, which doesn't wait for carrier on open */
+      path = cf_to_value(IORegistryEntryCreateCFProperty(service,
+                            CFSTR(kIOCalloutDeviceKey), kCFAllocatorDefault, 0));
+      if (!NIL_P(path))
+      {
+         hash = new_port_entry(RSTRING_PTR(path));
+         rb_hash_aset(hash, rb_str_new2("vid"), usb_property(service, "idVendor"));
+         rb_hash_aset(hash, rb_str_new2("pid"), usb_property(service, "idProduct"));
+         rb_hash_aset(hash, rb_str_new2("serial_number"),
+                      usb_property(service, "USB Serial Number"));
+         rb_hash_aset(hash, rb_str_new2("manufacturer"),
+                      usb_property(service, "USB Vendor Name"));
+         rb_hash_aset(hash, rb_str_new2("description"),
+                      usb_property(service, "USB Product Name"));
+         rb_ary_push(ports, hash);
+      }
+      IOObjectRelease(service);
+   }
+   IOObjectRelease(iter);
+
+   return ports;
+}
+
+#else
+
+/* names of serial devices in /dev, the BSDs' call-out devices first */
+static const char *dev_prefixes[] = { "cuaU", "cuau", "cuaa", "cu.", "ttyU", NULL };
+
+VALUE sp_list_impl(void)
+{
+   VALUE ports = rb_ary_new();
+   char path[PATH_MAX];
+   struct dirent *entry;
+   DIR *dir;
+   const char *name, *dot;
+   int i;
+
+   dir = opendir("/dev");
+   if (dir == NULL)
+   {
+      return ports;
+   }
+
+   while ((entry = readdir(dir)) != NULL)
+   {
+      name = entry->d_name;
+      for (i = 0; dev_prefixes[i] != NULL; i++)
+      {
+         if (strncmp(name, dev_prefixes[i], strlen(dev_prefixes[i])) == 0)
+         {
+            break;
+         }
+      }
+
+      /* skip the .init and .lock state devices of FreeBSD */
+      dot = strrchr(name, '.');
+      if (dev_prefixes[i] == NULL ||
+          (dot != NULL && (strcmp(dot, ".init") == 0 || strcmp(dot, ".lock") == 0)))
+      {
+         continue;
+      }
+
+      snprintf(path, sizeof(path), "/dev/%s", name);
+      rb_ary_push(ports, new_port_entry(path));
+   }
+   closedir(dir);
+
+   return ports;
+}
+
+#endif
+
+/* the segment of a share, kept open (and locked) by its owner */
+struct shm_file
+{
+   int fd;
+   dev_t dev;
+   ino_t ino;
+};
+
+/*
+ * :nodoc: Remove the file at name if it is a shared memory segment left
+ * by an earlier SerialPort#share whose owner is gone. A segment still
+ * locked by its owner raises IOError; anything else there fails with
+ * EEXIST, so a mistyped name can't delete an unrelated file.
+ */
+static void remove_old_share(name)
+   const char *name;
+{
+   char magic[8];
+   struct stat st, now;
+   int fd, old, busy = 0;
+
+#ifdef O_NOFOLLOW
+   fd = open(name, O_RDONLY | O_NOFOLLOW);
+#else
+   fd = open(name, O_RDONLY);
+#endif
+   if (fd == -1)
+   {
+      if (errno == ENOENT)
+      {
+         return;
+      }
+      if (errno != ELOOP)
+      {
+         rb_sys_fail(name);
+      }
+      /* a symbolic link, never a segment */
+      errno = EEXIST;
+      rb_sys_fail(name);
+   }
+
+   old = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+          read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+          memcmp(magic, SP_SHARE_MAGIC, sizeof(magic)) == 0);
+#ifdef LOCK_EX
+   busy = (old && flock(fd, LOCK_EX | LOCK_NB) == -1);
+#endif
+
+   if (!old)
+   {
+      close(fd);
+      errno = EEXIST;
+      rb_sys_fail(name);
+   }
+   if (busy)
+   {
+      close(fd);
+      rb_raise(rb_eIOError, "shared memory %s is still in use", name);
+   }
+
+   /* only the file checked above, not one put there meanwhile */
+   if (stat(name, &now) == 0 && now.st_dev == st.st_dev && now.st_ino == st.st_ino &&
+       unlink(name) == -1 && errno != ENOENT)
+   {
+      close(fd);
+      rb_sys_fail(name);
+   }
+   close(fd);
+}
+
+/*
+ * Shared memory is a file, which on Linux is best put in /dev/shm. Each
+ * SerialPort#share creates a new one, so readers still mapping the file
+ * of an earlier owner keep it intact instead of faulting on a truncated
+ * mapping. The owner keeps the file open with an exclusive flock() until
+ * it closes the share, so another process can tell a live segment from
+ * a stale one.
+ */
+char *sp_shm_create_impl(name, size, impl)
+   const char *name;
+   unsigned long size;
+   void **impl;
+{
+   struct shm_file *file;
+   struct stat st;
+   void *addr;
+   int fd, err;
+
+   remove_old_share(name);
+
+   fd = open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+   if (fd == -1)
+   {
+      rb_sys_fail(name);
+   }
+
+   addr = MAP_FAILED;
+   if (fstat(fd, &st) == 0 &&
+#ifdef LOCK_EX
+       flock(fd, LOCK_EX | LOCK_NB) == 0 &&
+#endif
+       ftruncate(fd, (off_t) size) == 0)
+   {
+      addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   }
+
+   if (addr == MAP_FAILED)
+   {
+      err = errno;
+      unlink(name);
+      close(fd);
+      errno = err;
+      rb_sys_fail(name);
+   }
+
+   file = ALLOC(struct shm_file);
+   file->fd = fd;
+   file->dev = st.st_dev;
+   file->ino = st.st_ino;
+   *impl = file;
+   return (char *) addr;
+}
+
+char *sp_shm_open_impl(name, size, impl)
+   const char *name;
+   unsigned long *size;
+   void **impl;
+{
+   struct stat st;
+   void *addr;
+   int fd, err;
+
+   fd = open(name, O_RDONLY);
+   if (fd == -1)
+   {
+      rb_sys_fail(name);
+   }
+
+   addr = MAP_FAILED;
+   if (fstat(fd, &st) == 0)
+   {
+      if (st.st_size == 0)
+      {
+         /* mmap refuses empty files */
+         close(fd);
+         rb_raise(rb_eArgError, "not a shared serial port: %s", name);
+      }
+      addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   err = errno;
+   close(fd);
+
+   if (addr == MAP_FAILED)
+   {
+      errno = err;
+      rb_sys_fail(name);
+   }
+
+   *size = (unsigned long) st.st_size;
+   *impl = NULL;
+   return (char *) addr;
+}
+
+void sp_shm_close_impl(name, addr, size, impl, owner)
+   const char *name;
+   char *addr;
+   unsigned long size;
+   void *impl;
+   int owner;
+{
+   struct shm_file *file = (struct shm_file *) impl;
+   struct stat st;
+
+   munmap(addr, size);
+   if (owner && file != NULL)
+   {
+      /* the path may name another segment by now, leave that one alone */
+      if (stat(name, &st) == 0 && st.st_dev == file->dev && st.st_ino == file->ino)
+      {
+         unlink(name);
+      }
+      close(file->fd);
+      xfree(file);
+   }
+}
+
 #endif /* !defined(OS_MSWIN) && !defined(OS_BCCWIN) && !defined(OS_MINGW) */
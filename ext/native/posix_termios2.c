@@ -0,0 +1,80 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Arbitrary baud rates on Linux through termios2 and BOTHER. The kernel's
+ * termios headers clash with the C library's <termios.h>, so this lives
+ * in its own file, apart from posix_serialport_impl.c.
+ */
+
+#if defined(OS_LINUX) && defined(HAVE_ASM_TERMBITS_H)
+
+#include <asm/termbits.h>
+#include <asm/ioctls.h>
+#include <errno.h>
+
+extern int ioctl(int fd, unsigned long request, ...);
+
+#if defined(TCGETS2) && defined(TCSETS2) && defined(BOTHER)
+
+/*
+ * :nodoc: Set fd to exactly baud bits per second in both directions.
+ * Returns 0 on success, -1 with errno set otherwise.
+ */
+int sp_set_termios2_speed(fd, baud)
+   int fd, baud;
+{
+   struct termios2 tio;
+
+   if (ioctl(fd, TCGETS2, &tio) == -1)
+   {
+      return -1;
+   }
+
+   tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+   tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+   tio.c_ispeed = baud;
+   tio.c_ospeed = baud;
+
+   return ioctl(fd, TCSETS2, &tio);
+}
+
+/*
+ * :nodoc: The output speed of fd in bits per second, 0 if unknown.
+ */
+int sp_get_termios2_speed(fd)
+   int fd;
+{
+   struct termios2 tio;
+
+   if (ioctl(fd, TCGETS2, &tio) == -1)
+   {
+      return 0;
+   }
+
+   return tio.c_ospeed;
+}
+
+#else
+
+int sp_set_termios2_speed(fd, baud)
+   int fd, baud;
+{
+   errno = ENOTTY;
+   return -1;
+}
+
+int sp_get_termios2_speed(fd)
+   int fd;
+{
+   return 0;
+}
+
+#endif
+
+#endif /* defined(OS_LINUX) && defined(HAVE_ASM_TERMBITS_H) */
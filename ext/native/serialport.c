@@ -20,6 +20,8 @@
 
 #include "serialport.h"
 
+#include <math.h>
+
 VALUE cSerialPort; /* serial port class */
 
 VALUE sBaud, sDataBits, sStopBits, sParity; /* strings */
@@ -29,13 +31,437 @@ VALUE sWriteTimeout;
 #endif
 VALUE sRts, sDtr, sCts, sDsr, sDcd, sRi;
 
+static ID id_port_data, id_rbuf_waiters;
+
+/* Most bytes added to the receive buffer by one read */
+#define RBUF_CHUNK 4096
+
+static void free_port_data(pd)
+   struct port_data *pd;
+{
+   /*
+    * The IO may have been finalized first, so the port settings are left
+    * alone; the receive thread reads its own duplicate of the descriptor.
+    */
+   sp_ring_stop(pd, 0);
+   sp_capture_stop(pd);
+   sp_share_stop(pd);
+   if (pd->rbuf != NULL)
+   {
+      xfree(pd->rbuf);
+   }
+   xfree(pd);
+}
+
+/*
+ * :nodoc: Returns the native state of a port, creating it on first use.
+ * It lives in a hidden instance variable so it is released together with
+ * the port object.
+ */
+struct port_data *get_port_data(obj)
+   VALUE obj;
+{
+   VALUE data;
+   struct port_data *pd;
+
+   data = rb_ivar_get(obj, id_port_data);
+   if (NIL_P(data))
+   {
+      data = Data_Make_Struct(rb_cObject, struct port_data, 0, free_port_data, pd);
+      pd->inter_byte_timeout = -1;
+      rb_ivar_set(obj, id_port_data, data);
+      return pd;
+   }
+
+   Data_Get_Struct(data, struct port_data, pd);
+   return pd;
+}
+
+struct fill_args
+{
+   VALUE self;
+   struct port_data *pd;
+   char *chunk;
+   int timeout;
+   long n;
+};
+
+static VALUE fill_body(arg)
+   VALUE arg;
+{
+   struct fill_args *args = (struct fill_args *) arg;
+
+   args->n = sp_read_impl(args->self, args->chunk, RBUF_CHUNK, args->timeout);
+
+   return Qnil;
+}
+
+/*
+ * :nodoc: End a fill and wake the threads waiting in fill_wait.
+ */
+static VALUE fill_ensure(arg)
+   VALUE arg;
+{
+   struct fill_args *args = (struct fill_args *) arg;
+   VALUE waiters = rb_ivar_get(args->self, id_rbuf_waiters);
+   long i;
+
+   args->pd->rbuf_filling = 0;
+   if (!NIL_P(waiters))
+   {
+      for (i = 0; i < RARRAY_LEN(waiters); i++)
+      {
+         rb_thread_wakeup(rb_ary_entry(waiters, i));
+      }
+   }
+
+   return Qnil;
+}
+
+struct fill_waiter
+{
+   VALUE waiters;
+   struct port_data *pd;
+   int timeout;
+   double deadline;
+};
+
+static VALUE fill_wait_body(arg)
+   VALUE arg;
+{
+   struct fill_waiter *w = (struct fill_waiter *) arg;
+   struct timeval tv;
+   double left;
+
+   while (w->pd->rbuf_filling)
+   {
+      if (w->timeout < 0)
+      {
+         rb_thread_sleep_forever();
+         continue;
+      }
+
+      left = w->deadline - sp_monotonic_ms_impl();
+      if (left <= 0)
+      {
+         break;
+      }
+      tv.tv_sec = (long) (left / 1000);
+      tv.tv_usec = (long) ((left - tv.tv_sec * 1000.0) * 1000);
+      rb_thread_wait_for(tv);
+   }
+
+   return Qnil;
+}
+
+static VALUE fill_wait_ensure(arg)
+   VALUE arg;
+{
+   rb_ary_delete(((struct fill_waiter *) arg)->waiters, rb_thread_current());
+
+   return Qnil;
+}
+
+/*
+ * :nodoc: Sleep until the fill of another thread is over, which wakes the
+ * threads listed in a hidden instance variable of self, or until the
+ * deadline has passed.
+ */
+static void fill_wait(self, pd, timeout, deadline)
+   VALUE self;
+   struct port_data *pd;
+   int timeout;
+   double deadline;
+{
+   struct fill_waiter w;
+
+   w.waiters = rb_ivar_get(self, id_rbuf_waiters);
+   if (NIL_P(w.waiters))
+   {
+      w.waiters = rb_ary_new();
+      rb_ivar_set(self, id_rbuf_waiters, w.waiters);
+   }
+   w.pd = pd;
+   w.timeout = timeout;
+   w.deadline = deadline;
+
+   rb_ary_push(w.waiters, rb_thread_current());
+   rb_ensure(fill_wait_body, (VALUE) &w, fill_wait_ensure, (VALUE) &w);
+}
+
+/*
+ * :nodoc: Read more data from the port into the receive buffer, waiting
+ * at most timeout milliseconds. Returns the number of bytes added, 0 on
+ * timeout or -1 on end of file.
+ *
+ * The read goes to the stack and is appended once the GVL is held again,
+ * as other threads may take from the buffer meanwhile. Fills are one at a
+ * time so the data is appended in order; a thread that had to wait for
+ * another's returns the bytes buffered then, for its caller to look at
+ * before reading more.
+ */
+long sp_rbuf_fill(self, pd, timeout)
+   VALUE self;
+   struct port_data *pd;
+   int timeout;
+{
+   char chunk[RBUF_CHUNK];
+   double deadline = sp_monotonic_ms_impl() + timeout;
+   struct fill_args args;
+   long n;
+
+   if (pd->rbuf_filling)
+   {
+      fill_wait(self, pd, timeout, deadline);
+      if (pd->rbuf_filling)
+      {
+         return 0;
+      }
+      if (pd->rbuf_len > 0)
+      {
+         return pd->rbuf_len;
+      }
+   }
+
+   args.self = self;
+   args.pd = pd;
+   args.chunk = chunk;
+   args.timeout = timeout;
+   if (timeout >= 0)
+   {
+      args.timeout = (int) ceil(deadline - sp_monotonic_ms_impl());
+      args.timeout = (args.timeout < 0 ? 0 : args.timeout);
+   }
+
+   pd->rbuf_filling = 1;
+   rb_ensure(fill_body, (VALUE) &args, fill_ensure, (VALUE) &args);
+   n = args.n;
+   if (n <= 0)
+   {
+      return n;
+   }
+
+   if (pd->rbuf_capa - pd->rbuf_len < n)
+   {
+      if (pd->rbuf_capa == 0)
+      {
+         pd->rbuf_capa = RBUF_CHUNK;
+      }
+      while (pd->rbuf_capa - pd->rbuf_len < n)
+      {
+         pd->rbuf_capa *= 2;
+      }
+      REALLOC_N(pd->rbuf, char, pd->rbuf_capa);
+   }
+
+   memcpy(pd->rbuf + pd->rbuf_len, chunk, n);
+   pd->rbuf_len += n;
+
+   return n;
+}
+
+/*
+ * :nodoc: Drop the first len bytes of the receive buffer.
+ */
+void sp_rbuf_consume(pd, len)
+   struct port_data *pd;
+   long len;
+{
+   if (len >= pd->rbuf_len)
+   {
+      pd->rbuf_consumed += pd->rbuf_len;
+      pd->rbuf_len = 0;
+      return;
+   }
+
+   memmove(pd->rbuf, pd->rbuf + len, pd->rbuf_len - len);
+   pd->rbuf_len -= len;
+   pd->rbuf_consumed += len;
+}
+
+/*
+ * :nodoc: Move up to len buffered bytes to buf. Returns the number of
+ * bytes moved.
+ */
+long sp_rbuf_take(pd, buf, len)
+   struct port_data *pd;
+   char *buf;
+   long len;
+{
+   if (len > pd->rbuf_len)
+   {
+      len = pd->rbuf_len;
+   }
+
+   if (len > 0)
+   {
+      memcpy(buf, pd->rbuf, len);
+      sp_rbuf_consume(pd, len);
+   }
+
+   return len;
+}
+
+/*
+ * :nodoc: Add a record to the stamps of SerialPort#read_stamped: the data
+ * up to byte end arrived at ns.
+ */
+void sp_stamp_append(stamps, end, ns)
+   VALUE stamps;
+   long end;
+   LONG_LONG ns;
+{
+   LONG_LONG rec[2];
+
+   rec[0] = end;
+   rec[1] = ns;
+   rb_str_buf_cat(stamps, (char *) rec, sizeof(rec));
+}
+
+/*
+ * :nodoc: Look up an option given to SerialPort#new or SerialPort#open,
+ * nil when it is absent.
+ */
+VALUE sp_open_option(options, name)
+   VALUE options;
+   const char *name;
+{
+   if (NIL_P(options))
+   {
+      return Qnil;
+   }
+
+   return rb_hash_aref(options, ID2SYM(rb_intern(name)));
+}
+
+/*
+ * :nodoc: A positive size option, or def when it is absent.
+ */
+int sp_open_size_option(options, name, def)
+   VALUE options;
+   const char *name;
+   int def;
+{
+   VALUE val = sp_open_option(options, name);
+   int size;
+
+   if (NIL_P(val))
+   {
+      return def;
+   }
+
+   size = NUM2INT(val);
+   if (size <= 0)
+   {
+      rb_raise(rb_eArgError, "invalid %s size", name);
+   }
+
+   return size;
+}
+
+#define DEFAULT_RING_SIZE (1024 * 1024)
+
+/*
+ * :nodoc: Start the receive thread of args[0], args[1] being the
+ * :rx_thread option (true or the ring size).
+ */
+static VALUE start_rx_thread(args)
+   VALUE args;
+{
+   VALUE sp = rb_ary_entry(args, 0);
+   VALUE opt = rb_ary_entry(args, 1);
+   long size = DEFAULT_RING_SIZE;
+
+   if (opt != Qtrue)
+   {
+      size = NUM2LONG(opt);
+   }
+
+   sp_ring_start(sp, get_port_data(sp), size);
+   return Qnil;
+}
+
 /*
  * :nodoc: This method is private and will be called by SerialPort#new or SerialPort#open.
  */
-static VALUE sp_create(class, _port)
-   VALUE class, _port;
+static VALUE sp_create(argc, argv, class)
+   int argc;
+   VALUE *argv, class;
+{
+   VALUE _port, options, params, sp, rx_thread;
+   int state = 0;
+
+   rb_scan_args(argc, argv, "12", &_port, &options, &params);
+   if (!NIL_P(options))
+   {
+      Check_Type(options, T_HASH);
+   }
+   if (NIL_P(params))
+   {
+      params = rb_ary_new();
+   }
+   Check_Type(params, T_ARRAY);
+
+   rx_thread = sp_open_option(options, "rx_thread");
+   if (RTEST(rx_thread) && RTEST(sp_open_option(options, "nonblock")))
+   {
+      /* reading the ring would block the fiber scheduler */
+      rb_raise(rb_eArgError, ":rx_thread and :nonblock can't be combined");
+   }
+
+   /* modem parameters are applied together with the open-time settings */
+   sp = sp_create_impl(class, _port, options, (int) RARRAY_LEN(params),
+                       RARRAY_PTR(params));
+
+   if (RTEST(rx_thread))
+   {
+      rb_protect(start_rx_thread, rb_assoc_new(sp, rx_thread), &state);
+      if (state)
+      {
+         rb_funcall(sp, rb_intern("close"), 0);
+         rb_jump_tag(state);
+      }
+   }
+
+   return sp;
+}
+
+/*
+ * :nodoc: This method is private and will be called by SerialPort::list.
+ */
+static VALUE sp_list_ports(class)
+   VALUE class;
+{
+   (void) class;
+   return sp_list_impl();
+}
+
+/*
+ * Close the port. A receive thread, a capture and SerialPort#share are
+ * stopped first.
+ */
+static VALUE sp_close(self)
+   VALUE self;
 {
-   return sp_create_impl(class, _port);
+   struct port_data *pd = get_port_data(self);
+
+   sp_ring_stop(pd, 1);
+   if (sp_capture_stop(pd) != 0)
+   {
+      rb_warn("serial port capture not flushed");
+   }
+   sp_share_stop(pd);
+   return rb_call_super(0, 0);
+}
+
+/*
+ * Returns true if a native receive thread feeds this port's readers,
+ * see the :rx_thread option of SerialPort::new.
+ */
+static VALUE sp_rx_thread_p(self)
+   VALUE self;
+{
+   return get_port_data(self)->ring != NULL ? Qtrue : Qfalse;
 }
 
 /*
@@ -92,7 +518,11 @@ VALUE sp_get_dtr(self)
 VALUE sp_get_flow_control(self)
    VALUE self;
 {
-   return sp_get_flow_control_impl(self);
+   struct modem_params mp;
+
+   get_modem_params(self, &mp);
+
+   return INT2FIX(mp.flow_control);
 }
 
 /*
@@ -102,7 +532,11 @@ VALUE sp_get_flow_control(self)
 VALUE sp_get_read_timeout(self)
    VALUE self;
 {
-   return sp_get_read_timeout_impl(self);
+   struct modem_params mp;
+
+   get_modem_params(self, &mp);
+
+   return INT2FIX(mp.read_timeout);
 }
 
 /*
@@ -163,6 +597,56 @@ VALUE sp_set_read_timeout(self, val)
    return sp_set_read_timeout_impl(self, val);
 }
 
+/*
+ * Set the minimum number of bytes (0 to 255) a read waits for.
+ *
+ * With a read timeout of 0 a read blocks until that many bytes have
+ * arrived; with a positive read timeout it waits for the first byte and
+ * then returns once that many bytes are there or the gap between two
+ * bytes exceeds the timeout. This lets the driver deliver a whole fixed
+ * size frame in one wakeup. A negative read timeout ignores it. The
+ * default of 0 keeps the behaviour described in
+ * SerialPort#set_read_timeout.
+ *
+ * This applies to the IO read methods. The native readers
+ * (SerialPort#sysread_timeout, #read_timed, #read_line, ...) keep their
+ * own deadlines and return whatever has arrived.
+ *
+ * Note: On Windows there is no minimum count; a nonzero value makes the
+ * read timeout an inter-byte timeout, and reads return once the
+ * requested length has arrived.
+ */
+VALUE sp_set_read_min_bytes(self, val)
+   VALUE self, val;
+{
+   struct modem_params mp;
+   int min_bytes;
+
+   Check_Type(val, T_FIXNUM);
+
+   min_bytes = FIX2INT(val);
+   if (min_bytes < 0 || min_bytes > 255)
+   {
+      rb_raise(rb_eArgError, "minimum read size must be between 0 and 255");
+   }
+
+   get_modem_params(self, &mp);
+   get_port_data(self)->read_min_bytes = min_bytes;
+   sp_set_read_timeout_impl(self, INT2FIX(mp.read_timeout));
+
+   return val;
+}
+
+/*
+ * Get the minimum number of bytes a read waits for, see
+ * SerialPort#read_min_bytes=
+ */
+VALUE sp_get_read_min_bytes(self)
+   VALUE self;
+{
+   return INT2FIX(get_port_data(self)->read_min_bytes);
+}
+
 /*
  * Set the state (0 or 1) of the RTS line
  */
@@ -172,6 +656,120 @@ VALUE sp_set_rts(self, val)
    return sp_set_rts_impl(self, val);
 }
 
+/*
+ * Ask the driver to hand received data to the reader immediately
+ * (ASYNC_LOW_LATENCY) instead of batching it. Linux only; changing it
+ * may require root.
+ *
+ * On FTDI adapters also lower the latency timer, see
+ * SerialPort::set_latency_timer.
+ */
+static VALUE sp_set_low_latency(self, val)
+   VALUE self, val;
+{
+   return sp_set_low_latency_impl(self, val);
+}
+
+/*
+ * Get whether the driver's low latency mode is enabled. Linux only.
+ */
+static VALUE sp_get_low_latency(self)
+   VALUE self;
+{
+   return sp_get_low_latency_impl(self);
+}
+
+static int rs485_flag(hash, key, def)
+   VALUE hash;
+   const char *key;
+   int def;
+{
+   VALUE val = rb_hash_aref(hash, rb_str_new2(key));
+
+   return NIL_P(val) ? def : RTEST(val);
+}
+
+static int rs485_delay(hash, key)
+   VALUE hash;
+   const char *key;
+{
+   VALUE val = rb_hash_aref(hash, rb_str_new2(key));
+   int delay;
+
+   if (NIL_P(val))
+   {
+      return 0;
+   }
+
+   delay = NUM2INT(val);
+   if (delay < 0)
+   {
+      rb_raise(rb_eArgError, "negative %s", key);
+   }
+
+   return delay;
+}
+
+/*
+ * Let the driver switch an RS-485 transceiver with RTS: it raises RTS
+ * before sending and drops it once the last bit is out, at line speed.
+ * <tt>val</tt> is true, false, or a hash with the keys "enabled",
+ * "rts_on_send" (RTS level while sending, default true),
+ * "rts_after_send" (default false), "delay_rts_before_send" and
+ * "delay_rts_after_send" (milliseconds, default 0).
+ *
+ *    sp.rs485 = { "enabled" => true, "delay_rts_after_send" => 1 }
+ *
+ * Note: Linux (TIOCSRS485) and Windows (RTS_CONTROL_TOGGLE) only, and
+ * the driver must support it. Windows ignores the levels and delays.
+ */
+static VALUE sp_set_rs485(self, val)
+   VALUE self, val;
+{
+   struct rs485_params rs;
+
+   if (TYPE(val) == T_HASH)
+   {
+      rs.enabled = rs485_flag(val, "enabled", 1);
+      rs.rts_on_send = rs485_flag(val, "rts_on_send", 1);
+      rs.rts_after_send = rs485_flag(val, "rts_after_send", 0);
+      rs.delay_before = rs485_delay(val, "delay_rts_before_send");
+      rs.delay_after = rs485_delay(val, "delay_rts_after_send");
+   }
+   else
+   {
+      rs.enabled = RTEST(val);
+      rs.rts_on_send = 1;
+      rs.rts_after_send = 0;
+      rs.delay_before = rs.delay_after = 0;
+   }
+
+   sp_set_rs485_impl(self, &rs);
+
+   return val;
+}
+
+/*
+ * Get the RS-485 settings as a hash, see SerialPort#rs485=.
+ */
+static VALUE sp_get_rs485(self)
+   VALUE self;
+{
+   struct rs485_params rs;
+   VALUE hash;
+
+   sp_get_rs485_impl(self, &rs);
+
+   hash = rb_hash_new();
+   rb_hash_aset(hash, rb_str_new2("enabled"), rs.enabled ? Qtrue : Qfalse);
+   rb_hash_aset(hash, rb_str_new2("rts_on_send"), rs.rts_on_send ? Qtrue : Qfalse);
+   rb_hash_aset(hash, rb_str_new2("rts_after_send"), rs.rts_after_send ? Qtrue : Qfalse);
+   rb_hash_aset(hash, rb_str_new2("delay_rts_before_send"), INT2FIX(rs.delay_before));
+   rb_hash_aset(hash, rb_str_new2("delay_rts_after_send"), INT2FIX(rs.delay_after));
+
+   return hash;
+}
+
 /*
  * Set a write timeout (in milliseconds)
  *
@@ -184,12 +782,56 @@ VALUE sp_set_write_timeout(self, val)
 }
 
 /*
+ * :nodoc: Fill mp with the port settings. They are read from the port
+ * once and then served from the copy kept up to date by the setters, see
+ * SerialPort#refresh!.
  */
 void get_modem_params(self, mp)
    VALUE self;
    struct modem_params *mp;
 {
-   get_modem_params_impl(self, mp);
+   struct port_data *pd = get_port_data(self);
+
+   if (!pd->mp_valid)
+   {
+      get_modem_params_impl(self, &pd->mp);
+      pd->mp_valid = 1;
+   }
+
+   *mp = pd->mp;
+}
+
+/*
+ * :nodoc: Called by the setters with the settings they just applied.
+ */
+void cache_modem_params(self, mp)
+   VALUE self;
+   struct modem_params *mp;
+{
+   struct port_data *pd = get_port_data(self);
+
+   pd->mp = *mp;
+   pd->mp_valid = 1;
+}
+
+/*
+ * Read the settings back from the port.
+ *
+ * The getters (SerialPort#baud, SerialPort#modem_params, ...) answer
+ * from a copy of the settings last applied through this object, without
+ * asking the driver. Call this if the port may have been reconfigured
+ * behind its back, e.g. by another process.
+ */
+VALUE sp_refresh(self)
+   VALUE self;
+{
+   struct port_data *pd = get_port_data(self);
+
+   pd->mp_valid = 0;
+   get_modem_params_impl(self, &pd->mp);
+   pd->mp_valid = 1;
+
+   return self;
 }
 
 /*
@@ -346,6 +988,671 @@ void get_line_signals_helper(obj, ls)
    get_line_signals_helper_impl(obj, ls);
 }
 
+/*
+ * :nodoc: Run func(data) without holding the GVL so that other Ruby threads
+ * keep running while a port is blocked. The call can be interrupted by
+ * Thread#raise, Thread#kill and signals.
+ */
+void *sp_blocking_call(func, data)
+   void *(*func)(void *);
+   void *data;
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) || defined(HAVE_RB_THREAD_BLOCKING_REGION)
+   return sp_blocking_call_ubf(func, data, RUBY_UBF_IO, 0);
+#else
+   return func(data);
+#endif
+}
+
+/*
+ * :nodoc: Like sp_blocking_call, with a custom function to wake func.
+ */
+void *sp_blocking_call_ubf(func, data, ubf, ubf_data)
+   void *(*func)(void *);
+   void *data;
+   void (*ubf)(void *);
+   void *ubf_data;
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+   return rb_thread_call_without_gvl(func, data, ubf, ubf_data);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+   return (void *) rb_thread_blocking_region((rb_blocking_function_t *) func,
+                                             data, ubf, ubf_data);
+#else
+   return func(data);
+#endif
+}
+
+static int get_timeout_arg(timeout)
+   VALUE timeout;
+{
+   if (NIL_P(timeout))
+   {
+      return -1;
+   }
+
+   Check_Type(timeout, T_FIXNUM);
+
+   if (FIX2INT(timeout) < 0)
+   {
+      rb_raise(rb_eArgError, "negative timeout");
+   }
+
+   return FIX2INT(timeout);
+}
+
+/*
+ * Read up to <tt>length</tt> bytes, waiting at most <tt>timeout</tt>
+ * milliseconds for data to arrive (forever if <tt>timeout</tt> is nil).
+ * Returns the data read or nil on timeout; a timeout of 0 never blocks.
+ *
+ * The wait happens without holding the interpreter lock, so other
+ * threads keep running and the call can be interrupted with Thread#raise
+ * or Thread#kill. Like IO#sysread, this bypasses the IO read buffer and
+ * should not be mixed with buffered methods such as IO#gets.
+ */
+VALUE sp_sysread_timeout(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _length, _timeout, str;
+   long length, n;
+
+   rb_scan_args(argc, argv, "11", &_length, &_timeout);
+
+   length = NUM2LONG(_length);
+   if (length < 0)
+   {
+      rb_raise(rb_eArgError, "negative length");
+   }
+
+   str = rb_str_new(0, length);
+   if (length == 0)
+   {
+      return str;
+   }
+
+   /* data left over by the framing readers comes first */
+   n = sp_rbuf_take(get_port_data(self), RSTRING_PTR(str), length);
+   if (n == 0)
+   {
+      n = sp_read_impl(self, RSTRING_PTR(str), length, get_timeout_arg(_timeout));
+   }
+   if (n < 0)
+   {
+      rb_eof_error();
+   }
+   else if (n == 0)
+   {
+      return Qnil;
+   }
+
+   rb_str_resize(str, n);
+
+   return str;
+}
+
+struct read_into_args
+{
+   VALUE self;
+   VALUE buf;
+   long offset;
+   long maxlen;
+   int timeout;
+   long n;
+};
+
+static VALUE read_into_body(arg)
+   VALUE arg;
+{
+   struct read_into_args *args = (struct read_into_args *) arg;
+
+   args->n = sp_read_impl(args->self, RSTRING_PTR(args->buf) + args->offset,
+                          args->maxlen, args->timeout);
+
+   return Qnil;
+}
+
+static VALUE read_into_ensure(buf)
+   VALUE buf;
+{
+#ifdef RUBY_1_9
+   rb_str_unlocktmp(buf);
+#endif
+   return Qnil;
+}
+
+/*
+ * Read up to <tt>maxlen</tt> bytes into <tt>buffer</tt>, a String that is
+ * reused across calls instead of allocating a new one for every read.
+ *
+ * The data is stored at byte <tt>:offset</tt> (0 by default, at most the
+ * current length) and <tt>buffer</tt> is truncated after it; the bytes
+ * before the offset are kept. Its capacity is grown but never shrunk, so
+ * reading into the same buffer repeatedly does no allocation at all.
+ * <tt>:timeout</tt> is in milliseconds as for SerialPort#sysread_timeout.
+ *
+ * Returns the number of bytes read, or nil on timeout (when
+ * <tt>buffer</tt> is truncated at the offset).
+ *
+ *    buf = String.new
+ *    while n = sp.read_into(buf, 4096, :timeout => 100)
+ *       process(buf)
+ *    end
+ */
+VALUE sp_read_into(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE buf, _maxlen, opts, val;
+   struct read_into_args args;
+
+   rb_scan_args(argc, argv, "21", &buf, &_maxlen, &opts);
+
+   args.self = self;
+   args.offset = 0;
+   args.timeout = -1;
+   if (!NIL_P(opts))
+   {
+      Check_Type(opts, T_HASH);
+      val = rb_hash_aref(opts, ID2SYM(rb_intern("offset")));
+      if (!NIL_P(val))
+      {
+         args.offset = NUM2LONG(val);
+      }
+      args.timeout = get_timeout_arg(rb_hash_aref(opts, ID2SYM(rb_intern("timeout"))));
+   }
+
+   args.maxlen = NUM2LONG(_maxlen);
+   if (args.maxlen < 0)
+   {
+      rb_raise(rb_eArgError, "negative length");
+   }
+
+   StringValue(buf);
+   if (args.offset < 0 || args.offset > RSTRING_LEN(buf))
+   {
+      rb_raise(rb_eArgError, "offset outside of buffer");
+   }
+
+   rb_str_modify(buf);
+#ifdef HAVE_RB_STR_MODIFY_EXPAND
+   if (args.offset + args.maxlen > RSTRING_LEN(buf))
+   {
+      rb_str_modify_expand(buf, args.offset + args.maxlen - RSTRING_LEN(buf));
+   }
+#else
+   rb_str_resize(buf, args.offset + args.maxlen);
+#endif
+   args.buf = buf;
+
+   if (args.maxlen == 0)
+   {
+      rb_str_set_len(buf, args.offset);
+      return INT2FIX(0);
+   }
+
+   /* data left over by the framing readers comes first */
+   args.n = sp_rbuf_take(get_port_data(self), RSTRING_PTR(buf) + args.offset,
+                         args.maxlen);
+   if (args.n == 0)
+   {
+#ifdef RUBY_1_9
+      /* keep other threads from resizing it while the GVL is released */
+      rb_str_locktmp(buf);
+#endif
+      rb_ensure(read_into_body, (VALUE) &args, read_into_ensure, buf);
+   }
+
+   rb_str_set_len(buf, args.offset + (args.n > 0 ? args.n : 0));
+
+   if (args.n < 0)
+   {
+      rb_eof_error();
+   }
+   else if (args.n == 0)
+   {
+      return Qnil;
+   }
+
+   return LONG2NUM(args.n);
+}
+
+/*
+ * Write <tt>string</tt>, waiting at most <tt>timeout</tt> milliseconds for
+ * the port to accept data (forever if <tt>timeout</tt> is nil). Returns
+ * the number of bytes written, which is less than the length of
+ * <tt>string</tt> if the timeout expired.
+ *
+ * Like SerialPort#sysread_timeout, the interpreter lock is released
+ * while waiting.
+ */
+VALUE sp_syswrite_timeout(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE str, _timeout;
+   long n;
+
+   rb_scan_args(argc, argv, "11", &str, &_timeout);
+
+   /* a frozen copy keeps the buffer valid while the GVL is released */
+   str = rb_str_new4(rb_obj_as_string(str));
+   if (RSTRING_LEN(str) == 0)
+   {
+      return INT2FIX(0);
+   }
+
+   n = sp_write_impl(self, RSTRING_PTR(str), RSTRING_LEN(str),
+                     get_timeout_arg(_timeout));
+   RB_GC_GUARD(str);
+
+   return LONG2NUM(n);
+}
+
+/*
+ * :nodoc: A break or mark-after-break duration in microseconds.
+ */
+static long get_break_arg(duration, minimum)
+   VALUE duration;
+   long minimum;
+{
+   long us;
+
+   if (NIL_P(duration))
+   {
+      return 0;
+   }
+
+   us = NUM2LONG(duration);
+   if (us < minimum || us > 10000000)
+   {
+      rb_raise(rb_eArgError, "invalid break duration");
+   }
+
+   return us;
+}
+
+/*
+ * Send a break of <tt>duration</tt> microseconds once the output has
+ * drained, followed by <tt>mark_after</tt> microseconds of mark (idle)
+ * before returning. Unlike SerialPort#break, the durations are kept by
+ * the extension with a high resolution timer, so breaks of a few hundred
+ * microseconds as used by LIN and DMX512 come out right, and the
+ * interpreter lock is released meanwhile. Durations are limited to 10
+ * seconds.
+ *
+ *    sp.send_break(200, 20)
+ */
+static VALUE sp_send_break(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE duration, mark_after;
+
+   rb_scan_args(argc, argv, "11", &duration, &mark_after);
+
+   sp_send_break_impl(self, get_break_arg(duration, 1),
+                      get_break_arg(mark_after, 0));
+
+   return self;
+}
+
+/*
+ * Send a break like SerialPort#send_break and then <tt>string</tt>, back
+ * to back: the write is issued by the same native call that ends the
+ * mark after break, so no Ruby code or thread switch delays it. Returns
+ * the number of bytes written; <tt>timeout</tt> limits the wait for the
+ * port to accept them like in SerialPort#syswrite_timeout.
+ *
+ *    # a DMX512 packet: break, mark after break, start code and slots
+ *    sp.break_and_write("\0" + levels, 176, 12)
+ */
+static VALUE sp_break_and_write(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE str, duration, mark_after, _timeout;
+   long n;
+
+   rb_scan_args(argc, argv, "22", &str, &duration, &mark_after, &_timeout);
+
+   /* a frozen copy keeps the buffer valid while the GVL is released */
+   str = rb_str_new4(rb_obj_as_string(str));
+   n = sp_break_write_impl(self, RSTRING_PTR(str), RSTRING_LEN(str),
+                           get_break_arg(duration, 1),
+                           get_break_arg(mark_after, 0),
+                           get_timeout_arg(_timeout));
+   RB_GC_GUARD(str);
+
+   return LONG2NUM(n);
+}
+
+/*
+ * Write all <tt>strings</tt> to the port, in order, as if they were one
+ * String, and return the number of bytes written. On Posix they are
+ * passed to a single writev() instead of being joined first, e.g. the
+ * header, payload and checksum of a frame:
+ *
+ *    sp.write_v(header, payload, crc)
+ *
+ * Like SerialPort#syswrite_timeout this bypasses the IO write buffer and
+ * releases the interpreter lock while waiting.
+ */
+static VALUE sp_write_v(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE strs, str;
+   long n;
+   int i;
+
+   /* frozen copies keep the buffers valid while the GVL is released */
+   strs = rb_ary_new2(argc);
+   for (i = 0; i < argc; i++)
+   {
+      str = rb_str_new4(rb_obj_as_string(argv[i]));
+      if (RSTRING_LEN(str) > 0)
+      {
+         rb_ary_push(strs, str);
+      }
+   }
+
+   if (RARRAY_LEN(strs) == 0)
+   {
+      return INT2FIX(0);
+   }
+
+   n = sp_writev_impl(self, strs, -1);
+   RB_GC_GUARD(strs);
+
+   return LONG2NUM(n);
+}
+
+/*
+ * Write as much of <tt>string</tt> as the driver accepts without waiting
+ * and return the number of bytes written, 0 if its output queue is full
+ * (e.g. while hardware flow control holds the line). Useful to keep a
+ * stalled peer from blocking the writer.
+ *
+ *    n = sp.write_partial(data)
+ *    data = data[n..-1]
+ */
+static VALUE sp_write_partial(self, str)
+   VALUE self, str;
+{
+   VALUE argv[2];
+
+   argv[0] = str;
+   argv[1] = INT2FIX(0);
+
+   return sp_syswrite_timeout(2, argv, self);
+}
+
+/*
+ * Returns the number of bytes written to the port but not sent yet.
+ */
+static VALUE sp_output_queue_size(self)
+   VALUE self;
+{
+   return LONG2NUM(sp_output_queue_impl(self));
+}
+
+/*
+ * Returns the number of received bytes that can be read without
+ * waiting, including data buffered by the extension.
+ */
+static VALUE sp_input_queue_size(self)
+   VALUE self;
+{
+   struct port_data *pd = get_port_data(self);
+   long n = pd->rbuf_len + sp_bytes_available_impl(self);
+
+   if (pd->ring != NULL)
+   {
+      n += sp_ring_count(pd->ring);
+   }
+
+   return LONG2NUM(n);
+}
+
+/*
+ * Wait until all data written to the port has been sent, at most
+ * <tt>timeout</tt> milliseconds (forever if nil). Returns true if the
+ * output queue drained, false on timeout.
+ *
+ * The interpreter lock is released while waiting.
+ */
+static VALUE sp_drain(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _timeout;
+
+   rb_scan_args(argc, argv, "01", &_timeout);
+
+   return sp_drain_impl(self, get_timeout_arg(_timeout)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Discard data received but not read yet, including data buffered by
+ * the extension.
+ */
+static VALUE sp_flush_input(self)
+   VALUE self;
+{
+   struct port_data *pd = get_port_data(self);
+
+   sp_flush_impl(self, 1, 0);
+   sp_rbuf_consume(pd, pd->rbuf_len);
+   if (pd->ring != NULL)
+   {
+      sp_ring_discard(pd->ring);
+   }
+
+   return self;
+}
+
+/*
+ * Discard data written to the port but not sent yet.
+ */
+static VALUE sp_flush_output(self)
+   VALUE self;
+{
+   sp_flush_impl(self, 0, 1);
+
+   return self;
+}
+
+/*
+ * Read up to <tt>length</tt> bytes with millisecond accurate timeouts.
+ *
+ * Returns when <tt>length</tt> bytes have arrived, when <tt>timeout</tt>
+ * milliseconds have passed, or, once some data has been received, when
+ * no further byte arrives for <tt>inter_byte_timeout</tt> milliseconds.
+ * A nil <tt>timeout</tt> waits forever for the first byte and
+ * <tt>inter_byte_timeout</tt> defaults to SerialPort#inter_byte_timeout.
+ * Returns the data received, or nil if nothing arrived in time.
+ *
+ * Unlike SerialPort#read_timeout, which the driver rounds to tenths of a
+ * second on POSIX, the deadlines are kept by the extension and are
+ * suitable for request/response protocols with timeouts of a few
+ * milliseconds. The interpreter lock is released while waiting.
+ */
+VALUE sp_read_timed(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _length, _timeout, _interval, str;
+   long length, n, buffered;
+   int interval;
+
+   rb_scan_args(argc, argv, "12", &_length, &_timeout, &_interval);
+
+   length = NUM2LONG(_length);
+   if (length < 0)
+   {
+      rb_raise(rb_eArgError, "negative length");
+   }
+
+   if (argc < 3)
+   {
+      interval = get_port_data(self)->inter_byte_timeout;
+   }
+   else
+   {
+      interval = get_timeout_arg(_interval);
+   }
+
+   str = rb_str_new(0, length);
+   if (length == 0)
+   {
+      return str;
+   }
+
+   /* data left over by the framing readers comes first */
+   buffered = sp_rbuf_take(get_port_data(self), RSTRING_PTR(str), length);
+   if (buffered == length)
+   {
+      return str;
+   }
+
+   n = sp_read_timed_impl(self, RSTRING_PTR(str) + buffered, length - buffered,
+                          get_timeout_arg(_timeout), interval);
+   if (n < 0 && buffered == 0)
+   {
+      rb_eof_error();
+   }
+   else if (n < 0)
+   {
+      n = 0;
+   }
+
+   n += buffered;
+   if (n == 0)
+   {
+      return Qnil;
+   }
+
+   rb_str_resize(str, n);
+
+   return str;
+}
+
+/*
+ * Like SerialPort#read_timed, but also tells when the data arrived.
+ * Returns <tt>[data, stamps]</tt>, or nil if nothing arrived in time.
+ *
+ * The native read path takes a timestamp as each read returns (in the
+ * receive thread for ports with <tt>:rx_thread</tt>). <tt>stamps</tt>
+ * packs one record per read, two native 64-bit integers: the offset in
+ * <tt>data</tt> where the bytes of that read end, and the time they
+ * arrived in nanoseconds on the clock of
+ * <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)</tt>
+ * (QueryPerformanceCounter on Windows). Data left over by the framing
+ * readers has the time -1, as it is unknown.
+ *
+ *    data, stamps = sp.read_stamped(256, 1000, 5)
+ *    stamps.unpack("q*").each_slice(2) do |end_offset, ns|
+ *       ...
+ *    end
+ */
+static VALUE sp_read_stamped(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _length, _timeout, _interval, str, stamps;
+   struct port_data *pd = get_port_data(self);
+   long length, n, got;
+   int timeout, interval, wait;
+   double deadline;
+
+   rb_scan_args(argc, argv, "12", &_length, &_timeout, &_interval);
+
+   length = NUM2LONG(_length);
+   if (length < 0)
+   {
+      rb_raise(rb_eArgError, "negative length");
+   }
+
+   timeout = get_timeout_arg(_timeout);
+   interval = (argc < 3 ? pd->inter_byte_timeout : get_timeout_arg(_interval));
+
+   str = rb_str_new(0, length);
+   stamps = rb_str_buf_new(4 * 2 * sizeof(LONG_LONG));
+   if (length == 0)
+   {
+      return rb_assoc_new(str, stamps);
+   }
+
+   got = sp_rbuf_take(pd, RSTRING_PTR(str), length);
+   if (got > 0)
+   {
+      sp_stamp_append(stamps, got, -1);
+   }
+
+   deadline = sp_monotonic_ms_impl() + timeout;
+   while (got < length)
+   {
+      /* the total timeout, shortened to the inter-byte one after data */
+      wait = -1;
+      if (timeout >= 0)
+      {
+         wait = (int) ceil(deadline - sp_monotonic_ms_impl());
+         wait = (wait < 0 ? 0 : wait);
+      }
+      if (got > 0 && interval >= 0 && (wait < 0 || interval < wait))
+      {
+         wait = interval;
+      }
+
+      n = sp_read_stamped_impl(self, RSTRING_PTR(str) + got, length - got,
+                               wait, stamps, got);
+      if (n < 0 && got == 0)
+      {
+         rb_eof_error();
+      }
+      if (n <= 0)
+      {
+         break;
+      }
+      got += n;
+   }
+
+   if (got == 0)
+   {
+      return Qnil;
+   }
+
+   rb_str_resize(str, got);
+
+   return rb_assoc_new(str, stamps);
+}
+
+/*
+ * Set the default inter-byte timeout (in milliseconds) for
+ * SerialPort#read_timed, or nil to only use the total timeout.
+ */
+VALUE sp_set_inter_byte_timeout(self, val)
+   VALUE self, val;
+{
+   get_port_data(self)->inter_byte_timeout = get_timeout_arg(val);
+
+   return val;
+}
+
+/*
+ * Get the default inter-byte timeout (in milliseconds) for
+ * SerialPort#read_timed, nil if none is set.
+ */
+VALUE sp_get_inter_byte_timeout(self)
+   VALUE self;
+{
+   int interval = get_port_data(self)->inter_byte_timeout;
+
+   return (interval < 0 ? Qnil : INT2FIX(interval));
+}
+
 /*
  * Get the state (0 or 1) of the CTS line
  */
@@ -426,6 +1733,150 @@ VALUE sp_signals(self)
    return hash;
 }
 
+/*
+ * Return the state of all lines as one Integer, read from the driver in
+ * a single call: the sum of SerialPort::LINE_RTS, SerialPort::LINE_DTR,
+ * SerialPort::LINE_CTS, SerialPort::LINE_DSR, SerialPort::LINE_DCD and
+ * SerialPort::LINE_RI for the lines that are on.
+ *
+ *    dcd = (sp.signal_bits & SerialPort::LINE_DCD) != 0
+ *
+ * Note: Under Windows, the rts and dtr bits are never set.
+ */
+static VALUE sp_signal_bits(self)
+   VALUE self;
+{
+   return INT2FIX(sp_get_signal_bits_impl(self));
+}
+
+/*
+ * Turn on the output lines in <tt>set</tt> and turn off those in
+ * <tt>clear</tt>, both combinations of SerialPort::LINE_RTS and
+ * SerialPort::LINE_DTR. On Posix each change is a single ioctl, so
+ * lines changed concurrently by other users of the port are left alone.
+ *
+ *    sp.set_signal_bits(SerialPort::LINE_DTR, SerialPort::LINE_RTS)
+ */
+static VALUE sp_set_signal_bits(self, _set, _clear)
+   VALUE self, _set, _clear;
+{
+   int set = NUM2INT(_set), clear = NUM2INT(_clear);
+
+   if (((set | clear) & ~(LINE_RTS | LINE_DTR)) != 0)
+   {
+      rb_raise(rb_eArgError, "only LINE_RTS and LINE_DTR can be changed");
+   }
+   if ((set & clear) != 0)
+   {
+      rb_raise(rb_eArgError, "line both set and cleared");
+   }
+
+   sp_set_signal_bits_impl(self, set, clear);
+
+   return self;
+}
+
+/*
+ * Wait until one of the input lines given in <tt>mask</tt> changes
+ * state, at most <tt>timeout</tt> milliseconds (forever if nil).
+ * <tt>mask</tt> combines SerialPort::LINE_CTS, SerialPort::LINE_DSR,
+ * SerialPort::LINE_DCD and SerialPort::LINE_RI. Returns the bits of the
+ * lines that changed, or nil on timeout.
+ *
+ * The wait doesn't hold the interpreter lock. On Linux it sleeps in
+ * TIOCMIWAIT, which a timer thread interrupts at the timeout; on other
+ * platforms, or drivers without TIOCMIWAIT, the lines are checked every
+ * 10 milliseconds. On Windows ports opened with
+ * <tt>:overlapped => true</tt> use WaitCommEvent instead.
+ *
+ *    sp.wait_for_signal_change(SerialPort::LINE_DCD | SerialPort::LINE_CTS)
+ */
+static VALUE sp_wait_for_signal_change(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _mask, _timeout;
+   int mask, changed;
+
+   rb_scan_args(argc, argv, "11", &_mask, &_timeout);
+
+   mask = NUM2INT(_mask);
+   if ((mask & LINE_INPUTS) == 0 || (mask & ~LINE_INPUTS) != 0)
+   {
+      rb_raise(rb_eArgError, "mask must combine LINE_CTS, LINE_DSR, LINE_DCD and LINE_RI");
+   }
+
+   changed = sp_wait_signal_change_impl(self, mask, get_timeout_arg(_timeout));
+
+   return changed ? INT2FIX(changed) : Qnil;
+}
+
+/*
+ * Returns a hash of the driver's counters of line transitions and
+ * receive events since the port was opened. Keys are "cts", "dsr",
+ * "dcd", "ri", "rx", "tx", "frame", "overrun", "parity", "break" and
+ * "buf_overrun".
+ *
+ * Note: Linux only (TIOCGICOUNT), and not every driver keeps them.
+ */
+static VALUE sp_get_line_counters(self)
+   VALUE self;
+{
+   return sp_get_line_counters_impl(self);
+}
+
+#define STAT(name, value) \
+   rb_hash_aset(hash, rb_str_new2(name), ULONG2NUM(value))
+
+/*
+ * Get the port's I/O counters as a hash: "bytes_in", "bytes_out",
+ * "reads" and "writes" (system calls that returned), "timeouts",
+ * "short_reads" (reads returning less than asked for), "eagain",
+ * "eintr", and the line errors "frame", "parity" and "overrun" (nil
+ * where the driver doesn't report them). Only the native readers and
+ * writers (sysread_timeout, read_timed, read_into, each_frame,
+ * syswrite_timeout, write_partial, write_v, modbus_request) and the
+ * receive thread are counted, not the IO methods. Counting allocates
+ * nothing; only this call does.
+ *
+ *    st = sp.stats
+ *    st["reads"] * 1024.0 / st["bytes_in"]   # system calls per KB
+ */
+static VALUE sp_get_stats(self)
+   VALUE self;
+{
+   struct port_data *pd = get_port_data(self);
+   struct port_stats st;
+   struct rx_ring *ring = pd->ring;
+   VALUE hash;
+   int errors;
+
+   st = pd->stats;
+   if (ring != NULL)
+   {
+      st.bytes_in += ring->head;
+      st.reads += ring->reads;
+   }
+   errors = sp_get_line_errors_impl(self, &st);
+
+   hash = rb_hash_new();
+   STAT("bytes_in", st.bytes_in);
+   STAT("bytes_out", st.bytes_out);
+   STAT("reads", st.reads);
+   STAT("writes", st.writes);
+   STAT("timeouts", st.timeouts);
+   STAT("short_reads", st.short_reads);
+   STAT("eagain", st.eagain);
+   STAT("eintr", st.eintr);
+   rb_hash_aset(hash, rb_str_new2("frame"), errors ? ULONG2NUM(st.frame) : Qnil);
+   rb_hash_aset(hash, rb_str_new2("parity"), errors ? ULONG2NUM(st.parity) : Qnil);
+   rb_hash_aset(hash, rb_str_new2("overrun"), errors ? ULONG2NUM(st.overrun) : Qnil);
+
+   return hash;
+}
+
+#undef STAT
+
 /*
  * This class is used for communication over a serial port.
  * In addition to the methods here, you can use everything
@@ -433,6 +1884,9 @@ VALUE sp_signals(self)
  */
 void Init_serialport()
 {
+   id_port_data = rb_intern("port_data");
+   id_rbuf_waiters = rb_intern("rbuf_waiters");
+
    sBaud = rb_str_new2("baud");
    sDataBits = rb_str_new2("data_bits");
    sStopBits = rb_str_new2("stop_bits");
@@ -468,7 +1922,10 @@ void Init_serialport()
    rb_gc_register_address(&sRi);
 
    cSerialPort = rb_define_class("SerialPort", rb_cIO);
-   rb_define_singleton_method(cSerialPort, "create", sp_create, 1);
+   rb_define_singleton_method(cSerialPort, "create", sp_create, -1);
+   rb_define_singleton_method(cSerialPort, "list_ports", sp_list_ports, 0);
+   rb_define_method(cSerialPort, "close", sp_close, 0);
+   rb_define_method(cSerialPort, "rx_thread?", sp_rx_thread_p, 0);
 
    rb_define_method(cSerialPort, "get_modem_params", sp_get_modem_params, 0);
    rb_define_method(cSerialPort, "set_modem_params", sp_set_modem_params, -1);
@@ -482,16 +1939,41 @@ void Init_serialport()
    rb_define_method(cSerialPort, "stop_bits=", sp_set_stop_bits, 1);
    rb_define_method(cSerialPort, "parity", sp_get_parity, 0);
    rb_define_method(cSerialPort, "parity=", sp_set_parity, 1);
+   rb_define_method(cSerialPort, "refresh!", sp_refresh, 0);
 
    rb_define_method(cSerialPort, "flow_control=", sp_set_flow_control, 1);
    rb_define_method(cSerialPort, "flow_control", sp_get_flow_control, 0);
 
    rb_define_method(cSerialPort, "read_timeout", sp_get_read_timeout, 0);
    rb_define_method(cSerialPort, "read_timeout=", sp_set_read_timeout, 1);
+   rb_define_method(cSerialPort, "read_min_bytes", sp_get_read_min_bytes, 0);
+   rb_define_method(cSerialPort, "read_min_bytes=", sp_set_read_min_bytes, 1);
    rb_define_method(cSerialPort, "write_timeout", sp_get_write_timeout, 0);
    rb_define_method(cSerialPort, "write_timeout=", sp_set_write_timeout, 1);
 
+   rb_define_method(cSerialPort, "low_latency", sp_get_low_latency, 0);
+   rb_define_method(cSerialPort, "low_latency=", sp_set_low_latency, 1);
+   rb_define_method(cSerialPort, "rs485", sp_get_rs485, 0);
+   rb_define_method(cSerialPort, "rs485=", sp_set_rs485, 1);
+
    rb_define_method(cSerialPort, "break", sp_break, 1);
+   rb_define_method(cSerialPort, "send_break", sp_send_break, -1);
+   rb_define_method(cSerialPort, "break_and_write", sp_break_and_write, -1);
+
+   rb_define_method(cSerialPort, "sysread_timeout", sp_sysread_timeout, -1);
+   rb_define_method(cSerialPort, "syswrite_timeout", sp_syswrite_timeout, -1);
+   rb_define_method(cSerialPort, "write_v", sp_write_v, -1);
+   rb_define_method(cSerialPort, "write_partial", sp_write_partial, 1);
+   rb_define_method(cSerialPort, "output_queue_size", sp_output_queue_size, 0);
+   rb_define_method(cSerialPort, "input_queue_size", sp_input_queue_size, 0);
+   rb_define_method(cSerialPort, "drain", sp_drain, -1);
+   rb_define_method(cSerialPort, "flush_input", sp_flush_input, 0);
+   rb_define_method(cSerialPort, "flush_output", sp_flush_output, 0);
+   rb_define_method(cSerialPort, "read_timed", sp_read_timed, -1);
+   rb_define_method(cSerialPort, "read_stamped", sp_read_stamped, -1);
+   rb_define_method(cSerialPort, "read_into", sp_read_into, -1);
+   rb_define_method(cSerialPort, "inter_byte_timeout", sp_get_inter_byte_timeout, 0);
+   rb_define_method(cSerialPort, "inter_byte_timeout=", sp_set_inter_byte_timeout, 1);
 
    rb_define_method(cSerialPort, "signals", sp_signals, 0);
    rb_define_method(cSerialPort, "get_signals", sp_signals, 0);
@@ -503,6 +1985,18 @@ void Init_serialport()
    rb_define_method(cSerialPort, "dsr", sp_get_dsr, 0);
    rb_define_method(cSerialPort, "dcd", sp_get_dcd, 0);
    rb_define_method(cSerialPort, "ri", sp_get_ri, 0);
+   rb_define_method(cSerialPort, "signal_bits", sp_signal_bits, 0);
+   rb_define_method(cSerialPort, "set_signal_bits", sp_set_signal_bits, 2);
+   rb_define_method(cSerialPort, "wait_for_signal_change", sp_wait_for_signal_change, -1);
+   rb_define_method(cSerialPort, "line_counters", sp_get_line_counters, 0);
+   rb_define_method(cSerialPort, "stats", sp_get_stats, 0);
+
+   Init_serialport_frame(cSerialPort);
+   Init_serialport_selector(cSerialPort);
+   Init_serialport_checksum(cSerialPort);
+   Init_serialport_modbus(cSerialPort);
+   Init_serialport_capture(cSerialPort);
+   Init_serialport_shared(cSerialPort);
 
    rb_define_const(cSerialPort, "NONE", INT2FIX(NONE));
    rb_define_const(cSerialPort, "HARD", INT2FIX(HARD));
@@ -513,6 +2007,13 @@ void Init_serialport()
    rb_define_const(cSerialPort, "EVEN", INT2FIX(EVEN));
    rb_define_const(cSerialPort, "ODD", INT2FIX(ODD));
 
+   rb_define_const(cSerialPort, "LINE_RTS", INT2FIX(LINE_RTS));
+   rb_define_const(cSerialPort, "LINE_DTR", INT2FIX(LINE_DTR));
+   rb_define_const(cSerialPort, "LINE_CTS", INT2FIX(LINE_CTS));
+   rb_define_const(cSerialPort, "LINE_DSR", INT2FIX(LINE_DSR));
+   rb_define_const(cSerialPort, "LINE_DCD", INT2FIX(LINE_DCD));
+   rb_define_const(cSerialPort, "LINE_RI", INT2FIX(LINE_RI));
+
    /* the package's version as a string "X.Y.Z", beeing major, minor and patch level */
    rb_define_const(cSerialPort, "VERSION", rb_str_new2(RUBY_SERIAL_PORT_VERSION));
 }
@@ -29,6 +29,67 @@
 #else
    #include <rubyio.h>
 #endif
+#ifdef HAVE_RUBY_THREAD_H
+   #include <ruby/thread.h>
+#endif
+
+#ifndef RSTRING_PTR
+   #define RSTRING_PTR(s) (RSTRING(s)->ptr)
+   #define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+#ifndef RB_GC_GUARD
+   #define RB_GC_GUARD(v) (v)
+#endif
+#ifndef RUBY_1_9
+   #define rb_str_set_len(s, n) \
+      (RSTRING(s)->len = (n), RSTRING(s)->ptr[RSTRING(s)->len] = '\0')
+#endif
+
+/* Full memory barrier between the receive thread and Ruby */
+#if defined(_MSC_VER)
+   #define SP_MEMORY_BARRIER() MemoryBarrier()
+#else
+   #define SP_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+/*
+ * When the data up to byte end of a stream arrived, in nanoseconds on
+ * the CLOCK_MONOTONIC (QueryPerformanceCounter) clock. See
+ * SerialPort#read_stamped.
+ */
+struct rx_stamp
+{
+   unsigned long end;
+   LONG_LONG ns;
+};
+
+/* stamps the receive thread keeps, a power of two */
+#define RX_STAMPS 1024
+
+/*
+ * Single-producer/single-consumer receive ring. The native receive
+ * thread only advances head, Ruby only advances tail.
+ */
+struct rx_ring
+{
+   char *buf;
+   unsigned long mask;              /* size - 1, the size is a power of two */
+   volatile unsigned long head;     /* bytes written by the thread */
+   volatile unsigned long tail;     /* bytes consumed by Ruby */
+   volatile int waiting;            /* Ruby is waiting for the thread */
+   volatile int full;               /* the thread is waiting for Ruby */
+   volatile int stop;               /* asks the thread to exit */
+   volatile int eof;                /* the thread saw end of file */
+   volatile int error;              /* errno (GetLastError) that stopped it */
+   volatile unsigned long reads;    /* read calls that returned data */
+   void *impl;                      /* platform thread state */
+   struct port_data *pd;            /* the port, for its capture */
+
+   /* one stamp per read of the thread, for SerialPort#read_stamped */
+   struct rx_stamp stamps[RX_STAMPS];
+   volatile unsigned long stamp_head;  /* stamps written by the thread */
+   unsigned long stamp_tail;           /* next stamp to look at */
+};
 
 struct modem_params
 {
@@ -43,6 +104,54 @@ struct modem_params
 #endif
 };
 
+/* Counters kept for SerialPort#stats, updated with the GVL held */
+struct port_stats
+{
+   unsigned long bytes_in;
+   unsigned long bytes_out;
+   unsigned long reads;       /* read system calls that returned */
+   unsigned long writes;      /* write system calls that returned */
+   unsigned long timeouts;    /* waits that ran out before data or room */
+   unsigned long short_reads; /* reads returning less than asked for */
+   unsigned long eagain;
+   unsigned long eintr;
+
+   /* line errors, accumulated from ClearCommError on Windows */
+   unsigned long frame;
+   unsigned long parity;
+   unsigned long overrun;
+};
+
+struct sp_capture;
+struct sp_share;
+
+/* Per-port state kept by the extension next to the IO object. */
+struct port_data
+{
+   int mp_valid;              /* non-zero once mp holds the port settings */
+   struct modem_params mp;    /* last settings applied or read back */
+   int inter_byte_timeout;    /* default for SerialPort#read_timed, ms or -1 */
+   int read_min_bytes;        /* VMIN used with non-negative read timeouts */
+   int vmin_users;            /* POSIX: native reads running with VMIN lowered */
+   int vmin_saved;            /* POSIX: VMIN to restore after them */
+   int overlapped;            /* Windows: handle opened for overlapped I/O */
+   int nonblock;              /* POSIX: O_NONBLOCK left set, see :nonblock */
+   int nonblock_writers;      /* POSIX: native writes running with O_NONBLOCK */
+   int nonblock_set;          /* POSIX: O_NONBLOCK set for them, to clear after */
+   struct rx_ring *ring;      /* set while a receive thread runs */
+   double modbus_idle_at;     /* ms, when the next Modbus RTU frame may start */
+   struct port_stats stats;
+   struct sp_capture *capture;  /* set while SerialPort#start_capture records */
+   struct sp_share *share;      /* set while SerialPort#share publishes */
+
+   /* data received by the framing readers but not consumed yet */
+   char *rbuf;
+   long rbuf_len;
+   long rbuf_capa;
+   int rbuf_filling;          /* a thread reads for sp_rbuf_fill */
+   unsigned long rbuf_consumed;   /* bytes consumed so far, see read_line */
+};
+
 struct line_signals
 {
    int rts;
@@ -53,10 +162,29 @@ struct line_signals
    int ri;
 };
 
+/* RS-485 direction control, see SerialPort#rs485= */
+struct rs485_params
+{
+   int enabled;
+   int rts_on_send;        /* RTS level while sending */
+   int rts_after_send;     /* RTS level once sent */
+   int delay_before;       /* ms between raising RTS and the first bit */
+   int delay_after;        /* ms between the last bit and dropping RTS */
+};
+
 #define NONE   0
 #define HARD   1
 #define SOFT   2
 
+/* Modem line bits, see SerialPort#signal_bits */
+#define LINE_RTS   0x01
+#define LINE_DTR   0x02
+#define LINE_CTS   0x04
+#define LINE_DSR   0x08
+#define LINE_DCD   0x10
+#define LINE_RI    0x20
+#define LINE_INPUTS  (LINE_CTS | LINE_DSR | LINE_DCD | LINE_RI)
+
 #if defined(OS_MSWIN) || defined(OS_BCCWIN) || defined(OS_MINGW)
    #define SPACE  SPACEPARITY
    #define MARK   MARKPARITY
@@ -87,22 +215,252 @@ extern VALUE sWriteTimeout;
 #endif
 extern VALUE sRts, sDtr, sCts, sDsr, sDcd, sRi;
 
+/*
+ * Run func(data) with the GVL released (when the interpreter has one).
+ * sp_blocking_call_ubf calls ubf(ubf_data) from another thread to wake
+ * func early when the blocked thread is interrupted.
+ */
+void *sp_blocking_call(void *(*func)(void *), void *data);
+void *sp_blocking_call_ubf(void *(*func)(void *), void *data,
+                           void (*ubf)(void *), void *ubf_data);
+
+struct port_data *get_port_data(VALUE obj);
+void get_modem_params(VALUE self, struct modem_params *mp);
+void cache_modem_params(VALUE self, struct modem_params *mp);
+
+/* Receive buffer, see serialport.c */
+long sp_rbuf_fill(VALUE self, struct port_data *pd, int timeout);
+long sp_rbuf_take(struct port_data *pd, char *buf, long len);
+void sp_rbuf_consume(struct port_data *pd, long len);
+
+/* Records of a String returned by SerialPort#read_stamped */
+void sp_stamp_append(VALUE stamps, long end, LONG_LONG ns);
+
+/* Options given to SerialPort#new or SerialPort#open */
+VALUE sp_open_option(VALUE options, const char *name);
+int sp_open_size_option(VALUE options, const char *name, int def);
+
+/* A SerialPort::Selector and the ports registered with it */
+struct selector_entry
+{
+   VALUE port;
+   intptr_t handle;           /* file descriptor, or HANDLE on Windows */
+};
+
+struct selector
+{
+   struct selector_entry *entries;
+   long count;
+   long capa;
+   long backend;              /* epoll or kqueue descriptor, -1 if none */
+   int closed;
+
+   /*
+    * Buffers for SerialPort::Selector#select, grown by register to hold
+    * wait_capa ports. A select takes them out while it waits, leaving
+    * NULL, so a concurrent one allocates its own.
+    */
+   intptr_t *wait_handles;
+   char *wait_ready;
+   char *wait_events;         /* wait_capa events of sp_selector_wait_impl */
+   long wait_capa;
+};
+
+/* Receive thread, see serialport_ring.c */
+void sp_ring_start(VALUE self, struct port_data *pd, long size);
+void sp_ring_stop(struct port_data *pd, int port_open);
+void sp_ring_free(struct rx_ring *ring);
+long sp_ring_count(struct rx_ring *ring);
+void sp_ring_discard(struct rx_ring *ring);
+long sp_ring_read(struct rx_ring *ring, char *buf, long len, int timeout);
+long sp_ring_read_timed(struct rx_ring *ring, char *buf, long len,
+                        int timeout, int interval);
+long sp_ring_read_stamped(struct rx_ring *ring, char *buf, long len,
+                          int timeout, VALUE stamps, long offset);
+void sp_ring_stamp(struct rx_ring *ring, unsigned long end, LONG_LONG ns);
+
+/* Checksums, see serialport_checksum.c */
+#define CHECKSUM_NONE          0
+#define CHECKSUM_CRC16_MODBUS  1
+#define CHECKSUM_CRC_CCITT     2
+#define CHECKSUM_CRC32         3
+#define CHECKSUM_LRC           4
+
+unsigned int sp_crc16_modbus(unsigned int crc, const unsigned char *buf, long len);
+unsigned int sp_crc_ccitt(unsigned int crc, const unsigned char *buf, long len);
+unsigned int sp_crc32(unsigned int crc, const unsigned char *buf, long len);
+unsigned int sp_lrc(const unsigned char *buf, long len);
+int sp_checksum_kind(VALUE sym);
+int sp_checksum_size(int kind);
+void sp_checksum_put(int kind, const unsigned char *buf, long len, unsigned char *out);
+int sp_checksum_valid(int kind, const unsigned char *buf, long len);
+
+#if defined(OS_LINUX)
+/* termios2 wrappers, see posix_termios2.c */
+int sp_set_termios2_speed(int fd, int baud);
+int sp_get_termios2_speed(int fd);
+#endif
+
+void Init_serialport_frame(VALUE klass);
+void Init_serialport_selector(VALUE klass);
+void Init_serialport_checksum(VALUE klass);
+void Init_serialport_modbus(VALUE klass);
+void Init_serialport_capture(VALUE klass);
+void Init_serialport_shared(VALUE klass);
+
+/* Capture files, see serialport_capture.c */
+#define CAPTURE_RX     0
+#define CAPTURE_TX     1
+#define CAPTURE_START  2
+
+void sp_capture_record(struct port_data *pd, int kind, const char *buf,
+                       long len, LONG_LONG ns);
+int sp_capture_stop(struct port_data *pd);
+
+/* Shared memory fan-out, see serialport_shared.c */
+void sp_share_publish(struct port_data *pd, const char *buf, long len);
+void sp_share_stop(struct port_data *pd);
+
 /* Implementation specific functions. */
-VALUE RB_SERIAL_EXPORT sp_create_impl(VALUE class, VALUE _port);
+VALUE RB_SERIAL_EXPORT sp_create_impl(VALUE class, VALUE _port, VALUE options,
+                                      int argc, VALUE *argv);
 VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(int argc, VALUE *argv, VALUE self);
 void RB_SERIAL_EXPORT get_modem_params_impl(VALUE self, struct modem_params *mp);
 VALUE RB_SERIAL_EXPORT sp_set_flow_control_impl(VALUE self, VALUE val);
-VALUE RB_SERIAL_EXPORT sp_get_flow_control_impl(VALUE self);
 VALUE RB_SERIAL_EXPORT sp_set_read_timeout_impl(VALUE self, VALUE val);
-VALUE RB_SERIAL_EXPORT sp_get_read_timeout_impl(VALUE self);
 VALUE RB_SERIAL_EXPORT sp_set_write_timeout_impl(VALUE self, VALUE val);
 VALUE RB_SERIAL_EXPORT sp_get_write_timeout_impl(VALUE self);
+VALUE RB_SERIAL_EXPORT sp_set_low_latency_impl(VALUE self, VALUE val);
+VALUE RB_SERIAL_EXPORT sp_get_low_latency_impl(VALUE self);
+void RB_SERIAL_EXPORT sp_set_rs485_impl(VALUE self, struct rs485_params *rs);
+void RB_SERIAL_EXPORT sp_get_rs485_impl(VALUE self, struct rs485_params *rs);
 VALUE RB_SERIAL_EXPORT sp_break_impl(VALUE self, VALUE time);
 void RB_SERIAL_EXPORT get_line_signals_helper_impl(VALUE obj, struct line_signals *ls);
 VALUE RB_SERIAL_EXPORT set_signal_impl(VALUE obj, VALUE val, int sig);
+int RB_SERIAL_EXPORT sp_get_signal_bits_impl(VALUE self);
+void RB_SERIAL_EXPORT sp_set_signal_bits_impl(VALUE self, int set, int clear);
 VALUE RB_SERIAL_EXPORT sp_set_rts_impl(VALUE self, VALUE val);
 VALUE RB_SERIAL_EXPORT sp_set_dtr_impl(VALUE self, VALUE val);
 VALUE RB_SERIAL_EXPORT sp_get_rts_impl(VALUE self);
 VALUE RB_SERIAL_EXPORT sp_get_dtr_impl(VALUE self);
 
+/*
+ * Wait up to timeout milliseconds (-1 forever) until one of the input
+ * lines in mask (LINE_* bits) changes. Returns the bits that changed, 0
+ * on timeout.
+ */
+int RB_SERIAL_EXPORT sp_wait_signal_change_impl(VALUE self, int mask, int timeout);
+VALUE RB_SERIAL_EXPORT sp_get_line_counters_impl(VALUE self);
+int RB_SERIAL_EXPORT sp_get_line_errors_impl(VALUE self, struct port_stats *st);
+
+/*
+ * Selector back end. sp_selector_add_impl returns the handle stored in
+ * the entry. sp_selector_wait_impl waits up to timeout milliseconds (-1
+ * forever) until one of the n handles is readable, sets ready[i] for
+ * each readable handles[i] and returns how many are ready. Its events
+ * has room for n + 1 platform events of sp_selector_event_size_impl
+ * bytes each.
+ */
+void RB_SERIAL_EXPORT sp_selector_init_impl(struct selector *sel);
+void RB_SERIAL_EXPORT sp_selector_close_impl(struct selector *sel);
+intptr_t RB_SERIAL_EXPORT sp_selector_add_impl(struct selector *sel, VALUE port);
+void RB_SERIAL_EXPORT sp_selector_remove_impl(struct selector *sel, intptr_t handle);
+long RB_SERIAL_EXPORT sp_selector_wait_impl(struct selector *sel, intptr_t *handles,
+                                            long n, int timeout, char *ready,
+                                            char *events);
+long RB_SERIAL_EXPORT sp_selector_event_size_impl(void);
+
+/*
+ * Receive thread back end. sp_rx_thread_start_impl takes ownership of
+ * ring and frees it with sp_ring_free if the thread can't be started.
+ * sp_rx_thread_stop_impl must neither raise nor call Ruby; port_open is
+ * zero when the port may already be closed. sp_rx_thread_space_impl
+ * wakes a thread waiting for room in its full ring, and must not raise
+ * either. sp_ring_wait_impl waits up to timeout milliseconds for data or
+ * end of file and returns non-zero if either arrived, raising if the
+ * thread failed.
+ */
+void RB_SERIAL_EXPORT sp_rx_thread_start_impl(VALUE self, struct rx_ring *ring);
+void RB_SERIAL_EXPORT sp_rx_thread_stop_impl(struct rx_ring *ring, int port_open);
+void RB_SERIAL_EXPORT sp_rx_thread_space_impl(struct rx_ring *ring);
+int RB_SERIAL_EXPORT sp_ring_wait_impl(struct rx_ring *ring, int timeout);
+double RB_SERIAL_EXPORT sp_monotonic_ms_impl(void);
+LONG_LONG RB_SERIAL_EXPORT sp_monotonic_ns_impl(void);
+
+/*
+ * The serial ports of the system as an Array of Hashes with the keys of
+ * SerialPort.list, in no particular order.
+ */
+VALUE RB_SERIAL_EXPORT sp_list_impl(void);
+
+/*
+ * Named shared memory for SerialPort#share. sp_shm_create_impl maps size
+ * new bytes read-write under name, in place of an unused old mapping
+ * (one starting with SP_SHARE_MAGIC whose owner is gone; a live one
+ * raises IOError, anything else fails with EEXIST); sp_shm_open_impl
+ * maps an existing one read-only and stores its size. Both raise on
+ * failure and leave the platform state in *impl. sp_shm_close_impl
+ * unmaps it and, for the creator, removes the name if it still names
+ * the same mapping.
+ */
+#define SP_SHARE_MAGIC "SPSHR001"
+
+char * RB_SERIAL_EXPORT sp_shm_create_impl(const char *name, unsigned long size,
+                                           void **impl);
+char * RB_SERIAL_EXPORT sp_shm_open_impl(const char *name, unsigned long *size,
+                                         void **impl);
+void RB_SERIAL_EXPORT sp_shm_close_impl(const char *name, char *addr,
+                                        unsigned long size, void *impl, int owner);
+
+/* Bytes received by the driver and not read yet */
+long RB_SERIAL_EXPORT sp_bytes_available_impl(VALUE self);
+
+/*
+ * Output queue. sp_output_queue_impl returns the bytes not sent yet,
+ * sp_drain_impl waits up to timeout milliseconds (-1 forever) until all
+ * are sent and returns non-zero if they were. sp_flush_impl discards the
+ * driver's input and/or output queue.
+ */
+long RB_SERIAL_EXPORT sp_output_queue_impl(VALUE self);
+int RB_SERIAL_EXPORT sp_drain_impl(VALUE self, int timeout);
+void RB_SERIAL_EXPORT sp_flush_impl(VALUE self, int input, int output);
+
+/*
+ * Native reads and writes. <tt>timeout</tt> is in milliseconds, a negative
+ * value waits forever. sp_read_impl returns the number of bytes read, 0 on
+ * timeout or -1 on end of file. sp_write_impl returns the number of bytes
+ * written, 0 on timeout.
+ */
+long RB_SERIAL_EXPORT sp_read_impl(VALUE self, char *buf, long len, int timeout);
+long RB_SERIAL_EXPORT sp_write_impl(VALUE self, const char *buf, long len, int timeout);
+
+/* sp_write_impl for several pieces, strings is an Array of frozen Strings */
+long RB_SERIAL_EXPORT sp_writev_impl(VALUE self, VALUE strings, int timeout);
+
+/*
+ * Breaks timed in microseconds. sp_send_break_impl waits for the output
+ * to drain, holds the line in break for break_us and then at mark for
+ * mab_us; sp_break_write_impl does that right before writing buf like
+ * sp_write_impl, without returning to Ruby in between.
+ */
+void RB_SERIAL_EXPORT sp_send_break_impl(VALUE self, long break_us, long mab_us);
+long RB_SERIAL_EXPORT sp_break_write_impl(VALUE self, const char *buf, long len,
+                                          long break_us, long mab_us, int timeout);
+
+/*
+ * Read until len bytes arrived, timeout milliseconds passed or, once data
+ * has been received, the line was idle for interval milliseconds (-1
+ * disables either limit). Returns the number of bytes read or -1 on end
+ * of file.
+ */
+long RB_SERIAL_EXPORT sp_read_timed_impl(VALUE self, char *buf, long len,
+                                         int timeout, int interval);
+
+/*
+ * sp_read_impl that also appends the arrival time of the data to stamps
+ * with sp_stamp_append, offset being where buf starts in the result.
+ */
+long RB_SERIAL_EXPORT sp_read_stamped_impl(VALUE self, char *buf, long len,
+                                           int timeout, VALUE stamps, long offset);
+
 #endif
@@ -0,0 +1,218 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Recording the traffic of a port to a capture file. The native read and
+ * write paths hand every chunk to sp_capture_record, which appends it to
+ * a buffered stdio stream; SerialPort::Capture (lib/serialport.rb) reads
+ * and replays the files.
+ *
+ * A capture file starts with CAPTURE_MAGIC and continues with records of
+ * a 16 byte header followed by the data, all integers little endian:
+ *
+ *    int64  time, nanoseconds on the clock of SerialPort#read_stamped
+ *    uint32 data length
+ *    uint8  CAPTURE_RX, CAPTURE_TX or CAPTURE_START
+ *    3 bytes of zero
+ *
+ * Every SerialPort#start_capture appends a CAPTURE_START record whose
+ * data is the wall clock time in seconds since the Unix epoch (int64),
+ * so runs appended to the same file can be told apart.
+ */
+
+#include "serialport.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define CAPTURE_MAGIC   "SPCAP001"
+#define CAPTURE_BUFFER  65536
+
+struct sp_capture
+{
+   FILE *fp;
+};
+
+static void put_le(out, value, size)
+   unsigned char *out;
+   unsigned LONG_LONG value;
+   int size;
+{
+   int i;
+
+   for (i = 0; i < size; i++)
+   {
+      out[i] = (unsigned char) (value >> (8 * i));
+   }
+}
+
+static int write_record(fp, kind, buf, len, ns)
+   FILE *fp;
+   int kind;
+   const char *buf;
+   long len;
+   LONG_LONG ns;
+{
+   unsigned char header[16];
+
+   memset(header, 0, sizeof(header));
+   put_le(header, (unsigned LONG_LONG) ns, 8);
+   put_le(header + 8, (unsigned LONG_LONG) len, 4);
+   header[12] = (unsigned char) kind;
+
+   return fwrite(header, sizeof(header), 1, fp) == 1 &&
+          (len == 0 || fwrite(buf, len, 1, fp) == 1);
+}
+
+/*
+ * :nodoc: Close the capture of pd, if any. Returns 0, or the errno of a
+ * failed flush.
+ */
+int sp_capture_stop(pd)
+   struct port_data *pd;
+{
+   struct sp_capture *cap = pd->capture;
+   int err = 0;
+
+   if (cap == NULL)
+   {
+      return 0;
+   }
+
+   pd->capture = NULL;
+   if (fclose(cap->fp) != 0)
+   {
+      err = errno;
+   }
+   xfree(cap);
+
+   return err;
+}
+
+/*
+ * :nodoc: Append len bytes of buf, moved in direction kind at ns, to the
+ * capture of pd. Called with the GVL held. A failing capture is stopped
+ * with a warning rather than failing the port I/O it records.
+ */
+void sp_capture_record(pd, kind, buf, len, ns)
+   struct port_data *pd;
+   int kind;
+   const char *buf;
+   long len;
+   LONG_LONG ns;
+{
+   if (pd->capture == NULL || len <= 0)
+   {
+      return;
+   }
+
+   if (!write_record(pd->capture->fp, kind, buf, len, ns))
+   {
+      rb_warn("serial port capture stopped: %s", strerror(errno));
+      sp_capture_stop(pd);
+   }
+}
+
+/*
+ * Start recording the data read and written through the port to the
+ * file at <tt>path</tt>, appending if it exists. Both directions are
+ * recorded with nanosecond timestamps by the native readers and writers
+ * (SerialPort#sysread_timeout, #read_timed, #read_into, #each_frame,
+ * #syswrite_timeout, #write_partial, #write_v, ...), without copying
+ * the data into Ruby objects; the IO methods are not recorded. Received
+ * data is stamped when it is read from the driver, or on ports with
+ * <tt>:rx_thread</tt> when it is taken from the ring.
+ *
+ * The file is written through a 64 KiB buffer, which
+ * SerialPort#stop_capture and SerialPort#close flush.
+ * SerialPort::Capture reads and replays it.
+ *
+ *    sp.start_capture("field.spcap")
+ */
+static VALUE sp_start_capture(self, path)
+   VALUE self, path;
+{
+   struct port_data *pd = get_port_data(self);
+   struct sp_capture *cap;
+   unsigned char now[8];
+   FILE *fp;
+
+   if (pd->capture != NULL)
+   {
+      rb_raise(rb_eIOError, "already capturing");
+   }
+
+   FilePathValue(path);
+   fp = fopen(RSTRING_PTR(path), "ab");
+   if (fp == NULL)
+   {
+      rb_sys_fail(RSTRING_PTR(path));
+   }
+   setvbuf(fp, NULL, _IOFBF, CAPTURE_BUFFER);
+
+   /* append mode starts at the end, so an empty file is a new one */
+   fseek(fp, 0, SEEK_END);
+   if (ftell(fp) == 0)
+   {
+      fwrite(CAPTURE_MAGIC, 8, 1, fp);
+   }
+
+   put_le(now, (unsigned LONG_LONG) time(NULL), 8);
+   if (!write_record(fp, CAPTURE_START, (char *) now, 8, sp_monotonic_ns_impl()) ||
+       fflush(fp) != 0)
+   {
+      int err = errno;
+
+      fclose(fp);
+      errno = err;
+      rb_sys_fail(RSTRING_PTR(path));
+   }
+
+   cap = ALLOC(struct sp_capture);
+   cap->fp = fp;
+   pd->capture = cap;
+
+   return self;
+}
+
+/*
+ * Stop the capture started by SerialPort#start_capture and flush the
+ * file. Does nothing if the port isn't capturing.
+ */
+static VALUE sp_stop_capture(self)
+   VALUE self;
+{
+   int err = sp_capture_stop(get_port_data(self));
+
+   if (err != 0)
+   {
+      errno = err;
+      rb_sys_fail("capture");
+   }
+
+   return self;
+}
+
+/*
+ * Returns true while SerialPort#start_capture records the port.
+ */
+static VALUE sp_capturing_p(self)
+   VALUE self;
+{
+   return get_port_data(self)->capture != NULL ? Qtrue : Qfalse;
+}
+
+void Init_serialport_capture(klass)
+   VALUE klass;
+{
+   rb_define_method(klass, "start_capture", sp_start_capture, 1);
+   rb_define_method(klass, "stop_capture", sp_stop_capture, 0);
+   rb_define_method(klass, "capturing?", sp_capturing_p, 0);
+}
@@ -0,0 +1,400 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Checksums used by serial protocols, table driven. CRC-32 processes
+ * eight bytes per step (slice-by-8).
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+
+static unsigned short crc16_modbus_table[256];
+static unsigned short crc_ccitt_table[256];
+static unsigned int crc32_table[8][256];
+
+static ID id_crc16_modbus, id_crc_ccitt, id_crc32, id_lrc;
+
+static void init_tables(void)
+{
+   unsigned int c, i, k;
+
+   for (i = 0; i < 256; i++)
+   {
+      /* CRC-16/MODBUS, reflected polynomial 0x8005 */
+      c = i;
+      for (k = 0; k < 8; k++)
+      {
+         c = (c & 1) ? (c >> 1) ^ 0xA001 : c >> 1;
+      }
+      crc16_modbus_table[i] = (unsigned short) c;
+
+      /* CRC-16/CCITT-FALSE, polynomial 0x1021 */
+      c = i << 8;
+      for (k = 0; k < 8; k++)
+      {
+         c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+      }
+      crc_ccitt_table[i] = (unsigned short) c;
+
+      /* CRC-32 (IEEE 802.3), reflected polynomial 0x04C11DB7 */
+      c = i;
+      for (k = 0; k < 8; k++)
+      {
+         c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+      }
+      crc32_table[0][i] = c;
+   }
+
+   /* crc32_table[k][b]: b followed by k zero bytes */
+   for (i = 0; i < 256; i++)
+   {
+      c = crc32_table[0][i];
+      for (k = 1; k < 8; k++)
+      {
+         c = (c >> 8) ^ crc32_table[0][c & 0xFF];
+         crc32_table[k][i] = c;
+      }
+   }
+}
+
+unsigned int sp_crc16_modbus(crc, buf, len)
+   unsigned int crc;
+   const unsigned char *buf;
+   long len;
+{
+   while (len-- > 0)
+   {
+      crc = (crc >> 8) ^ crc16_modbus_table[(crc ^ *buf++) & 0xFF];
+   }
+
+   return crc & 0xFFFF;
+}
+
+unsigned int sp_crc_ccitt(crc, buf, len)
+   unsigned int crc;
+   const unsigned char *buf;
+   long len;
+{
+   while (len-- > 0)
+   {
+      crc = (crc << 8) ^ crc_ccitt_table[((crc >> 8) ^ *buf++) & 0xFF];
+   }
+
+   return crc & 0xFFFF;
+}
+
+unsigned int sp_crc32(crc, buf, len)
+   unsigned int crc;
+   const unsigned char *buf;
+   long len;
+{
+   unsigned int lo, hi;
+
+   crc = ~crc;
+
+   while (len >= 8)
+   {
+      lo = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (unsigned int) buf[3] << 24);
+      hi = buf[4] | buf[5] << 8 | buf[6] << 16 | (unsigned int) buf[7] << 24;
+
+      crc = crc32_table[7][lo & 0xFF] ^
+            crc32_table[6][(lo >> 8) & 0xFF] ^
+            crc32_table[5][(lo >> 16) & 0xFF] ^
+            crc32_table[4][lo >> 24] ^
+            crc32_table[3][hi & 0xFF] ^
+            crc32_table[2][(hi >> 8) & 0xFF] ^
+            crc32_table[1][(hi >> 16) & 0xFF] ^
+            crc32_table[0][hi >> 24];
+
+      buf += 8;
+      len -= 8;
+   }
+
+   while (len-- > 0)
+   {
+      crc = (crc >> 8) ^ crc32_table[0][(crc ^ *buf++) & 0xFF];
+   }
+
+   return ~crc & 0xFFFFFFFF;
+}
+
+/*
+ * Modbus ASCII LRC: the two's complement of the byte sum.
+ */
+unsigned int sp_lrc(buf, len)
+   const unsigned char *buf;
+   long len;
+{
+   unsigned int sum = 0;
+
+   while (len-- > 0)
+   {
+      sum += *buf++;
+   }
+
+   return (-sum) & 0xFF;
+}
+
+/*
+ * :nodoc: The CHECKSUM_* kind named by sym, raising ArgumentError for
+ * unknown names.
+ */
+int sp_checksum_kind(sym)
+   VALUE sym;
+{
+   ID id;
+
+   if (SYMBOL_P(sym))
+   {
+      id = SYM2ID(sym);
+      if (id == id_crc16_modbus)
+      {
+         return CHECKSUM_CRC16_MODBUS;
+      }
+      if (id == id_crc_ccitt)
+      {
+         return CHECKSUM_CRC_CCITT;
+      }
+      if (id == id_crc32)
+      {
+         return CHECKSUM_CRC32;
+      }
+      if (id == id_lrc)
+      {
+         return CHECKSUM_LRC;
+      }
+   }
+
+   rb_raise(rb_eArgError, "unknown checksum");
+   return CHECKSUM_NONE;
+}
+
+/*
+ * :nodoc: Number of bytes the checksum takes at the end of a frame.
+ */
+int sp_checksum_size(kind)
+   int kind;
+{
+   switch (kind)
+   {
+      case CHECKSUM_CRC16_MODBUS:
+      case CHECKSUM_CRC_CCITT:
+         return 2;
+      case CHECKSUM_CRC32:
+         return 4;
+      case CHECKSUM_LRC:
+         return 1;
+   }
+
+   return 0;
+}
+
+/*
+ * :nodoc: Store the checksum of buf[0, len] in out, in the byte order it
+ * is sent in: least significant byte first for CRC-16/MODBUS and CRC-32
+ * (as Modbus RTU and Ethernet do), most significant first for
+ * CRC-CCITT.
+ */
+void sp_checksum_put(kind, buf, len, out)
+   int kind;
+   const unsigned char *buf;
+   long len;
+   unsigned char *out;
+{
+   unsigned int crc;
+
+   switch (kind)
+   {
+      case CHECKSUM_CRC16_MODBUS:
+         crc = sp_crc16_modbus(0xFFFF, buf, len);
+         out[0] = crc & 0xFF;
+         out[1] = crc >> 8;
+         break;
+      case CHECKSUM_CRC_CCITT:
+         crc = sp_crc_ccitt(0xFFFF, buf, len);
+         out[0] = crc >> 8;
+         out[1] = crc & 0xFF;
+         break;
+      case CHECKSUM_CRC32:
+         crc = sp_crc32(0, buf, len);
+         out[0] = crc & 0xFF;
+         out[1] = (crc >> 8) & 0xFF;
+         out[2] = (crc >> 16) & 0xFF;
+         out[3] = crc >> 24;
+         break;
+      case CHECKSUM_LRC:
+         out[0] = sp_lrc(buf, len);
+         break;
+   }
+}
+
+/*
+ * :nodoc: Non-zero if the last bytes of buf[0, len] hold the checksum of
+ * the bytes before them.
+ */
+int sp_checksum_valid(kind, buf, len)
+   int kind;
+   const unsigned char *buf;
+   long len;
+{
+   unsigned char sum[4];
+   int size = sp_checksum_size(kind);
+
+   if (len < size)
+   {
+      return 0;
+   }
+
+   sp_checksum_put(kind, buf, len - size, sum);
+   return memcmp(sum, buf + len - size, size) == 0;
+}
+
+static unsigned int get_crc_arg(argc, argv, str, def)
+   int argc;
+   VALUE *argv, *str;
+   unsigned int def;
+{
+   VALUE _crc;
+
+   rb_scan_args(argc, argv, "11", str, &_crc);
+   StringValue(*str);
+
+   return NIL_P(_crc) ? def : (unsigned int) NUM2ULONG(_crc);
+}
+
+/*
+ * Returns the CRC-16/MODBUS of <tt>string</tt>. Pass the result for the
+ * previous part as <tt>crc</tt> to checksum data given in pieces.
+ *
+ *    SerialPort::Checksum.crc16_modbus("123456789")   # => 0x4B37
+ */
+static VALUE sp_checksum_crc16_modbus(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE str;
+   unsigned int crc = get_crc_arg(argc, argv, &str, 0xFFFF);
+
+   (void) self;
+   return INT2FIX(sp_crc16_modbus(crc, (unsigned char *) RSTRING_PTR(str),
+                                  RSTRING_LEN(str)));
+}
+
+/*
+ * Returns the CRC-16/CCITT-FALSE (initial value 0xFFFF) of
+ * <tt>string</tt>, continuing from <tt>crc</tt> if given.
+ *
+ *    SerialPort::Checksum.crc_ccitt("123456789")      # => 0x29B1
+ */
+static VALUE sp_checksum_crc_ccitt(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE str;
+   unsigned int crc = get_crc_arg(argc, argv, &str, 0xFFFF);
+
+   (void) self;
+   return INT2FIX(sp_crc_ccitt(crc, (unsigned char *) RSTRING_PTR(str),
+                               RSTRING_LEN(str)));
+}
+
+/*
+ * Returns the CRC-32 of <tt>string</tt>, continuing from <tt>crc</tt> if
+ * given. The same value as Zlib.crc32.
+ *
+ *    SerialPort::Checksum.crc32("123456789")          # => 0xCBF43926
+ */
+static VALUE sp_checksum_crc32(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE str;
+   unsigned int crc = get_crc_arg(argc, argv, &str, 0);
+
+   (void) self;
+   return ULONG2NUM(sp_crc32(crc, (unsigned char *) RSTRING_PTR(str),
+                             RSTRING_LEN(str)));
+}
+
+/*
+ * Returns the Modbus ASCII longitudinal redundancy check of
+ * <tt>string</tt>.
+ */
+static VALUE sp_checksum_lrc(self, str)
+   VALUE self, str;
+{
+   (void) self;
+   StringValue(str);
+
+   return INT2FIX(sp_lrc((unsigned char *) RSTRING_PTR(str), RSTRING_LEN(str)));
+}
+
+/*
+ * Returns <tt>string</tt> followed by its checksum, in the byte order
+ * SerialPort#each_frame expects with the <tt>:checksum</tt> option.
+ * <tt>kind</tt> is :crc16_modbus, :crc_ccitt, :crc32 or :lrc.
+ *
+ *    sp.write(SerialPort::Checksum.append(:crc16_modbus, request))
+ */
+static VALUE sp_checksum_append(self, kind, str)
+   VALUE self, kind, str;
+{
+   int k = sp_checksum_kind(kind);
+   long len;
+   VALUE out;
+
+   (void) self;
+   StringValue(str);
+   len = RSTRING_LEN(str);
+
+   out = rb_str_new(0, len + sp_checksum_size(k));
+   memcpy(RSTRING_PTR(out), RSTRING_PTR(str), len);
+   sp_checksum_put(k, (unsigned char *) RSTRING_PTR(out), len,
+                   (unsigned char *) RSTRING_PTR(out) + len);
+
+   return out;
+}
+
+/*
+ * Returns true if <tt>string</tt> ends with a valid checksum of the
+ * given <tt>kind</tt>, as added by SerialPort::Checksum.append.
+ */
+static VALUE sp_checksum_valid_p(self, kind, str)
+   VALUE self, kind, str;
+{
+   int k = sp_checksum_kind(kind);
+
+   (void) self;
+   StringValue(str);
+
+   return sp_checksum_valid(k, (unsigned char *) RSTRING_PTR(str),
+                            RSTRING_LEN(str)) ? Qtrue : Qfalse;
+}
+
+void Init_serialport_checksum(klass)
+   VALUE klass;
+{
+   VALUE mChecksum;
+
+   init_tables();
+
+   id_crc16_modbus = rb_intern("crc16_modbus");
+   id_crc_ccitt = rb_intern("crc_ccitt");
+   id_crc32 = rb_intern("crc32");
+   id_lrc = rb_intern("lrc");
+
+   mChecksum = rb_define_module_under(klass, "Checksum");
+   rb_define_module_function(mChecksum, "crc16_modbus", sp_checksum_crc16_modbus, -1);
+   rb_define_module_function(mChecksum, "crc_ccitt", sp_checksum_crc_ccitt, -1);
+   rb_define_module_function(mChecksum, "crc32", sp_checksum_crc32, -1);
+   rb_define_module_function(mChecksum, "lrc", sp_checksum_lrc, 1);
+   rb_define_module_function(mChecksum, "append", sp_checksum_append, 2);
+   rb_define_module_function(mChecksum, "valid?", sp_checksum_valid_p, 2);
+}
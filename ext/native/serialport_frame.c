@@ -0,0 +1,572 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Splitting the received byte stream into frames and lines, so that only
+ * complete ones are handed to Ruby.
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+#include <math.h>
+
+#define FRAME_DELIMITER  0
+#define FRAME_LENGTH     1
+#define FRAME_SLIP       2
+#define FRAME_COBS       3
+
+#define SLIP_END      0xC0
+#define SLIP_ESC      0xDB
+#define SLIP_ESC_END  0xDC
+#define SLIP_ESC_ESC  0xDD
+
+#define DEFAULT_MAX_LENGTH 65536
+
+static const char slip_end[] = { (char) SLIP_END };
+static const char cobs_end[] = { 0 };
+
+static ID id_delimiter, id_length_prefix, id_encoding, id_max_length;
+static ID id_timeout, id_slip, id_cobs, id_checksum;
+
+struct frame_spec
+{
+   int type;
+   VALUE delim_str;
+   const char *delim;
+   long delim_len;
+   int prefix_len;
+   long max_len;
+   int timeout;
+   int checksum;     /* CHECKSUM_* kind ending each frame */
+};
+
+static VALUE get_option(opts, id)
+   VALUE opts;
+   ID id;
+{
+   return rb_hash_aref(opts, ID2SYM(id));
+}
+
+/*
+ * :nodoc: Fill spec from the options hash given to SerialPort#each_frame.
+ */
+static void parse_frame_spec(opts, spec)
+   VALUE opts;
+   struct frame_spec *spec;
+{
+   VALUE delim, prefix, encoding, max_len, timeout, checksum;
+
+   Check_Type(opts, T_HASH);
+
+   delim = get_option(opts, id_delimiter);
+   prefix = get_option(opts, id_length_prefix);
+   encoding = get_option(opts, id_encoding);
+   max_len = get_option(opts, id_max_length);
+   timeout = get_option(opts, id_timeout);
+   checksum = get_option(opts, id_checksum);
+
+   if ((!NIL_P(delim)) + (!NIL_P(prefix)) + (!NIL_P(encoding)) != 1)
+   {
+      rb_raise(rb_eArgError,
+               "exactly one of :delimiter, :length_prefix or :encoding is required");
+   }
+
+   if (!NIL_P(delim))
+   {
+      StringValue(delim);
+      if (RSTRING_LEN(delim) == 0)
+      {
+         rb_raise(rb_eArgError, "empty delimiter");
+      }
+      /* a frozen copy, the block might modify the original */
+      delim = rb_str_new4(delim);
+      spec->type = FRAME_DELIMITER;
+      spec->delim_str = delim;
+      spec->delim = RSTRING_PTR(delim);
+      spec->delim_len = RSTRING_LEN(delim);
+   }
+   else if (!NIL_P(prefix))
+   {
+      Check_Type(prefix, T_FIXNUM);
+      spec->type = FRAME_LENGTH;
+      spec->prefix_len = FIX2INT(prefix);
+      if (spec->prefix_len != 1 && spec->prefix_len != 2 && spec->prefix_len != 4)
+      {
+         rb_raise(rb_eArgError, "length prefix must be 1, 2 or 4 bytes");
+      }
+   }
+   else if (SYMBOL_P(encoding) && SYM2ID(encoding) == id_slip)
+   {
+      spec->type = FRAME_SLIP;
+   }
+   else if (SYMBOL_P(encoding) && SYM2ID(encoding) == id_cobs)
+   {
+      spec->type = FRAME_COBS;
+   }
+   else
+   {
+      rb_raise(rb_eArgError, "unknown frame encoding");
+   }
+
+   spec->max_len = DEFAULT_MAX_LENGTH;
+   if (!NIL_P(max_len))
+   {
+      spec->max_len = NUM2LONG(max_len);
+      if (spec->max_len <= 0)
+      {
+         rb_raise(rb_eArgError, "invalid maximum frame length");
+      }
+   }
+
+   spec->timeout = -1;
+   if (!NIL_P(timeout))
+   {
+      Check_Type(timeout, T_FIXNUM);
+      spec->timeout = FIX2INT(timeout);
+      if (spec->timeout < 0)
+      {
+         rb_raise(rb_eArgError, "negative timeout");
+      }
+   }
+
+   spec->checksum = (NIL_P(checksum) ? CHECKSUM_NONE : sp_checksum_kind(checksum));
+}
+
+/*
+ * :nodoc: Find the first occurrence of delim in buf, memchr for the first
+ * byte and memcmp for the rest. Returns its offset or -1.
+ */
+static long find_delimiter(buf, len, delim, delim_len)
+   const char *buf;
+   long len;
+   const char *delim;
+   long delim_len;
+{
+   const char *p = buf;
+   const char *end = buf + len;
+
+   while (end - p >= delim_len)
+   {
+      p = memchr(p, delim[0], end - p - delim_len + 1);
+      if (p == NULL)
+      {
+         return -1;
+      }
+      if (memcmp(p + 1, delim + 1, delim_len - 1) == 0)
+      {
+         return p - buf;
+      }
+      p++;
+   }
+
+   return -1;
+}
+
+static VALUE slip_decode(buf, len)
+   const unsigned char *buf;
+   long len;
+{
+   VALUE str = rb_str_new(0, len);
+   char *out = RSTRING_PTR(str);
+   long i, n = 0;
+
+   for (i = 0; i < len; i++)
+   {
+      if (buf[i] == SLIP_ESC && i + 1 < len)
+      {
+         i++;
+         out[n++] = (buf[i] == SLIP_ESC_END ? SLIP_END :
+                     buf[i] == SLIP_ESC_ESC ? SLIP_ESC : buf[i]);
+      }
+      else
+      {
+         out[n++] = buf[i];
+      }
+   }
+
+   rb_str_resize(str, n);
+   return str;
+}
+
+/*
+ * :nodoc: Decode a COBS frame (without its trailing zero). Returns nil if
+ * the frame is malformed.
+ */
+static VALUE cobs_decode(buf, len)
+   const unsigned char *buf;
+   long len;
+{
+   VALUE str = rb_str_new(0, len);
+   char *out = RSTRING_PTR(str);
+   long i = 0, n = 0;
+   int code;
+
+   while (i < len)
+   {
+      code = buf[i++];
+      if (code == 0 || i + code - 1 > len)
+      {
+         return Qnil;
+      }
+
+      memcpy(out + n, buf + i, code - 1);
+      n += code - 1;
+      i += code - 1;
+
+      if (code != 0xFF && i < len)
+      {
+         out[n++] = 0;
+      }
+   }
+
+   rb_str_resize(str, n);
+   return str;
+}
+
+/*
+ * :nodoc: Strip the checksum of a frame. Returns nil if it doesn't match.
+ */
+static VALUE check_frame(spec, frame)
+   struct frame_spec *spec;
+   VALUE frame;
+{
+   long len = RSTRING_LEN(frame);
+
+   if (spec->checksum == CHECKSUM_NONE)
+   {
+      return frame;
+   }
+
+   if (!sp_checksum_valid(spec->checksum, (unsigned char *) RSTRING_PTR(frame), len))
+   {
+      return Qnil;
+   }
+
+   rb_str_set_len(frame, len - sp_checksum_size(spec->checksum));
+   return frame;
+}
+
+/*
+ * :nodoc: Take the next complete frame out of the receive buffer. Returns
+ * the frame, or Qundef if the buffer holds no complete frame yet.
+ * Malformed and oversized frames, and frames failing the checksum, are
+ * dropped.
+ */
+static VALUE next_frame(pd, spec)
+   struct port_data *pd;
+   struct frame_spec *spec;
+{
+   const unsigned char *buf;
+   unsigned long flen;
+   long pos;
+   int i;
+   VALUE frame;
+
+   for (;;)
+   {
+      buf = (const unsigned char *) pd->rbuf;
+
+      if (spec->type == FRAME_LENGTH)
+      {
+         if (pd->rbuf_len < spec->prefix_len)
+         {
+            return Qundef;
+         }
+
+         /* the length is in network byte order and excludes the prefix */
+         flen = 0;
+         for (i = 0; i < spec->prefix_len; i++)
+         {
+            flen = (flen << 8) | buf[i];
+         }
+
+         if (flen > (unsigned long) spec->max_len)
+         {
+            /* no way to find the next frame boundary */
+            rb_raise(rb_eIOError, "frame length %lu exceeds the maximum", flen);
+         }
+         if (pd->rbuf_len < spec->prefix_len + (long) flen)
+         {
+            return Qundef;
+         }
+
+         frame = rb_str_new(pd->rbuf + spec->prefix_len, flen);
+         sp_rbuf_consume(pd, spec->prefix_len + flen);
+
+         frame = check_frame(spec, frame);
+         if (NIL_P(frame))
+         {
+            continue;
+         }
+         return frame;
+      }
+
+      if (spec->type == FRAME_DELIMITER)
+      {
+         pos = find_delimiter(pd->rbuf, pd->rbuf_len, spec->delim, spec->delim_len);
+      }
+      else
+      {
+         pos = find_delimiter(pd->rbuf, pd->rbuf_len,
+                              spec->type == FRAME_SLIP ? slip_end : cobs_end, 1);
+      }
+
+      if (pos < 0)
+      {
+         if (pd->rbuf_len > spec->max_len)
+         {
+            /* drop the runaway frame and resync on the next delimiter */
+            sp_rbuf_consume(pd, pd->rbuf_len);
+         }
+         return Qundef;
+      }
+
+      if (pos > spec->max_len)
+      {
+         frame = Qnil;
+      }
+      else if (spec->type == FRAME_DELIMITER)
+      {
+         frame = rb_str_new(pd->rbuf, pos);
+      }
+      else if (pos == 0)
+      {
+         /* SLIP and COBS senders may emit empty frames between packets */
+         frame = Qnil;
+      }
+      else if (spec->type == FRAME_SLIP)
+      {
+         frame = slip_decode(buf, pos);
+      }
+      else
+      {
+         frame = cobs_decode(buf, pos);
+      }
+
+      sp_rbuf_consume(pd, pos + (spec->type == FRAME_DELIMITER ? spec->delim_len : 1));
+
+      if (!NIL_P(frame))
+      {
+         frame = check_frame(spec, frame);
+      }
+      if (!NIL_P(frame))
+      {
+         return frame;
+      }
+   }
+}
+
+/*
+ * Read from the port and yield each complete frame.
+ *
+ * The byte stream is split in the extension, so Ruby only sees whole
+ * frames. Exactly one of the following options selects the framing:
+ * [:delimiter] A String ending each frame, e.g. "\r\n". Frames are
+ *              yielded without it.
+ * [:length_prefix] 1, 2 or 4: each frame starts with its payload length
+ *                  in that many bytes, most significant byte first. Only
+ *                  the payload is yielded.
+ * [:encoding] :slip for RFC 1055 SLIP or :cobs for zero-delimited
+ *             Consistent Overhead Byte Stuffing. Frames are decoded.
+ *
+ * Further options:
+ * [:max_length] Longest frame accepted, 65536 by default. Longer
+ *               delimited frames are dropped; a longer length prefix
+ *               raises IOError.
+ * [:timeout] Milliseconds to wait for more data. Without it, reads
+ *            block until a frame arrives or the port reaches end of file.
+ * [:checksum] :crc16_modbus, :crc_ccitt, :crc32 or :lrc: each frame (after
+ *             decoding) ends with this checksum, see
+ *             SerialPort::Checksum.append. It is checked as the frame
+ *             is extracted; frames that fail are dropped, the others
+ *             are yielded without it.
+ *
+ * Returns self once a read times out or the port reaches end of file.
+ * Bytes of an incomplete frame stay buffered for the next call and are
+ * returned first by SerialPort#sysread_timeout and SerialPort#read_timed.
+ *
+ *    sp.each_frame(:delimiter => "\r\n", :timeout => 1000) do |line|
+ *       puts line
+ *    end
+ */
+static VALUE sp_each_frame(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE opts, frame;
+   struct frame_spec spec;
+   struct port_data *pd;
+
+   spec.delim_str = Qnil;
+
+   RETURN_ENUMERATOR(self, argc, argv);
+
+   rb_scan_args(argc, argv, "1", &opts);
+   parse_frame_spec(opts, &spec);
+
+   pd = get_port_data(self);
+
+   for (;;)
+   {
+      frame = next_frame(pd, &spec);
+      if (frame != Qundef)
+      {
+         rb_yield(frame);
+         continue;
+      }
+
+      if (sp_rbuf_fill(self, pd, spec.timeout) <= 0)
+      {
+         break;
+      }
+   }
+
+   RB_GC_GUARD(spec.delim_str);
+
+   return self;
+}
+
+/*
+ * Read one line, up to and including <tt>terminator</tt> ("\n" by
+ * default). Waits at most <tt>timeout</tt> milliseconds in total (forever
+ * if nil) and returns nil once it has passed; the bytes of the partial
+ * line stay buffered for the next call. A line with no terminator within
+ * <tt>max_length</tt> bytes (65536 by default) is returned in pieces of
+ * that length, like <tt>IO#gets(terminator, max_length)</tt>.
+ *
+ * The search for the terminator happens in the extension over the same
+ * receive buffer as SerialPort#each_frame, so no Ruby code runs per byte,
+ * and unlike IO#gets the deadline doesn't depend on
+ * SerialPort#read_timeout. At end of file the buffered remainder is
+ * returned, and EOFError raised once nothing remains.
+ *
+ *    sp.write("*IDN?\r\n")
+ *    id = sp.read_line("\r\n", 256, 500)
+ */
+static VALUE sp_read_line(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _term, _max_len, _timeout, line;
+   const char *term = "\n";
+   long term_len = 1, max_len = DEFAULT_MAX_LENGTH;
+   long scanned = 0, start, limit, pos, len, n;
+   unsigned long consumed;
+   int timeout = -1, wait;
+   double deadline;
+   struct port_data *pd;
+
+   rb_scan_args(argc, argv, "03", &_term, &_max_len, &_timeout);
+
+   if (!NIL_P(_term))
+   {
+      StringValue(_term);
+      if (RSTRING_LEN(_term) == 0)
+      {
+         rb_raise(rb_eArgError, "empty terminator");
+      }
+      /* a frozen copy, another thread might modify the original */
+      _term = rb_str_new4(_term);
+      term = RSTRING_PTR(_term);
+      term_len = RSTRING_LEN(_term);
+   }
+
+   if (!NIL_P(_max_len))
+   {
+      max_len = NUM2LONG(_max_len);
+      if (max_len <= 0)
+      {
+         rb_raise(rb_eArgError, "invalid maximum line length");
+      }
+   }
+
+   if (!NIL_P(_timeout))
+   {
+      Check_Type(_timeout, T_FIXNUM);
+      timeout = FIX2INT(_timeout);
+      if (timeout < 0)
+      {
+         rb_raise(rb_eArgError, "negative timeout");
+      }
+   }
+
+   pd = get_port_data(self);
+   consumed = pd->rbuf_consumed;
+   deadline = sp_monotonic_ms_impl() + timeout;
+
+   for (;;)
+   {
+      /* only the new bytes, and a terminator they may complete, are searched */
+      limit = (pd->rbuf_len < max_len ? pd->rbuf_len : max_len);
+      if (pd->rbuf_consumed != consumed)
+      {
+         /* another thread took buffered bytes meanwhile */
+         consumed = pd->rbuf_consumed;
+         scanned = 0;
+      }
+      start = (scanned > term_len - 1 ? scanned - (term_len - 1) : 0);
+      pos = find_delimiter(pd->rbuf + start, limit - start, term, term_len);
+      if (pos >= 0)
+      {
+         len = start + pos + term_len;
+         break;
+      }
+      if (limit == max_len)
+      {
+         len = max_len;
+         break;
+      }
+      scanned = limit;
+
+      wait = -1;
+      if (timeout >= 0)
+      {
+         wait = (int) ceil(deadline - sp_monotonic_ms_impl());
+         wait = (wait < 0 ? 0 : wait);
+      }
+
+      n = sp_rbuf_fill(self, pd, wait);
+      if (n == 0)
+      {
+         return Qnil;
+      }
+      if (n < 0)
+      {
+         if (pd->rbuf_len == 0)
+         {
+            rb_eof_error();
+         }
+         len = pd->rbuf_len;
+         break;
+      }
+   }
+
+   line = rb_str_new(pd->rbuf, len);
+   sp_rbuf_consume(pd, len);
+
+   RB_GC_GUARD(_term);
+
+   return line;
+}
+
+void Init_serialport_frame(klass)
+   VALUE klass;
+{
+   id_delimiter = rb_intern("delimiter");
+   id_length_prefix = rb_intern("length_prefix");
+   id_encoding = rb_intern("encoding");
+   id_max_length = rb_intern("max_length");
+   id_timeout = rb_intern("timeout");
+   id_slip = rb_intern("slip");
+   id_cobs = rb_intern("cobs");
+   id_checksum = rb_intern("checksum");
+
+   rb_define_method(klass, "each_frame", sp_each_frame, -1);
+   rb_define_method(klass, "read_line", sp_read_line, -1);
+}
@@ -0,0 +1,512 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Modbus RTU master transactions. Frames are separated by 3.5 character
+ * times of silence, derived from the port settings; responses are read
+ * to their expected length where the function code tells it, otherwise
+ * until the line falls silent.
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+#include <math.h>
+
+#define RTU_MAX_ADU          256
+#define RTU_DEFAULT_TIMEOUT  1000
+
+static VALUE cSerialPortClass, eModbusError;
+
+struct rtu_xfer
+{
+   VALUE port;
+   int unit;
+   VALUE pdu;
+   double deadline;     /* ms, for the first byte of the response */
+   int gap;             /* ms of silence that end a frame */
+   VALUE result;
+};
+
+/*
+ * :nodoc: t1.5 and t3.5 in microseconds for the current settings of
+ * port. Above 19200 baud the standard fixes them at 750 and 1750 us.
+ */
+static void rtu_timing(port, t15, t35)
+   VALUE port;
+   long *t15, *t35;
+{
+   struct modem_params mp;
+   double char_us;
+
+   get_modem_params(port, &mp);
+
+   if (mp.data_rate > 19200 || mp.data_rate <= 0)
+   {
+      *t15 = 750;
+      *t35 = 1750;
+      return;
+   }
+
+   /* start bit, data bits, parity bit, stop bits */
+   char_us = (1 + mp.data_bits + (mp.parity != NONE ? 1 : 0) + mp.stop_bits)
+             * 1000000.0 / mp.data_rate;
+   *t15 = (long) ceil(char_us * 1.5);
+   *t35 = (long) ceil(char_us * 3.5);
+}
+
+/*
+ * :nodoc: Milliseconds it takes to send len characters on port.
+ */
+static double rtu_send_time_ms(port, len)
+   VALUE port;
+   long len;
+{
+   struct modem_params mp;
+
+   get_modem_params(port, &mp);
+   if (mp.data_rate <= 0)
+   {
+      return 0;
+   }
+
+   return len * (1 + mp.data_bits + (mp.parity != NONE ? 1 : 0) + mp.stop_bits)
+          * 1000.0 / mp.data_rate;
+}
+
+/*
+ * :nodoc: Length of the response ADU given its first three bytes, or -1
+ * if only the silence after it tells.
+ */
+static long rtu_response_length(hdr)
+   const unsigned char *hdr;
+{
+   switch (hdr[1] & 0x80 ? 0x80 : hdr[1])
+   {
+      case 0x80:                      /* exception */
+      case 0x07:                      /* read exception status */
+         return 5;
+      case 0x01: case 0x02: case 0x03: case 0x04:
+      case 0x0C: case 0x11: case 0x14: case 0x15: case 0x17:
+         return 5 + hdr[2];           /* byte count */
+      case 0x05: case 0x06: case 0x0B: case 0x0F: case 0x10:
+         return 8;
+      case 0x16:                      /* mask write register */
+         return 10;
+   }
+
+   return -1;
+}
+
+/*
+ * :nodoc: Sleep, without the GVL, until the bus has been idle for t3.5.
+ */
+static void rtu_wait_idle(pd)
+   struct port_data *pd;
+{
+   double left = pd->modbus_idle_at - sp_monotonic_ms_impl();
+   struct timeval tv;
+
+   if (left > 0)
+   {
+      tv.tv_sec = (long) (left / 1000);
+      tv.tv_usec = (long) ((left - tv.tv_sec * 1000.0) * 1000);
+      rb_thread_wait_for(tv);
+   }
+}
+
+static void check_request(x)
+   struct rtu_xfer *x;
+{
+   if (!rb_obj_is_kind_of(x->port, cSerialPortClass))
+   {
+      rb_raise(rb_eTypeError, "not a SerialPort");
+   }
+   if (x->unit < 0 || x->unit > 247)
+   {
+      rb_raise(rb_eArgError, "invalid unit address");
+   }
+   StringValue(x->pdu);
+   if (RSTRING_LEN(x->pdu) < 1 || RSTRING_LEN(x->pdu) > RTU_MAX_ADU - 3)
+   {
+      rb_raise(rb_eArgError, "invalid PDU length");
+   }
+}
+
+/*
+ * :nodoc: Send the request of x, after discarding stale input.
+ */
+static void rtu_send(x, timeout)
+   struct rtu_xfer *x;
+   int timeout;
+{
+   struct port_data *pd = get_port_data(x->port);
+   unsigned char adu[RTU_MAX_ADU];
+   long len = RSTRING_LEN(x->pdu) + 1, t15, t35;
+   double sent;
+
+   adu[0] = x->unit;
+   memcpy(adu + 1, RSTRING_PTR(x->pdu), len - 1);
+   sp_checksum_put(CHECKSUM_CRC16_MODBUS, adu, len, adu + len);
+   len += 2;
+
+   /* USB adapters hold data back, inter_byte_timeout= widens the gap */
+   rtu_timing(x->port, &t15, &t35);
+   x->gap = (int) ((t35 + 999) / 1000);
+   if (pd->inter_byte_timeout > x->gap)
+   {
+      x->gap = pd->inter_byte_timeout;
+   }
+   x->result = Qnil;
+
+   rtu_wait_idle(pd);
+
+   sp_flush_impl(x->port, 1, 0);
+   sp_rbuf_consume(pd, pd->rbuf_len);
+   if (pd->ring != NULL)
+   {
+      sp_ring_discard(pd->ring);
+   }
+
+   if (sp_write_impl(x->port, (char *) adu, len, timeout) < len)
+   {
+      rb_raise(eModbusError, "request write timed out");
+   }
+
+   /* the write returns once the driver has the data, not once it is sent */
+   sent = sp_monotonic_ms_impl() + rtu_send_time_ms(x->port, len);
+   x->deadline = sent + timeout;
+   pd->modbus_idle_at = sent + t35 / 1000.0;
+}
+
+/*
+ * :nodoc: Read up to len bytes, waiting until the deadline for the first
+ * one and at most gap ms between bytes.
+ */
+static long rtu_read(x, buf, len, first)
+   struct rtu_xfer *x;
+   unsigned char *buf;
+   long len;
+   int first;
+{
+   double left = x->deadline - sp_monotonic_ms_impl();
+   int wait = first ? (left > 0 ? (int) ceil(left) : 0) : x->gap;
+   long n;
+
+   n = sp_read_timed_impl(x->port, (char *) buf, len, wait, x->gap);
+
+   return n < 0 ? 0 : n;
+}
+
+/*
+ * :nodoc: Receive the response to x. Stores the PDU, nil on timeout or a
+ * ModbusError in x->result.
+ */
+static void rtu_receive(x)
+   struct rtu_xfer *x;
+{
+   struct port_data *pd = get_port_data(x->port);
+   unsigned char adu[RTU_MAX_ADU];
+   long got, want;
+   int incomplete;
+
+   if (x->unit == 0)
+   {
+      /* nobody answers a broadcast */
+      return;
+   }
+
+   got = rtu_read(x, adu, 3, 1);
+   if (got == 0)
+   {
+      return;
+   }
+   if (got < 3)
+   {
+      got += rtu_read(x, adu + got, 3 - got, 0);
+   }
+
+   want = (got == 3 ? rtu_response_length(adu) : 3);
+   if (want < 0 || want > RTU_MAX_ADU)
+   {
+      want = RTU_MAX_ADU;
+   }
+   while (got < want)
+   {
+      long n = rtu_read(x, adu + got, want - got, 0);
+      if (n == 0)
+      {
+         break;
+      }
+      got += n;
+   }
+
+   pd->modbus_idle_at = sp_monotonic_ms_impl() + x->gap;
+
+   incomplete = (got < 4 || (got < want && want != RTU_MAX_ADU));
+   if (incomplete)
+   {
+      x->result = rb_exc_new2(eModbusError, "incomplete response");
+   }
+   else if (!sp_checksum_valid(CHECKSUM_CRC16_MODBUS, adu, got))
+   {
+      x->result = rb_exc_new2(eModbusError, "response CRC mismatch");
+   }
+   else if (adu[0] != x->unit)
+   {
+      x->result = rb_exc_new2(eModbusError, "response from another unit");
+   }
+   else if ((adu[1] & 0x7F) != (unsigned char) RSTRING_PTR(x->pdu)[0])
+   {
+      x->result = rb_exc_new2(eModbusError, "response to another function");
+   }
+   else
+   {
+      x->result = rb_str_new((char *) adu + 1, got - 3);
+   }
+}
+
+static int get_timeout(_timeout)
+   VALUE _timeout;
+{
+   int timeout;
+
+   if (NIL_P(_timeout))
+   {
+      return RTU_DEFAULT_TIMEOUT;
+   }
+
+   Check_Type(_timeout, T_FIXNUM);
+   timeout = FIX2INT(_timeout);
+   if (timeout < 0)
+   {
+      rb_raise(rb_eArgError, "negative timeout");
+   }
+
+   return timeout;
+}
+
+/*
+ * Send the Modbus RTU request <tt>pdu</tt> (function code and data,
+ * without address and CRC) to <tt>unit</tt> and return the response PDU,
+ * or nil if none arrived within <tt>timeout</tt> milliseconds (1000 by
+ * default). Exception responses are returned as they are, with bit 7 of
+ * the function code set. A response with a bad CRC, from another unit or
+ * for another function raises SerialPort::ModbusError.
+ *
+ * The 3.5 character silence before each request is kept based on the
+ * current baud rate and character format, and a longer silence ends the
+ * response. Set SerialPort#inter_byte_timeout to accept longer gaps, as
+ * needed behind USB adapters. Unit 0 broadcasts; nil is returned without
+ * waiting.
+ *
+ *    pdu = sp.modbus_request(17, "\x03\x00\x6B\x00\x03")   # read 3 registers
+ */
+static VALUE sp_modbus_request(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   VALUE _unit, _timeout;
+   struct rtu_xfer x;
+   int timeout;
+
+   rb_scan_args(argc, argv, "21", &_unit, &x.pdu, &_timeout);
+   x.port = self;
+   x.unit = NUM2INT(_unit);
+   check_request(&x);
+   timeout = get_timeout(_timeout);
+
+   x.pdu = rb_str_new4(x.pdu);
+   rtu_send(&x, timeout);
+   rtu_receive(&x);
+   RB_GC_GUARD(x.pdu);
+
+   if (rb_obj_is_kind_of(x.result, rb_eException))
+   {
+      rb_exc_raise(x.result);
+   }
+
+   return x.result;
+}
+
+/* The state of SerialPort.modbus_requests, released by batch_ensure */
+struct rtu_batch
+{
+   struct rtu_xfer *xs;
+   char *done;          /* 0 pending, 1 sent, 2 answered */
+   long n;
+   int timeout;
+   VALUE results;
+};
+
+static VALUE batch_body(arg)
+   VALUE arg;
+{
+   struct rtu_batch *b = (struct rtu_batch *) arg;
+   struct rtu_xfer *xs = b->xs;
+   VALUE busy = rb_ary_new();
+   long i, j, first, count;
+
+   for (count = 0; count < b->n; )
+   {
+      /* one round: the first pending request of each port */
+      rb_ary_clear(busy);
+      first = -1;
+      for (i = 0; i < b->n; i++)
+      {
+         if (b->done[i] || rb_ary_includes(busy, xs[i].port) == Qtrue)
+         {
+            continue;
+         }
+         rb_ary_push(busy, xs[i].port);
+         if (first < 0)
+         {
+            first = i;
+         }
+         rtu_send(&xs[i], b->timeout);
+         b->done[i] = 1;
+      }
+
+      for (i = first, j = RARRAY_LEN(busy); j > 0; i++)
+      {
+         if (b->done[i] != 1)
+         {
+            continue;
+         }
+         rtu_receive(&xs[i]);
+         rb_ary_store(b->results, i, xs[i].result);
+         b->done[i] = 2;
+         count++;
+         j--;
+      }
+   }
+
+   return Qnil;
+}
+
+/*
+ * :nodoc: Free the batch. When it was cut short, a bus with a request
+ * still unanswered is kept idle until the response window of that
+ * request is over, so a late response can't collide with the next
+ * request; rtu_send discards it.
+ */
+static VALUE batch_ensure(arg)
+   VALUE arg;
+{
+   struct rtu_batch *b = (struct rtu_batch *) arg;
+   struct port_data *pd;
+   double until;
+   long i;
+
+   for (i = 0; i < b->n; i++)
+   {
+      if (b->done[i] == 1)
+      {
+         pd = get_port_data(b->xs[i].port);
+         until = b->xs[i].deadline + b->xs[i].gap;
+         if (pd->modbus_idle_at < until)
+         {
+            pd->modbus_idle_at = until;
+         }
+      }
+   }
+
+   xfree(b->xs);
+   xfree(b->done);
+   return Qnil;
+}
+
+/*
+ * Run many Modbus RTU requests, given as <tt>[port, unit, pdu]</tt>
+ * Arrays, and return their results in the same order: the response PDU,
+ * nil on timeout or a SerialPort::ModbusError.
+ *
+ * Requests on different ports overlap: one request is sent on each port,
+ * then the responses are collected while the drivers buffer them, so a
+ * round takes about as long as its slowest unit. Requests on the same
+ * port run one after the other, as the bus requires.
+ *
+ *    SerialPort.modbus_requests([[bus1, 1, req], [bus2, 1, req]], 100)
+ */
+static VALUE sp_modbus_requests(argc, argv, klass)
+   int argc;
+   VALUE *argv, klass;
+{
+   VALUE requests, _timeout, req, keep;
+   struct rtu_xfer x;
+   struct rtu_batch b;
+   long i;
+
+   (void) klass;
+   rb_scan_args(argc, argv, "11", &requests, &_timeout);
+   Check_Type(requests, T_ARRAY);
+   b.timeout = get_timeout(_timeout);
+
+   /* the ports and PDU copies, as the heap isn't scanned by the GC */
+   keep = rb_ary_new();
+   b.n = RARRAY_LEN(requests);
+   for (i = 0; i < b.n; i++)
+   {
+      req = rb_ary_entry(requests, i);
+      Check_Type(req, T_ARRAY);
+      if (RARRAY_LEN(req) != 3)
+      {
+         rb_raise(rb_eArgError, "requests are [port, unit, pdu]");
+      }
+      x.port = rb_ary_entry(req, 0);
+      x.unit = NUM2INT(rb_ary_entry(req, 1));
+      x.pdu = rb_ary_entry(req, 2);
+      check_request(&x);
+      rb_ary_push(keep, x.port);
+      rb_ary_push(keep, rb_str_new4(x.pdu));
+   }
+
+   b.xs = ALLOC_N(struct rtu_xfer, b.n + 1);
+   b.done = ALLOC_N(char, b.n + 1);
+   b.results = rb_ary_new2(b.n);
+   for (i = 0; i < b.n; i++)
+   {
+      req = rb_ary_entry(requests, i);
+      b.xs[i].port = rb_ary_entry(keep, 2 * i);
+      b.xs[i].unit = NUM2INT(rb_ary_entry(req, 1));
+      b.xs[i].pdu = rb_ary_entry(keep, 2 * i + 1);
+      b.xs[i].result = Qnil;
+      b.done[i] = 0;
+   }
+
+   rb_ensure(batch_body, (VALUE) &b, batch_ensure, (VALUE) &b);
+
+   RB_GC_GUARD(keep);
+   return b.results;
+}
+
+/*
+ * Returns <tt>[t1_5, t3_5]</tt>, the Modbus RTU inter-character and
+ * inter-frame times in microseconds for the current port settings.
+ */
+static VALUE sp_modbus_timing(self)
+   VALUE self;
+{
+   long t15, t35;
+
+   rtu_timing(self, &t15, &t35);
+
+   return rb_assoc_new(LONG2NUM(t15), LONG2NUM(t35));
+}
+
+void Init_serialport_modbus(klass)
+   VALUE klass;
+{
+   cSerialPortClass = klass;
+
+   eModbusError = rb_define_class_under(klass, "ModbusError", rb_eIOError);
+
+   rb_define_method(klass, "modbus_request", sp_modbus_request, -1);
+   rb_define_method(klass, "modbus_timing", sp_modbus_timing, 0);
+   rb_define_singleton_method(klass, "modbus_requests", sp_modbus_requests, -1);
+}
@@ -0,0 +1,325 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * The receive ring filled by the native receive thread. Reads take data
+ * straight out of the ring and only wait (through sp_ring_wait_impl)
+ * when it is empty.
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+#include <math.h>
+
+#define MIN_RING_SIZE 4096
+
+/*
+ * :nodoc: Allocate a ring of at least size bytes and start the receive
+ * thread of self on it.
+ */
+void sp_ring_start(self, pd, size)
+   VALUE self;
+   struct port_data *pd;
+   long size;
+{
+   struct rx_ring *ring;
+   unsigned long capa = MIN_RING_SIZE;
+
+   if (size <= 0)
+   {
+      rb_raise(rb_eArgError, "invalid rx_thread ring size");
+   }
+   if (pd->ring != NULL)
+   {
+      rb_raise(rb_eIOError, "receive thread already running");
+   }
+
+   while (capa < (unsigned long) size)
+   {
+      capa <<= 1;
+   }
+
+   ring = ALLOC(struct rx_ring);
+   memset(ring, 0, sizeof(*ring));
+   ring->buf = ALLOC_N(char, capa);
+   ring->mask = capa - 1;
+   ring->pd = pd;
+
+   sp_rx_thread_start_impl(self, ring);
+   pd->ring = ring;
+}
+
+/*
+ * :nodoc: Stop the receive thread, if any, and release its ring.
+ */
+void sp_ring_stop(pd, port_open)
+   struct port_data *pd;
+   int port_open;
+{
+   struct rx_ring *ring = pd->ring;
+
+   if (ring == NULL)
+   {
+      return;
+   }
+
+   pd->ring = NULL;
+   sp_rx_thread_stop_impl(ring, port_open);
+   sp_ring_free(ring);
+}
+
+void sp_ring_free(ring)
+   struct rx_ring *ring;
+{
+   xfree(ring->buf);
+   xfree(ring);
+}
+
+/*
+ * :nodoc: Wake the thread if it waits for room, now that tail has moved.
+ */
+static void ring_freed(ring)
+   struct rx_ring *ring;
+{
+   SP_MEMORY_BARRIER();
+   if (ring->full)
+   {
+      ring->full = 0;
+      sp_rx_thread_space_impl(ring);
+   }
+}
+
+/*
+ * :nodoc: Copy up to len bytes out of the ring. Never blocks.
+ */
+static long ring_take(ring, buf, len)
+   struct rx_ring *ring;
+   char *buf;
+   long len;
+{
+   unsigned long head, tail, off, n, first;
+
+   head = ring->head;
+   SP_MEMORY_BARRIER();
+   tail = ring->tail;
+
+   n = head - tail;
+   if (n > (unsigned long) len)
+   {
+      n = len;
+   }
+   if (n == 0)
+   {
+      return 0;
+   }
+
+   off = tail & ring->mask;
+   first = ring->mask + 1 - off;
+   if (first > n)
+   {
+      first = n;
+   }
+   memcpy(buf, ring->buf + off, first);
+   memcpy(buf + first, ring->buf, n - first);
+
+   SP_MEMORY_BARRIER();
+   ring->tail = tail + n;
+   ring_freed(ring);
+
+   if (ring->pd->capture != NULL)
+   {
+      sp_capture_record(ring->pd, CAPTURE_RX, buf, n, sp_monotonic_ns_impl());
+   }
+   if (ring->pd->share != NULL)
+   {
+      sp_share_publish(ring->pd, buf, n);
+   }
+
+   return n;
+}
+
+/*
+ * :nodoc: Bytes in the ring not consumed yet.
+ */
+long sp_ring_count(ring)
+   struct rx_ring *ring;
+{
+   return ring->head - ring->tail;
+}
+
+/*
+ * :nodoc: Drop everything the thread has stored so far.
+ */
+void sp_ring_discard(ring)
+   struct rx_ring *ring;
+{
+   unsigned long head = ring->head;
+
+   SP_MEMORY_BARRIER();
+   ring->tail = head;
+   ring_freed(ring);
+}
+
+static int ring_at_eof(ring)
+   struct rx_ring *ring;
+{
+   int eof = ring->eof;
+
+   SP_MEMORY_BARRIER();
+   return eof && ring->head == ring->tail;
+}
+
+static int ms_left(deadline)
+   double deadline;
+{
+   double left = deadline - sp_monotonic_ms_impl();
+
+   return left <= 0 ? 0 : (int) ceil(left);
+}
+
+/*
+ * :nodoc: sp_read_impl for ports with a receive thread.
+ */
+long sp_ring_read(ring, buf, len, timeout)
+   struct rx_ring *ring;
+   char *buf;
+   long len;
+   int timeout;
+{
+   long n;
+
+   n = ring_take(ring, buf, len);
+   if (n == 0 && sp_ring_wait_impl(ring, timeout))
+   {
+      n = ring_take(ring, buf, len);
+   }
+
+   if (n == 0 && ring_at_eof(ring))
+   {
+      return -1;
+   }
+
+   return n;
+}
+
+/*
+ * :nodoc: sp_read_timed_impl for ports with a receive thread.
+ */
+long sp_ring_read_timed(ring, buf, len, timeout, interval)
+   struct rx_ring *ring;
+   char *buf;
+   long len;
+   int timeout, interval;
+{
+   double deadline = sp_monotonic_ms_impl() + timeout;
+   long got = 0;
+   int wait;
+
+   for (;;)
+   {
+      got += ring_take(ring, buf + got, len - got);
+      if (got == len || ring_at_eof(ring))
+      {
+         break;
+      }
+
+      /* the total timeout, shortened to the inter-byte one after data */
+      wait = (timeout < 0 ? -1 : ms_left(deadline));
+      if (got > 0 && interval >= 0 && (wait < 0 || interval < wait))
+      {
+         wait = interval;
+      }
+
+      if (!sp_ring_wait_impl(ring, wait))
+      {
+         break;
+      }
+   }
+
+   return (got == 0 && ring_at_eof(ring)) ? -1 : got;
+}
+
+/*
+ * :nodoc: Called by the receive thread before it publishes the bytes up
+ * to end, which arrived at ns. Old stamps are overwritten.
+ */
+void sp_ring_stamp(ring, end, ns)
+   struct rx_ring *ring;
+   unsigned long end;
+   LONG_LONG ns;
+{
+   struct rx_stamp *stamp = &ring->stamps[ring->stamp_head & (RX_STAMPS - 1)];
+
+   stamp->end = end;
+   stamp->ns = ns;
+   SP_MEMORY_BARRIER();
+   ring->stamp_head++;
+}
+
+/*
+ * :nodoc: sp_read_stamped_impl for ports with a receive thread. A read
+ * covering data of several thread reads gets one record per thread read.
+ * Bytes whose stamp was already overwritten (more than RX_STAMPS reads
+ * behind) take the time of the next stamp still kept.
+ */
+long sp_ring_read_stamped(ring, buf, len, timeout, stamps, offset)
+   struct rx_ring *ring;
+   char *buf;
+   long len;
+   int timeout;
+   VALUE stamps;
+   long offset;
+{
+   unsigned long start = ring->tail, head;
+   struct rx_stamp *stamp;
+   long n, end;
+
+   n = sp_ring_read(ring, buf, len, timeout);
+   if (n <= 0)
+   {
+      return n;
+   }
+
+   head = ring->stamp_head;
+   SP_MEMORY_BARRIER();
+   if (head - ring->stamp_tail > RX_STAMPS)
+   {
+      ring->stamp_tail = head - RX_STAMPS;
+   }
+
+   while (ring->stamp_tail != head)
+   {
+      stamp = &ring->stamps[ring->stamp_tail & (RX_STAMPS - 1)];
+      end = (long) (stamp->end - start);
+
+      if (end <= 0)
+      {
+         /* consumed by a reader that doesn't want stamps */
+         ring->stamp_tail++;
+         continue;
+      }
+      if (end >= n)
+      {
+         /* the rest of this thread read is left for the next call */
+         sp_stamp_append(stamps, offset + n, stamp->ns);
+         if (end == n)
+         {
+            ring->stamp_tail++;
+         }
+         return n;
+      }
+
+      sp_stamp_append(stamps, offset + end, stamp->ns);
+      ring->stamp_tail++;
+   }
+
+   /* the thread publishes its stamp first, so this is not reached */
+   sp_stamp_append(stamps, offset + n, -1);
+   return n;
+}
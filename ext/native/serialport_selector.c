@@ -0,0 +1,441 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Waiting on many ports from one thread. The waiting itself is done by
+ * the sp_selector_*_impl functions of each platform.
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+
+static VALUE cSerialPortClass;
+
+static void selector_mark(sel)
+   struct selector *sel;
+{
+   long i;
+
+   for (i = 0; i < sel->count; i++)
+   {
+      rb_gc_mark(sel->entries[i].port);
+   }
+}
+
+static void selector_free(sel)
+   struct selector *sel;
+{
+   if (!sel->closed)
+   {
+      sp_selector_close_impl(sel);
+   }
+   xfree(sel->entries);
+   xfree(sel->wait_handles);
+   xfree(sel->wait_ready);
+   xfree(sel->wait_events);
+   xfree(sel);
+}
+
+static VALUE selector_alloc(klass)
+   VALUE klass;
+{
+   struct selector *sel;
+   VALUE obj;
+
+   obj = Data_Make_Struct(klass, struct selector, selector_mark, selector_free, sel);
+   sel->backend = -1;
+   sel->closed = 1;
+
+   return obj;
+}
+
+static struct selector *get_selector(self)
+   VALUE self;
+{
+   struct selector *sel;
+
+   Data_Get_Struct(self, struct selector, sel);
+   if (sel->closed)
+   {
+      rb_raise(rb_eIOError, "closed selector");
+   }
+
+   return sel;
+}
+
+/*
+ * :nodoc: Raise IOError if port has been closed.
+ */
+static void check_port(port)
+   VALUE port;
+{
+#ifdef RUBY_1_9
+   rb_io_t *fptr;
+#else
+   OpenFile *fptr;
+#endif
+
+   GetOpenFile(port, fptr);
+}
+
+static long find_entry(sel, port)
+   struct selector *sel;
+   VALUE port;
+{
+   long i;
+
+   for (i = 0; i < sel->count; i++)
+   {
+      if (sel->entries[i].port == port)
+      {
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+/*
+ * :nodoc: Make the buffers of select hold one port more than there is
+ * room for in entries, sp_selector_wait_impl may use the extra one.
+ */
+static void grow_wait_buffers(sel)
+   struct selector *sel;
+{
+   long capa = sel->capa + 1;
+
+   if (sel->wait_capa >= capa)
+   {
+      return;
+   }
+
+   REALLOC_N(sel->wait_handles, intptr_t, capa);
+   REALLOC_N(sel->wait_ready, char, capa);
+   REALLOC_N(sel->wait_events, char, capa * sp_selector_event_size_impl());
+   sel->wait_capa = capa;
+}
+
+/*
+ * Create an empty selector.
+ */
+static VALUE sp_selector_initialize(self)
+   VALUE self;
+{
+   struct selector *sel;
+
+   Data_Get_Struct(self, struct selector, sel);
+   if (sel->closed)
+   {
+      sp_selector_init_impl(sel);
+      sel->closed = 0;
+   }
+
+   return self;
+}
+
+/*
+ * Add <tt>port</tt> to the ports watched by SerialPort::Selector#select.
+ * Registering a port twice has no effect. Returns the port.
+ *
+ * Deregister ports before closing them. On Windows the port must have
+ * been opened with <tt>:overlapped => true</tt>. Ports with a receive
+ * thread (<tt>:rx_thread</tt>) can't be registered.
+ */
+static VALUE sp_selector_register(self, port)
+   VALUE self, port;
+{
+   struct selector *sel = get_selector(self);
+   intptr_t handle;
+
+   if (!rb_obj_is_kind_of(port, cSerialPortClass))
+   {
+      rb_raise(rb_eTypeError, "not a SerialPort");
+   }
+   if (find_entry(sel, port) >= 0)
+   {
+      return port;
+   }
+
+   check_port(port);
+   if (get_port_data(port)->ring != NULL)
+   {
+      /* the receive thread drains the port, readiness never shows */
+      rb_raise(rb_eArgError, "ports with a receive thread can't be selected");
+   }
+
+   if (sel->count == sel->capa)
+   {
+      sel->capa = (sel->capa == 0 ? 8 : sel->capa * 2);
+      REALLOC_N(sel->entries, struct selector_entry, sel->capa);
+   }
+   grow_wait_buffers(sel);
+
+   handle = sp_selector_add_impl(sel, port);
+   sel->entries[sel->count].port = port;
+   sel->entries[sel->count].handle = handle;
+   sel->count++;
+
+   return port;
+}
+
+/*
+ * Stop watching <tt>port</tt>. Returns the port, or nil if it was not
+ * registered.
+ */
+static VALUE sp_selector_deregister(self, port)
+   VALUE self, port;
+{
+   struct selector *sel = get_selector(self);
+   long i = find_entry(sel, port);
+
+   if (i < 0)
+   {
+      return Qnil;
+   }
+
+   sp_selector_remove_impl(sel, sel->entries[i].handle);
+   memmove(sel->entries + i, sel->entries + i + 1,
+           (sel->count - i - 1) * sizeof(struct selector_entry));
+   sel->count--;
+
+   return port;
+}
+
+/*
+ * Returns true if <tt>port</tt> is registered.
+ */
+static VALUE sp_selector_registered_p(self, port)
+   VALUE self, port;
+{
+   return find_entry(get_selector(self), port) >= 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * Returns the registered ports.
+ */
+static VALUE sp_selector_ports(self)
+   VALUE self;
+{
+   struct selector *sel = get_selector(self);
+   VALUE ary = rb_ary_new2(sel->count);
+   long i;
+
+   for (i = 0; i < sel->count; i++)
+   {
+      rb_ary_push(ary, sel->entries[i].port);
+   }
+
+   return ary;
+}
+
+/*
+ * Returns the number of registered ports.
+ */
+static VALUE sp_selector_size(self)
+   VALUE self;
+{
+   return LONG2NUM(get_selector(self)->count);
+}
+
+struct select_args
+{
+   struct selector *sel;
+   int timeout;
+   intptr_t *handles;
+   char *ready;
+   char *events;
+   long capa;
+   VALUE result;
+};
+
+static VALUE select_body(arg)
+   VALUE arg;
+{
+   struct select_args *args = (struct select_args *) arg;
+   struct selector *sel = args->sel;
+   VALUE ports, port;
+   long n, i, buffered = 0;
+   struct port_data *pd;
+
+   /* a snapshot, other threads may register ports while we wait */
+   n = sel->count;
+   if (sel->wait_capa > n)
+   {
+      args->handles = sel->wait_handles;
+      args->ready = sel->wait_ready;
+      args->events = sel->wait_events;
+      args->capa = sel->wait_capa;
+      sel->wait_handles = NULL;
+      sel->wait_ready = NULL;
+      sel->wait_events = NULL;
+      sel->wait_capa = 0;
+   }
+   else
+   {
+      /* another thread is selecting with the selector's buffers */
+      args->capa = n + 1;
+      args->handles = ALLOC_N(intptr_t, args->capa);
+      args->ready = ALLOC_N(char, args->capa);
+      args->events = ALLOC_N(char, args->capa * sp_selector_event_size_impl());
+   }
+
+   ports = rb_ary_new2(n);
+   for (i = 0; i < n; i++)
+   {
+      port = sel->entries[i].port;
+      check_port(port);
+      rb_ary_push(ports, port);
+      args->handles[i] = sel->entries[i].handle;
+      args->ready[i] = (get_port_data(port)->rbuf_len > 0);
+      buffered += args->ready[i];
+   }
+
+   sp_selector_wait_impl(sel, args->handles, n, buffered ? 0 : args->timeout,
+                         args->ready, args->events);
+
+   args->result = rb_ary_new();
+   for (i = 0; i < n; i++)
+   {
+      if (args->ready[i])
+      {
+         port = rb_ary_entry(ports, i);
+         pd = get_port_data(port);
+         rb_ary_push(args->result, rb_assoc_new(port,
+                     LONG2NUM(pd->rbuf_len + sp_bytes_available_impl(port))));
+      }
+   }
+
+   return Qnil;
+}
+
+/*
+ * :nodoc: Hand the buffers back to the selector, unless it has bigger
+ * ones by now.
+ */
+static VALUE select_ensure(arg)
+   VALUE arg;
+{
+   struct select_args *args = (struct select_args *) arg;
+   struct selector *sel = args->sel;
+
+   if (args->capa > sel->wait_capa)
+   {
+      xfree(sel->wait_handles);
+      xfree(sel->wait_ready);
+      xfree(sel->wait_events);
+      sel->wait_handles = args->handles;
+      sel->wait_ready = args->ready;
+      sel->wait_events = args->events;
+      sel->wait_capa = args->capa;
+   }
+   else
+   {
+      xfree(args->handles);
+      xfree(args->ready);
+      xfree(args->events);
+   }
+
+   return Qnil;
+}
+
+/*
+ * Wait until at least one registered port has data to read, at most
+ * <tt>timeout</tt> milliseconds (forever if nil). Returns an Array of
+ * <tt>[port, bytes]</tt> pairs, one per readable port, where
+ * <tt>bytes</tt> is the number of bytes that can be read without
+ * blocking. The Array is empty on timeout. A port at end of file is
+ * reported with 0 bytes.
+ *
+ * Data buffered by SerialPort#each_frame counts as readable.
+ *
+ *    sel = SerialPort::Selector.new
+ *    ports.each { |sp| sel.register(sp) }
+ *    loop do
+ *       sel.select(1000).each do |sp, bytes|
+ *          handle(sp, sp.sysread_timeout(bytes, 0))
+ *       end
+ *    end
+ */
+static VALUE sp_selector_select(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   struct select_args args;
+   VALUE _timeout;
+
+   args.sel = get_selector(self);
+   args.timeout = -1;
+   rb_scan_args(argc, argv, "01", &_timeout);
+   if (!NIL_P(_timeout))
+   {
+      Check_Type(_timeout, T_FIXNUM);
+      args.timeout = FIX2INT(_timeout);
+      if (args.timeout < 0)
+      {
+         rb_raise(rb_eArgError, "negative timeout");
+      }
+   }
+
+   args.handles = NULL;
+   args.ready = NULL;
+   args.events = NULL;
+   args.capa = 0;
+   args.result = Qnil;
+   rb_ensure(select_body, (VALUE) &args, select_ensure, (VALUE) &args);
+
+   return args.result;
+}
+
+/*
+ * Deregister all ports and release the selector's resources. The ports
+ * stay open.
+ */
+static VALUE sp_selector_close(self)
+   VALUE self;
+{
+   struct selector *sel = get_selector(self);
+
+   sp_selector_close_impl(sel);
+   sel->closed = 1;
+   sel->count = 0;
+
+   return Qnil;
+}
+
+/*
+ * Returns true once the selector is closed.
+ */
+static VALUE sp_selector_closed_p(self)
+   VALUE self;
+{
+   struct selector *sel;
+
+   Data_Get_Struct(self, struct selector, sel);
+   return sel->closed ? Qtrue : Qfalse;
+}
+
+void Init_serialport_selector(klass)
+   VALUE klass;
+{
+   VALUE cSelector;
+
+   cSerialPortClass = klass;
+
+   cSelector = rb_define_class_under(klass, "Selector", rb_cObject);
+   rb_define_alloc_func(cSelector, selector_alloc);
+   rb_define_method(cSelector, "initialize", sp_selector_initialize, 0);
+   rb_define_method(cSelector, "register", sp_selector_register, 1);
+   rb_define_method(cSelector, "deregister", sp_selector_deregister, 1);
+   rb_define_method(cSelector, "registered?", sp_selector_registered_p, 1);
+   rb_define_method(cSelector, "ports", sp_selector_ports, 0);
+   rb_define_method(cSelector, "size", sp_selector_size, 0);
+   rb_define_method(cSelector, "select", sp_selector_select, -1);
+   rb_define_method(cSelector, "close", sp_selector_close, 0);
+   rb_define_method(cSelector, "closed?", sp_selector_closed_p, 0);
+}
@@ -0,0 +1,557 @@
+/* Ruby/SerialPort
+ *
+ * This code is hereby licensed for public consumption under either the
+ * GNU GPL v2 or greater.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ * Fanning the received data of one port out to other processes. The
+ * owner of the port publishes everything its native readers receive into
+ * a ring in shared memory; SerialPort::SharedReader maps the ring
+ * read-only in any number of processes. The owner never waits for the
+ * readers: a reader that falls more than the ring size behind skips the
+ * overwritten bytes and counts them as lost.
+ *
+ * The shared memory starts with a SHARE_HEADER byte header, followed by
+ * the ring. Positions in the stream are 64 bit byte counts since
+ * SerialPort#share. The owner raises reserve to the end of the bytes it
+ * is about to write, copies them, then raises head to the same value;
+ * a reader copies up to head and then checks against reserve that the
+ * owner hasn't overwritten what it copied meanwhile.
+ */
+
+#include "serialport.h"
+
+#include <string.h>
+
+#define SHARE_HEADER         64
+#define SHARE_DEFAULT_SIZE   (1 << 20)
+#define SHARE_MAX_SIZE       (1 << 30)
+#define SHARE_READ_DEFAULT   65536
+
+/* readers look for new data this often, in microseconds */
+#define SHARE_POLL_US        1000
+
+struct share_header
+{
+   char magic[8];
+   unsigned LONG_LONG size;              /* of the ring, a power of two */
+   volatile unsigned LONG_LONG reserve;  /* end of the bytes being written */
+   volatile unsigned LONG_LONG head;     /* end of the bytes written */
+   volatile unsigned LONG_LONG closed;   /* set when the owner stops */
+};
+
+/* The owner's side, see SerialPort#share */
+struct sp_share
+{
+   char *addr;
+   unsigned long map_size;
+   void *impl;
+   char *name;
+   unsigned LONG_LONG head;
+};
+
+struct shared_reader
+{
+   char *addr;                /* NULL once closed */
+   unsigned long map_size;
+   void *impl;
+   unsigned LONG_LONG pos;    /* of the next byte to read */
+   unsigned LONG_LONG lost;   /* bytes overwritten before they were read */
+};
+
+static VALUE cSharedReader;
+
+/*
+ * :nodoc: Read a counter of the header. 64 bit loads may be split on 32
+ * bit machines, so it is read until two reads agree.
+ */
+static unsigned LONG_LONG load_counter(counter)
+   volatile unsigned LONG_LONG *counter;
+{
+   unsigned LONG_LONG value;
+
+   do
+   {
+      value = *counter;
+   } while (value != *counter);
+
+   return value;
+}
+
+/*
+ * :nodoc: Publish len bytes received by the port of pd to its readers.
+ * Called with the GVL held.
+ */
+void sp_share_publish(pd, buf, len)
+   struct port_data *pd;
+   const char *buf;
+   long len;
+{
+   struct sp_share *sh = pd->share;
+   struct share_header *hdr;
+   char *ring;
+   unsigned long size, off, first;
+
+   if (sh == NULL || len <= 0)
+   {
+      return;
+   }
+
+   hdr = (struct share_header *) sh->addr;
+   ring = sh->addr + SHARE_HEADER;
+   size = (unsigned long) hdr->size;
+
+   if ((unsigned long) len > size)
+   {
+      /* only the end can be kept */
+      sh->head += len - size;
+      buf += len - size;
+      len = size;
+   }
+
+   hdr->reserve = sh->head + len;
+   SP_MEMORY_BARRIER();
+
+   off = (unsigned long) (sh->head & (size - 1));
+   first = size - off;
+   if (first > (unsigned long) len)
+   {
+      first = len;
+   }
+   memcpy(ring + off, buf, first);
+   memcpy(ring, buf + first, len - first);
+
+   SP_MEMORY_BARRIER();
+   sh->head += len;
+   hdr->head = sh->head;
+}
+
+/*
+ * :nodoc: Stop publishing the port of pd, if it is. Readers see end of
+ * file once they have read the rest.
+ */
+void sp_share_stop(pd)
+   struct port_data *pd;
+{
+   struct sp_share *sh = pd->share;
+
+   if (sh == NULL)
+   {
+      return;
+   }
+
+   pd->share = NULL;
+   ((struct share_header *) sh->addr)->closed = 1;
+   SP_MEMORY_BARRIER();
+
+   sp_shm_close_impl(sh->name, sh->addr, sh->map_size, sh->impl, 1);
+   xfree(sh->name);
+   xfree(sh);
+}
+
+/*
+ * Publish the data received through the port to other processes, which
+ * read it with SerialPort::SharedReader. <tt>name</tt> is a file to
+ * create on Posix (on Linux best in /dev/shm) and the name of a file
+ * mapping on Windows (e.g. "Local\\gps"). A file left at name by an
+ * earlier share is replaced, one still shared raises IOError and any
+ * other raises Errno::EEXIST.
+ * <tt>size</tt> is the size in bytes of the ring (1 MiB by default,
+ * rounded up to a power of two): how far a reader may fall behind before
+ * it loses data.
+ *
+ * Everything the native readers (SerialPort#sysread_timeout, #read_timed,
+ * #read_into, #each_frame, #read_line, ...) receive is published, in
+ * order and without blocking on the readers, so the owner has to keep
+ * reading. The IO read methods are not published. The shared memory is
+ * removed by SerialPort#unshare or SerialPort#close; attached readers
+ * then read the rest and reach end of file.
+ *
+ *    sp = SerialPort.new("/dev/ttyUSB0", 9600, :rx_thread => true)
+ *    sp.share("/dev/shm/gps")
+ *    buf = ""
+ *    loop { sp.read_into(buf, 4096) }
+ */
+static VALUE sp_share(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   struct port_data *pd = get_port_data(self);
+   struct share_header *hdr;
+   struct sp_share *sh;
+   VALUE name, _size;
+   unsigned long size = SHARE_DEFAULT_SIZE;
+   long requested;
+   char *addr;
+   void *impl;
+
+   rb_scan_args(argc, argv, "11", &name, &_size);
+   StringValueCStr(name);
+
+   if (!NIL_P(_size))
+   {
+      requested = NUM2LONG(_size);
+      if (requested <= 0 || requested > SHARE_MAX_SIZE)
+      {
+         rb_raise(rb_eArgError, "invalid shared ring size");
+      }
+      for (size = 4096; size < (unsigned long) requested; size <<= 1)
+      {
+      }
+   }
+
+   if (pd->share != NULL)
+   {
+      rb_raise(rb_eIOError, "already sharing");
+   }
+
+   addr = sp_shm_create_impl(RSTRING_PTR(name), SHARE_HEADER + size, &impl);
+
+   hdr = (struct share_header *) addr;
+   memset(addr, 0, SHARE_HEADER);
+   hdr->size = size;
+   SP_MEMORY_BARRIER();
+   memcpy(hdr->magic, SP_SHARE_MAGIC, 8);
+
+   sh = ALLOC(struct sp_share);
+   sh->addr = addr;
+   sh->map_size = SHARE_HEADER + size;
+   sh->impl = impl;
+   sh->name = ALLOC_N(char, RSTRING_LEN(name) + 1);
+   memcpy(sh->name, RSTRING_PTR(name), RSTRING_LEN(name) + 1);
+   sh->head = 0;
+   pd->share = sh;
+
+   return self;
+}
+
+/*
+ * Stop publishing started by SerialPort#share and remove the shared
+ * memory. Does nothing if the port isn't shared.
+ */
+static VALUE sp_unshare(self)
+   VALUE self;
+{
+   sp_share_stop(get_port_data(self));
+   return self;
+}
+
+/*
+ * Returns true while SerialPort#share publishes the port.
+ */
+static VALUE sp_sharing_p(self)
+   VALUE self;
+{
+   return get_port_data(self)->share != NULL ? Qtrue : Qfalse;
+}
+
+static void reader_close(r)
+   struct shared_reader *r;
+{
+   if (r->addr != NULL)
+   {
+      sp_shm_close_impl(NULL, r->addr, r->map_size, r->impl, 0);
+      r->addr = NULL;
+   }
+}
+
+static void reader_free(r)
+   struct shared_reader *r;
+{
+   reader_close(r);
+   xfree(r);
+}
+
+static VALUE reader_alloc(klass)
+   VALUE klass;
+{
+   struct shared_reader *r;
+
+   return Data_Make_Struct(klass, struct shared_reader, 0, reader_free, r);
+}
+
+static struct shared_reader *get_reader(self)
+   VALUE self;
+{
+   struct shared_reader *r;
+
+   Data_Get_Struct(self, struct shared_reader, r);
+   if (r->addr == NULL)
+   {
+      rb_raise(rb_eIOError, "closed shared reader");
+   }
+
+   return r;
+}
+
+/*
+ * Attach to the data published by SerialPort#share under
+ * <tt>name</tt>. Reading starts with the data published from now on.
+ *
+ *    gps = SerialPort::SharedReader.new("/dev/shm/gps")
+ *    while data = gps.read(4096, 1000)
+ *       warn "#{gps.lost} bytes lost" if gps.lost > 0
+ *       ...
+ *    end
+ */
+static VALUE sp_reader_initialize(self, name)
+   VALUE self, name;
+{
+   struct shared_reader *r;
+   struct share_header *hdr;
+   unsigned LONG_LONG size;
+
+   Data_Get_Struct(self, struct shared_reader, r);
+   StringValueCStr(name);
+   reader_close(r);
+
+   r->addr = sp_shm_open_impl(RSTRING_PTR(name), &r->map_size, &r->impl);
+
+   hdr = (struct share_header *) r->addr;
+   size = (r->map_size < SHARE_HEADER ? 0 : hdr->size);
+   SP_MEMORY_BARRIER();
+   if (r->map_size < SHARE_HEADER || memcmp(hdr->magic, SP_SHARE_MAGIC, 8) != 0 ||
+       size == 0 || (size & (size - 1)) != 0 || size > r->map_size - SHARE_HEADER)
+   {
+      reader_close(r);
+      rb_raise(rb_eArgError, "not a shared serial port: %s", RSTRING_PTR(name));
+   }
+
+   r->pos = load_counter(&hdr->head);
+   r->lost = 0;
+
+   return self;
+}
+
+/*
+ * :nodoc: Copy up to len bytes at r->pos out of the ring into a new
+ * String. Bytes the owner overwrote meanwhile are dropped and counted as
+ * lost; returns nil if nothing was left.
+ */
+static VALUE reader_copy(r, head, len)
+   struct shared_reader *r;
+   unsigned LONG_LONG head;
+   long len;
+{
+   struct share_header *hdr = (struct share_header *) r->addr;
+   const char *ring = r->addr + SHARE_HEADER;
+   unsigned LONG_LONG size = hdr->size, reserve, gone;
+   unsigned long off, first, n;
+   VALUE str;
+
+   if (head - r->pos > size)
+   {
+      r->lost += head - size - r->pos;
+      r->pos = head - size;
+   }
+
+   n = (unsigned long) (head - r->pos);
+   if (n > (unsigned long) len)
+   {
+      n = len;
+   }
+
+   str = rb_str_new(0, n);
+   off = (unsigned long) (r->pos & (size - 1));
+   first = (unsigned long) size - off;
+   if (first > n)
+   {
+      first = n;
+   }
+   memcpy(RSTRING_PTR(str), ring + off, first);
+   memcpy(RSTRING_PTR(str) + first, ring, n - first);
+
+   SP_MEMORY_BARRIER();
+   reserve = load_counter(&hdr->reserve);
+
+   /* the bytes before reserve - size may have been replaced while copying */
+   gone = 0;
+   if (reserve > size && reserve - size > r->pos)
+   {
+      gone = reserve - size - r->pos;
+      gone = (gone > n ? n : gone);
+   }
+
+   r->lost += gone;
+   r->pos += n;
+   if (gone == n)
+   {
+      return Qnil;
+   }
+   if (gone > 0)
+   {
+      memmove(RSTRING_PTR(str), RSTRING_PTR(str) + gone, n - (unsigned long) gone);
+      rb_str_set_len(str, n - (long) gone);
+   }
+
+   return str;
+}
+
+/*
+ * Read up to <tt>length</tt> bytes (65536 by default) of the published
+ * data, waiting at most <tt>timeout</tt> milliseconds for some to arrive
+ * (forever if nil). Returns nil on timeout, and raises EOFError once the
+ * owner stopped sharing and everything has been read.
+ *
+ * New data is looked for every millisecond, without holding the
+ * interpreter lock. The data is never older than the ring; what the
+ * owner overwrote before it was read is skipped and added to
+ * SerialPort::SharedReader#lost.
+ */
+static VALUE sp_reader_read(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
+{
+   struct shared_reader *r = get_reader(self);
+   struct share_header *hdr = (struct share_header *) r->addr;
+   VALUE _length, _timeout, str;
+   long length = SHARE_READ_DEFAULT;
+   int timeout = -1;
+   unsigned LONG_LONG head;
+   double deadline, left;
+   struct timeval tv;
+
+   rb_scan_args(argc, argv, "02", &_length, &_timeout);
+   if (!NIL_P(_length))
+   {
+      length = NUM2LONG(_length);
+      if (length <= 0)
+      {
+         rb_raise(rb_eArgError, "invalid length");
+      }
+   }
+   if (!NIL_P(_timeout))
+   {
+      Check_Type(_timeout, T_FIXNUM);
+      timeout = FIX2INT(_timeout);
+      if (timeout < 0)
+      {
+         rb_raise(rb_eArgError, "negative timeout");
+      }
+   }
+
+   deadline = sp_monotonic_ms_impl() + timeout;
+   for (;;)
+   {
+      head = load_counter(&hdr->head);
+      if (head != r->pos)
+      {
+         SP_MEMORY_BARRIER();
+         str = reader_copy(r, head, length);
+         if (!NIL_P(str))
+         {
+            return str;
+         }
+         continue;
+      }
+
+      if (hdr->closed)
+      {
+         SP_MEMORY_BARRIER();
+         if (load_counter(&hdr->head) == r->pos)
+         {
+            rb_eof_error();
+         }
+         continue;
+      }
+
+      tv.tv_sec = 0;
+      tv.tv_usec = SHARE_POLL_US;
+      if (timeout >= 0)
+      {
+         left = deadline - sp_monotonic_ms_impl();
+         if (left <= 0)
+         {
+            return Qnil;
+         }
+         if (left * 1000 < SHARE_POLL_US)
+         {
+            tv.tv_usec = (long) (left * 1000) + 1;
+         }
+      }
+      rb_thread_wait_for(tv);
+
+      /* the reader may have been closed by another thread meanwhile */
+      r = get_reader(self);
+   }
+}
+
+/*
+ * Position in the published stream of the next byte to read: the number
+ * of bytes the owner published since SerialPort#share before it.
+ */
+static VALUE sp_reader_position(self)
+   VALUE self;
+{
+   return ULL2NUM(get_reader(self)->pos);
+}
+
+/*
+ * Number of bytes skipped because the owner overwrote them before they
+ * were read.
+ */
+static VALUE sp_reader_lost(self)
+   VALUE self;
+{
+   return ULL2NUM(get_reader(self)->lost);
+}
+
+/*
+ * Number of bytes published but not read yet, at most the ring size.
+ */
+static VALUE sp_reader_pending(self)
+   VALUE self;
+{
+   struct shared_reader *r = get_reader(self);
+   struct share_header *hdr = (struct share_header *) r->addr;
+   unsigned LONG_LONG n = load_counter(&hdr->head) - r->pos;
+
+   return ULL2NUM(n > hdr->size ? hdr->size : n);
+}
+
+/*
+ * Detach from the shared memory.
+ */
+static VALUE sp_reader_close(self)
+   VALUE self;
+{
+   struct shared_reader *r;
+
+   Data_Get_Struct(self, struct shared_reader, r);
+   reader_close(r);
+
+   return Qnil;
+}
+
+/*
+ * Returns true once SerialPort::SharedReader#close has been called.
+ */
+static VALUE sp_reader_closed_p(self)
+   VALUE self;
+{
+   struct shared_reader *r;
+
+   Data_Get_Struct(self, struct shared_reader, r);
+   return r->addr == NULL ? Qtrue : Qfalse;
+}
+
+void Init_serialport_shared(klass)
+   VALUE klass;
+{
+   rb_define_method(klass, "share", sp_share, -1);
+   rb_define_method(klass, "unshare", sp_unshare, 0);
+   rb_define_method(klass, "sharing?", sp_sharing_p, 0);
+
+   cSharedReader = rb_define_class_under(klass, "SharedReader", rb_cObject);
+   rb_define_alloc_func(cSharedReader, reader_alloc);
+   rb_define_method(cSharedReader, "initialize", sp_reader_initialize, 1);
+   rb_define_method(cSharedReader, "read", sp_reader_read, -1);
+   rb_define_method(cSharedReader, "position", sp_reader_position, 0);
+   rb_define_method(cSharedReader, "lost", sp_reader_lost, 0);
+   rb_define_method(cSharedReader, "pending", sp_reader_pending, 0);
+   rb_define_method(cSharedReader, "close", sp_reader_close, 0);
+   rb_define_method(cSharedReader, "closed?", sp_reader_closed_p, 0);
+}
@@ -25,6 +25,9 @@
 #include <io.h>      /* Low-level I/O definitions */
 #include <fcntl.h>   /* File control definitions */
 #include <windows.h> /* Windows standard function definitions */
+#if defined(HAVE_SETUPAPI_H)
+#include <setupapi.h>  /* Port enumeration */
+#endif
 
 
 static char sGetCommState[] = "GetCommState";
@@ -59,8 +62,52 @@ static void _rb_win32_fail(const char *function_call) {
   );
 }
 
-VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port)
-   VALUE class, _port;
+static void modem_params_to_dcb(VALUE self, DCB *dcb, COMMTIMEOUTS *ctout,
+                                int argc, VALUE *argv);
+static void save_modem_params(VALUE self, HANDLE fh, DCB *dcb, COMMTIMEOUTS *ctout);
+
+/* The port being opened by sp_create_impl */
+struct open_config
+{
+   VALUE sp;
+   HANDLE fh;
+   DCB *dcb;
+   int argc;
+   VALUE *argv;
+};
+
+/*
+ * :nodoc: Apply the default line settings and the modem parameters of a
+ * port being opened in a single SetCommState. Called under rb_protect.
+ */
+static VALUE configure_port(arg)
+   VALUE arg;
+{
+   struct open_config *config = (struct open_config *) arg;
+   COMMTIMEOUTS ctout;
+
+   if (config->argc == 0)
+   {
+      if (SetCommState(config->fh, config->dcb) == 0)
+      {
+         _rb_win32_fail(sSetCommState);
+      }
+      return Qnil;
+   }
+
+   if (GetCommTimeouts(config->fh, &ctout) == 0)
+   {
+      _rb_win32_fail(sGetCommTimeouts);
+   }
+   modem_params_to_dcb(config->sp, config->dcb, &ctout, config->argc, config->argv);
+   save_modem_params(config->sp, config->fh, config->dcb, &ctout);
+   return Qnil;
+}
+
+VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port, options, argc, argv)
+   VALUE class, _port, options;
+   int argc;
+   VALUE *argv;
 {
 #ifdef RUBY_1_9
    rb_io_t *fp;
@@ -72,6 +119,10 @@ VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port)
    int num_port;
    char *str_port;
    char port[260]; /* Windows XP MAX_PATH. See http://msdn.microsoft.com/en-us/library/aa365247(VS.85).aspx */
+   int overlapped;
+   int rx_buffer, tx_buffer;
+   struct open_config config;
+   int state = 0;
 
    DCB dcb;
 
@@ -117,14 +168,39 @@ VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port)
          break;
    }
 
-   fd = open(port, O_BINARY | O_RDWR);
-   if (fd == -1)
+   overlapped = RTEST(sp_open_option(options, "overlapped"));
+   rx_buffer = sp_open_size_option(options, "rx_buffer", 1024);
+   tx_buffer = sp_open_size_option(options, "tx_buffer", 1024);
+
+   if (overlapped)
+   {
+      /* open() can't ask for FILE_FLAG_OVERLAPPED */
+      fh = CreateFileA(port, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                       OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+      if (fh == INVALID_HANDLE_VALUE)
+      {
+         _rb_win32_fail("CreateFile");
+      }
+
+      fd = _open_osfhandle((intptr_t) fh, O_BINARY | O_RDWR);
+      if (fd == -1)
+      {
+         CloseHandle(fh);
+         rb_sys_fail(port);
+      }
+   }
+   else
    {
-      rb_sys_fail(port);
+      fd = open(port, O_BINARY | O_RDWR);
+      if (fd == -1)
+      {
+         rb_sys_fail(port);
+      }
+
+      fh = (HANDLE) _get_osfhandle(fd);
    }
 
-   fh = (HANDLE) _get_osfhandle(fd);
-   if (SetupComm(fh, 1024, 1024) == 0)
+   if (SetupComm(fh, rx_buffer, tx_buffer) == 0)
    {
       close(fd);
       rb_raise(rb_eArgError, "not a serial port");
@@ -148,10 +224,17 @@ VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port)
    dcb.fAbortOnError = FALSE;
    dcb.XonChar = 17;
    dcb.XoffChar = 19;
-   if (SetCommState(fh, &dcb) == 0)
+
+   config.sp = (VALUE) sp;
+   config.fh = fh;
+   config.dcb = &dcb;
+   config.argc = argc;
+   config.argv = argv;
+   rb_protect(configure_port, (VALUE) &config, &state);
+   if (state)
    {
       close(fd);
-      _rb_win32_fail(sSetCommState);
+      rb_jump_tag(state);
    }
 
    errno = 0;
@@ -161,26 +244,160 @@ VALUE RB_SERIAL_EXPORT sp_create_impl(class, _port)
 #else
    fp->f = fdopen(fd, "rb+");
 #endif
+   get_port_data((VALUE) sp)->overlapped = overlapped;
    return (VALUE) sp;
 }
 
-VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
-   int argc;
-   VALUE *argv, self;
+/*
+ * :nodoc: Decode the line settings held in dcb.
+ */
+static void dcb_to_modem_params(DCB *dcb, struct modem_params *mp)
+{
+   mp->data_rate = dcb->BaudRate;
+   mp->data_bits = dcb->ByteSize;
+   mp->stop_bits = (dcb->StopBits == ONESTOPBIT ? 1 : 2);
+   mp->parity = dcb->Parity;
+
+   mp->flow_control = 0;
+   if (dcb->fOutxCtsFlow)
+   {
+      mp->flow_control += HARD;
+   }
+
+   if (dcb->fOutX)
+   {
+      mp->flow_control += SOFT;
+   }
+}
+
+/*
+ * :nodoc: Decode the read and write timeouts held in ctout.
+ */
+static void timeouts_to_modem_params(COMMTIMEOUTS *ctout, struct modem_params *mp)
+{
+   switch (ctout->ReadTotalTimeoutConstant)
+   {
+      case 0:
+         /* see set_read_timeouts for the read_min_bytes encodings */
+         if (ctout->ReadIntervalTimeout == MAXDWORD)
+         {
+            mp->read_timeout = -1;
+         }
+         else
+         {
+            mp->read_timeout = ctout->ReadIntervalTimeout;
+         }
+         break;
+      case MAXDWORD:
+      case MAXDWORD - 1:
+         mp->read_timeout = 0;
+         break;
+      default:
+         mp->read_timeout = ctout->ReadTotalTimeoutConstant;
+         break;
+   }
+
+   mp->write_timeout = ctout->WriteTotalTimeoutMultiplier;
+}
+
+/*
+ * :nodoc: Map a read timeout in milliseconds onto ctout. When a minimum
+ * read size is set, reads wait for the first byte without a total
+ * timeout and the timeout only limits the gap between bytes, which is
+ * how VMIN and VTIME behave on POSIX.
+ */
+static void set_read_timeouts(COMMTIMEOUTS *ctout, int timeout, int min_bytes)
+{
+   if (timeout < 0)
+   {
+      ctout->ReadIntervalTimeout = MAXDWORD;
+      ctout->ReadTotalTimeoutMultiplier = 0;
+      ctout->ReadTotalTimeoutConstant = 0;
+   }
+   else if (min_bytes > 0)
+   {
+      ctout->ReadIntervalTimeout = timeout;
+      ctout->ReadTotalTimeoutMultiplier = 0;
+      ctout->ReadTotalTimeoutConstant = 0;
+   }
+   else if (timeout == 0)
+   {
+      ctout->ReadIntervalTimeout = MAXDWORD;
+      ctout->ReadTotalTimeoutMultiplier = MAXDWORD;
+      ctout->ReadTotalTimeoutConstant = MAXDWORD - 1;
+   }
+   else
+   {
+      ctout->ReadIntervalTimeout = timeout;
+      ctout->ReadTotalTimeoutMultiplier = 0;
+      ctout->ReadTotalTimeoutConstant = timeout;
+   }
+}
+
+static COMMTIMEOUTS *rx_thread_timeouts(VALUE self);
+
+/*
+ * :nodoc: While a receive thread runs the port has its read timeouts;
+ * put the ones configured for the port into ctout instead.
+ */
+static void copy_rx_read_timeouts(self, ctout)
+   VALUE self;
+   COMMTIMEOUTS *ctout;
+{
+   COMMTIMEOUTS *rx_saved = rx_thread_timeouts(self);
+
+   if (rx_saved != NULL)
+   {
+      ctout->ReadIntervalTimeout = rx_saved->ReadIntervalTimeout;
+      ctout->ReadTotalTimeoutMultiplier = rx_saved->ReadTotalTimeoutMultiplier;
+      ctout->ReadTotalTimeoutConstant = rx_saved->ReadTotalTimeoutConstant;
+   }
+}
+
+void RB_SERIAL_EXPORT get_modem_params_impl(self, mp)
+   VALUE self;
+   struct modem_params *mp;
 {
    HANDLE fh;
    DCB dcb;
    COMMTIMEOUTS ctout;
+
+   fh = get_handle_helper(self);
+   ZeroMemory(&dcb, sizeof(DCB));
+   dcb.DCBlength = sizeof(DCB);
+   if (GetCommState(fh, &dcb) == 0)
+   {
+      _rb_win32_fail(sGetCommState);
+   }
+   if (GetCommTimeouts(fh, &ctout) == 0)
+   {
+      _rb_win32_fail(sGetCommTimeouts);
+   }
+
+   copy_rx_read_timeouts(self, &ctout);
+
+   dcb_to_modem_params(&dcb, mp);
+   timeouts_to_modem_params(&ctout, mp);
+}
+
+/*
+ * :nodoc: Put the modem parameters of SerialPort#set_modem_params into
+ * dcb and ctout, without applying them.
+ */
+static void modem_params_to_dcb(self, dcb, ctout, argc, argv)
+   VALUE self;
+   DCB *dcb;
+   COMMTIMEOUTS *ctout;
+   int argc;
+   VALUE *argv;
+{
+   COMMTIMEOUTS *rx_saved;
    VALUE _data_rate, _data_bits, _parity, _stop_bits;
    VALUE _flow_control, _read_timeout, _write_timeout;
    int use_hash = 0;
    int data_rate, data_bits, parity;
    int flow_control, read_timeout, write_timeout;
 
-   if (argc == 0)
-   {
-      return self;
-   }
    if (argc == 1 && T_HASH == TYPE(argv[0]))
    {
       use_hash = 1;
@@ -193,18 +410,6 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
       _write_timeout = rb_hash_aref(argv[0], sWriteTimeout);
    }
 
-   fh = get_handle_helper(self);
-   ZeroMemory(&dcb, sizeof(DCB));
-   dcb.DCBlength = sizeof(DCB);
-   if (GetCommState(fh, &dcb) == 0)
-   {
-      _rb_win32_fail(sGetCommState);
-   }
-   else if (GetCommTimeouts(fh, &ctout) == 0)
-   {
-      _rb_win32_fail(sGetCommTimeouts);
-   }
-
    if (!use_hash)
    {
       _data_rate = argv[0];
@@ -224,7 +429,7 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
       rb_raise(rb_eArgError, "invalid baud rate");
    }
 
-   dcb.BaudRate = data_rate;
+   dcb->BaudRate = data_rate;
 
    SetDataBits:
 
@@ -243,7 +448,7 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
    data_bits = FIX2INT(_data_bits);
    if (4 <= data_bits && data_bits <= 8)
    {
-      dcb.ByteSize = data_bits;
+      dcb->ByteSize = data_bits;
    }
    else
    {
@@ -267,10 +472,10 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
    switch (FIX2INT(_stop_bits))
    {
       case 1:
-         dcb.StopBits = ONESTOPBIT;
+         dcb->StopBits = ONESTOPBIT;
          break;
       case 2:
-         dcb.StopBits = TWOSTOPBITS;
+         dcb->StopBits = TWOSTOPBITS;
          break;
       default:
          rb_raise(rb_eArgError, "unknown number of stop bits");
@@ -281,7 +486,7 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
 
    if (!use_hash)
    {
-      _parity = (argc >= 4 ? argv[3] : (dcb.ByteSize == 8 ?
+      _parity = (argc >= 4 ? argv[3] : (dcb->ByteSize == 8 ?
                INT2FIX(NOPARITY) : INT2FIX(EVENPARITY)));
    }
 
@@ -300,7 +505,7 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
       case MARKPARITY:
       case SPACEPARITY:
       case NOPARITY:
-         dcb.Parity = parity;
+         dcb->Parity = parity;
          break;
 
       default:
@@ -332,22 +537,26 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
 
    if (flow_control & HARD)
    {
-      dcb.fRtsControl = RTS_CONTROL_HANDSHAKE;
-      dcb.fOutxCtsFlow = TRUE;
+      dcb->fRtsControl = RTS_CONTROL_HANDSHAKE;
+      dcb->fOutxCtsFlow = TRUE;
    }
    else
    {
-      dcb.fRtsControl = RTS_CONTROL_ENABLE;
-      dcb.fOutxCtsFlow = FALSE;
+      /* leave RS-485 direction control on, see sp_set_rs485_impl */
+      if (dcb->fRtsControl != RTS_CONTROL_TOGGLE)
+      {
+         dcb->fRtsControl = RTS_CONTROL_ENABLE;
+      }
+      dcb->fOutxCtsFlow = FALSE;
    }
 
    if (flow_control & SOFT)
    {
-      dcb.fOutX = dcb.fInX = TRUE;
+      dcb->fOutX = dcb->fInX = TRUE;
    }
    else
    {
-      dcb.fOutX = dcb.fInX = FALSE;
+      dcb->fOutX = dcb->fInX = FALSE;
    }
 
    SetReadTimeout:
@@ -365,24 +574,9 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
    Check_Type(_read_timeout, T_FIXNUM);
    read_timeout = FIX2INT(_read_timeout);
 
-   if (read_timeout < 0)
-   {
-      ctout.ReadIntervalTimeout = MAXDWORD;
-      ctout.ReadTotalTimeoutMultiplier = 0;
-      ctout.ReadTotalTimeoutConstant = 0;
-   }
-   else if (read_timeout == 0)
-   {
-      ctout.ReadIntervalTimeout = MAXDWORD;
-      ctout.ReadTotalTimeoutMultiplier = MAXDWORD;
-      ctout.ReadTotalTimeoutConstant = MAXDWORD - 1;
-   }
-   else
-   {
-      ctout.ReadIntervalTimeout = read_timeout;
-      ctout.ReadTotalTimeoutMultiplier = 0;
-      ctout.ReadTotalTimeoutConstant = read_timeout;
-   }
+   rx_saved = rx_thread_timeouts(self);
+   set_read_timeouts(rx_saved != NULL ? rx_saved : ctout, read_timeout,
+                     get_port_data(self)->read_min_bytes);
 
    SetWriteTimeout:
 
@@ -393,52 +587,65 @@ VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
 
    if (NIL_P(_write_timeout))
    {
-      goto SaveSettings;
+      return;
    }
 
    Check_Type(_write_timeout, T_FIXNUM);
    write_timeout = FIX2INT(_write_timeout);
 
-   fh = get_handle_helper(self);
-   if (GetCommTimeouts(fh, &ctout) == 0)
-   {
-      _rb_win32_fail(sGetCommTimeouts);
-   }
-
    if (write_timeout <= 0)
    {
-      ctout.WriteTotalTimeoutMultiplier = 0;
-      ctout.WriteTotalTimeoutConstant = 0;
+      ctout->WriteTotalTimeoutMultiplier = 0;
+      ctout->WriteTotalTimeoutConstant = 0;
    }
    else
    {
-      ctout.WriteTotalTimeoutMultiplier = write_timeout;
-      ctout.WriteTotalTimeoutConstant = 0;
+      ctout->WriteTotalTimeoutMultiplier = write_timeout;
+      ctout->WriteTotalTimeoutConstant = 0;
    }
+}
 
-   SaveSettings:
+/*
+ * :nodoc: Apply dcb and ctout filled in by modem_params_to_dcb and cache
+ * the resulting modem parameters.
+ */
+static void save_modem_params(self, fh, dcb, ctout)
+   VALUE self;
+   HANDLE fh;
+   DCB *dcb;
+   COMMTIMEOUTS *ctout;
+{
+   struct modem_params mp;
 
-   if (SetCommTimeouts(fh, &ctout) == 0)
+   if (SetCommTimeouts(fh, ctout) == 0)
    {
       _rb_win32_fail(sSetCommTimeouts);
    }
 
-   if (SetCommState(fh, &dcb) == 0)
+   if (SetCommState(fh, dcb) == 0)
    {
       _rb_win32_fail(sSetCommState);
    }
 
-   return argv[0];
+   copy_rx_read_timeouts(self, ctout);
+   dcb_to_modem_params(dcb, &mp);
+   timeouts_to_modem_params(ctout, &mp);
+   cache_modem_params(self, &mp);
 }
 
-void RB_SERIAL_EXPORT get_modem_params_impl(self, mp)
-   VALUE self;
-   struct modem_params *mp;
+VALUE RB_SERIAL_EXPORT sp_set_modem_params_impl(argc, argv, self)
+   int argc;
+   VALUE *argv, self;
 {
    HANDLE fh;
    DCB dcb;
    COMMTIMEOUTS ctout;
 
+   if (argc == 0)
+   {
+      return self;
+   }
+
    fh = get_handle_helper(self);
    ZeroMemory(&dcb, sizeof(DCB));
    dcb.DCBlength = sizeof(DCB);
@@ -446,43 +653,15 @@ void RB_SERIAL_EXPORT get_modem_params_impl(self, mp)
    {
       _rb_win32_fail(sGetCommState);
    }
-   if (GetCommTimeouts(fh, &ctout) == 0)
+   else if (GetCommTimeouts(fh, &ctout) == 0)
    {
       _rb_win32_fail(sGetCommTimeouts);
    }
 
-   mp->data_rate = dcb.BaudRate;
-   mp->data_bits = dcb.ByteSize;
-   mp->stop_bits = (dcb.StopBits == ONESTOPBIT ? 1 : 2);
-   mp->parity = dcb.Parity;
-
-   mp->flow_control = 0;
-   if (dcb.fOutxCtsFlow)
-   {
-      mp->flow_control += HARD;
-   }
-
-   if (dcb.fOutX)
-   {
-      mp->flow_control += SOFT;
-   }
-
-   switch (ctout.ReadTotalTimeoutConstant)
-   {
-      case 0:
-         mp->read_timeout = -1;
-         break;
-      case MAXDWORD:
-      case MAXDWORD - 1:
-         mp->read_timeout = 0;
-         break;
-      default:
-         mp->read_timeout = ctout.ReadTotalTimeoutConstant;
-         break;
-   }
-
-   mp->write_timeout = ctout.WriteTotalTimeoutMultiplier;
+   modem_params_to_dcb(self, &dcb, &ctout, argc, argv);
+   save_modem_params(self, fh, &dcb, &ctout);
 
+   return argv[0];
 }
 
 VALUE RB_SERIAL_EXPORT sp_set_flow_control_impl(self, val)
@@ -491,6 +670,7 @@ VALUE RB_SERIAL_EXPORT sp_set_flow_control_impl(self, val)
    HANDLE fh;
    int flowc;
    DCB dcb;
+   struct modem_params mp;
 
    Check_Type(val, T_FIXNUM);
 
@@ -519,7 +699,11 @@ VALUE RB_SERIAL_EXPORT sp_set_flow_control_impl(self, val)
    }
    else
    {
-      dcb.fRtsControl = RTS_CONTROL_ENABLE;
+      /* leave RS-485 direction control on, see sp_set_rs485_impl */
+      if (dcb.fRtsControl != RTS_CONTROL_TOGGLE)
+      {
+         dcb.fRtsControl = RTS_CONTROL_ENABLE;
+      }
       dcb.fOutxCtsFlow = FALSE;
    }
 
@@ -537,36 +721,11 @@ VALUE RB_SERIAL_EXPORT sp_set_flow_control_impl(self, val)
       _rb_win32_fail(sSetCommState);
    }
 
-   return val;
-}
-
-VALUE RB_SERIAL_EXPORT sp_get_flow_control_impl(self)
-   VALUE self;
-{
-   HANDLE fh;
-   int ret;
-   DCB dcb;
-
-   fh = get_handle_helper(self);
-   ZeroMemory(&dcb, sizeof(DCB));
-   dcb.DCBlength = sizeof(DCB);
-   if (GetCommState(fh, &dcb) == 0)
-   {
-      _rb_win32_fail(sGetCommState);
-   }
-
-   ret = 0;
-   if (dcb.fOutxCtsFlow)
-   {
-      ret += HARD;
-   }
-
-   if (dcb.fOutX)
-   {
-      ret += SOFT;
-   }
+   get_modem_params(self, &mp);
+   dcb_to_modem_params(&dcb, &mp);
+   cache_modem_params(self, &mp);
 
-   return INT2FIX(ret);
+   return val;
 }
 
 VALUE RB_SERIAL_EXPORT sp_set_read_timeout_impl(self, val)
@@ -575,65 +734,42 @@ VALUE RB_SERIAL_EXPORT sp_set_read_timeout_impl(self, val)
    int timeout;
    HANDLE fh;
    COMMTIMEOUTS ctout;
+   struct modem_params mp;
+
+   COMMTIMEOUTS *rx_saved;
 
    Check_Type(val, T_FIXNUM);
    timeout = FIX2INT(val);
 
+   /* a receive thread owns the read timeouts, they apply once it stops */
+   rx_saved = rx_thread_timeouts(self);
+   if (rx_saved != NULL)
+   {
+      set_read_timeouts(rx_saved, timeout, get_port_data(self)->read_min_bytes);
+      get_modem_params(self, &mp);
+      timeouts_to_modem_params(rx_saved, &mp);
+      cache_modem_params(self, &mp);
+      return val;
+   }
+
    fh = get_handle_helper(self);
    if (GetCommTimeouts(fh, &ctout) == 0)
    {
       _rb_win32_fail(sGetCommTimeouts);
    }
 
-   if (timeout < 0)
-   {
-      ctout.ReadIntervalTimeout = MAXDWORD;
-      ctout.ReadTotalTimeoutMultiplier = 0;
-      ctout.ReadTotalTimeoutConstant = 0;
-   }
-   else if (timeout == 0)
-   {
-      ctout.ReadIntervalTimeout = MAXDWORD;
-      ctout.ReadTotalTimeoutMultiplier = MAXDWORD;
-      ctout.ReadTotalTimeoutConstant = MAXDWORD - 1;
-   }
-   else
-   {
-      ctout.ReadIntervalTimeout = timeout;
-      ctout.ReadTotalTimeoutMultiplier = 0;
-      ctout.ReadTotalTimeoutConstant = timeout;
-   }
+   set_read_timeouts(&ctout, timeout, get_port_data(self)->read_min_bytes);
 
    if (SetCommTimeouts(fh, &ctout) == 0)
    {
       _rb_win32_fail(sSetCommTimeouts);
    }
 
-   return val;
-}
-
-VALUE RB_SERIAL_EXPORT sp_get_read_timeout_impl(self)
-   VALUE self;
-{
-   HANDLE fh;
-   COMMTIMEOUTS ctout;
-
-   fh = get_handle_helper(self);
-   if (GetCommTimeouts(fh, &ctout) == 0)
-   {
-      _rb_win32_fail(sGetCommTimeouts);
-   }
-
-   switch (ctout.ReadTotalTimeoutConstant)
-   {
-      case 0:
-         return INT2FIX(-1);
-      case MAXDWORD:
-      case MAXDWORD - 1:
-         return INT2FIX(0);
-   }
+   get_modem_params(self, &mp);
+   timeouts_to_modem_params(&ctout, &mp);
+   cache_modem_params(self, &mp);
 
-   return INT2FIX(ctout.ReadTotalTimeoutConstant);
+   return val;
 }
 
 VALUE RB_SERIAL_EXPORT sp_set_write_timeout_impl(self, val)
@@ -642,6 +778,7 @@ VALUE RB_SERIAL_EXPORT sp_set_write_timeout_impl(self, val)
    int timeout;
    HANDLE fh;
    COMMTIMEOUTS ctout;
+   struct modem_params mp;
 
    Check_Type(val, T_FIXNUM);
    timeout = FIX2INT(val);
@@ -668,22 +805,21 @@ VALUE RB_SERIAL_EXPORT sp_set_write_timeout_impl(self, val)
       _rb_win32_fail(sSetCommTimeouts);
    }
 
+   get_modem_params(self, &mp);
+   timeouts_to_modem_params(&ctout, &mp);
+   cache_modem_params(self, &mp);
+
    return val;
 }
 
 VALUE RB_SERIAL_EXPORT sp_get_write_timeout_impl(self)
    VALUE self;
 {
-   HANDLE fh;
-   COMMTIMEOUTS ctout;
+   struct modem_params mp;
 
-   fh = get_handle_helper(self);
-   if (GetCommTimeouts(fh, &ctout) == 0)
-   {
-      _rb_win32_fail(sGetCommTimeouts);
-   }
+   get_modem_params(self, &mp);
 
-   return INT2FIX(ctout.WriteTotalTimeoutMultiplier);
+   return INT2FIX(mp.write_timeout);
 }
 
 static void delay_ms(time)
@@ -705,6 +841,103 @@ static void delay_ms(time)
    CloseHandle(ev);
 }
 
+/*
+ * The driver raises RTS while sending (RTS_CONTROL_TOGGLE); the levels
+ * and delays can't be changed.
+ */
+void RB_SERIAL_EXPORT sp_set_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   HANDLE fh;
+   DCB dcb;
+
+   fh = get_handle_helper(self);
+   dcb.DCBlength = sizeof(dcb);
+   if (GetCommState(fh, &dcb) == 0)
+   {
+      _rb_win32_fail(sGetCommState);
+   }
+
+   if (rs->enabled)
+   {
+      dcb.fRtsControl = RTS_CONTROL_TOGGLE;
+      dcb.fOutxCtsFlow = FALSE;
+   }
+   else if (dcb.fRtsControl == RTS_CONTROL_TOGGLE)
+   {
+      dcb.fRtsControl = RTS_CONTROL_ENABLE;
+   }
+
+   if (SetCommState(fh, &dcb) == 0)
+   {
+      _rb_win32_fail(sSetCommState);
+   }
+
+   get_port_data(self)->mp_valid = 0;
+}
+
+void RB_SERIAL_EXPORT sp_get_rs485_impl(self, rs)
+   VALUE self;
+   struct rs485_params *rs;
+{
+   HANDLE fh;
+   DCB dcb;
+
+   fh = get_handle_helper(self);
+   dcb.DCBlength = sizeof(dcb);
+   if (GetCommState(fh, &dcb) == 0)
+   {
+      _rb_win32_fail(sGetCommState);
+   }
+
+   rs->enabled = (dcb.fRtsControl == RTS_CONTROL_TOGGLE);
+   rs->rts_on_send = 1;
+   rs->rts_after_send = 0;
+   rs->delay_before = rs->delay_after = 0;
+}
+
+static BOOL send_break(HANDLE fh, long break_us, long mab_us);
+
+/* The break alone, see send_break */
+struct break_args
+{
+   HANDLE fh;
+   long break_us;
+   long mab_us;
+   BOOL ok;
+   DWORD error;
+};
+
+static void *break_func(ptr)
+   void *ptr;
+{
+   struct break_args *b = (struct break_args *) ptr;
+
+   b->ok = send_break(b->fh, b->break_us, b->mab_us);
+   b->error = (b->ok ? 0 : GetLastError());
+
+   return NULL;
+}
+
+void RB_SERIAL_EXPORT sp_send_break_impl(self, break_us, mab_us)
+   VALUE self;
+   long break_us, mab_us;
+{
+   struct break_args b;
+
+   b.fh = get_handle_helper(self);
+   b.break_us = break_us;
+   b.mab_us = mab_us;
+
+   sp_blocking_call(break_func, &b);
+   if (!b.ok)
+   {
+      SetLastError(b.error);
+      _rb_win32_fail("SetCommBreak");
+   }
+}
+
 VALUE RB_SERIAL_EXPORT sp_break_impl(self, time)
    VALUE self, time;
 {
@@ -743,6 +976,50 @@ void RB_SERIAL_EXPORT get_line_signals_helper_impl(obj, ls)
    ls->ri  = (status & MS_RING_ON ? 1 : 0);
 }
 
+/*
+ * :nodoc: Convert MS_*_ON bits to LINE_* bits.
+ */
+static int status_to_lines(status)
+   DWORD status;
+{
+   return (status & MS_CTS_ON ? LINE_CTS : 0) |
+          (status & MS_DSR_ON ? LINE_DSR : 0) |
+          (status & MS_RLSD_ON ? LINE_DCD : 0) |
+          (status & MS_RING_ON ? LINE_RI : 0);
+}
+
+int RB_SERIAL_EXPORT sp_get_signal_bits_impl(self)
+   VALUE self;
+{
+   DWORD status;
+
+   if (GetCommModemStatus(get_handle_helper(self), &status) == 0)
+   {
+      _rb_win32_fail("GetCommModemStatus");
+   }
+
+   return status_to_lines(status);
+}
+
+/*
+ * Windows has no call changing several lines at once, each line is set
+ * with its own EscapeCommFunction.
+ */
+void RB_SERIAL_EXPORT sp_set_signal_bits_impl(self, set, clear)
+   VALUE self;
+   int set, clear;
+{
+   HANDLE fh = get_handle_helper(self);
+
+   if (((set & LINE_RTS) && EscapeCommFunction(fh, SETRTS) == 0) ||
+       ((clear & LINE_RTS) && EscapeCommFunction(fh, CLRRTS) == 0) ||
+       ((set & LINE_DTR) && EscapeCommFunction(fh, SETDTR) == 0) ||
+       ((clear & LINE_DTR) && EscapeCommFunction(fh, CLRDTR) == 0))
+   {
+      _rb_win32_fail("EscapeCommFunction");
+   }
+}
+
 static VALUE set_signal(obj, val, sigoff, sigon)
    VALUE obj,val;
    int sigoff, sigon;
@@ -787,6 +1064,20 @@ VALUE RB_SERIAL_EXPORT sp_set_dtr_impl(self, val)
    return set_signal(self, val, CLRDTR, SETDTR);
 }
 
+VALUE RB_SERIAL_EXPORT sp_set_low_latency_impl(self, val)
+   VALUE self, val;
+{
+   rb_notimplement();
+   return self;
+}
+
+VALUE RB_SERIAL_EXPORT sp_get_low_latency_impl(self)
+   VALUE self;
+{
+   rb_notimplement();
+   return self;
+}
+
 VALUE RB_SERIAL_EXPORT sp_get_rts_impl(self)
    VALUE self;
 {
@@ -801,4 +1092,1815 @@ VALUE RB_SERIAL_EXPORT sp_get_dtr_impl(self)
    return self;
 }
 
+/*
+ * Longest single wait in the native read loop. ReadFile cannot be
+ * interrupted, so long timeouts are split into slices of this length and
+ * pending Ruby interrupts are checked between them.
+ */
+#define READ_SLICE_MS  100
+
+struct blocking_io
+{
+   HANDLE fh;
+   int write;
+   char *buf;
+   DWORD len;
+   DWORD result;
+   BOOL ok;
+   DWORD error;
+
+   /* only used on ports opened for overlapped I/O */
+   int overlapped;
+   DWORD wait;       /* ms to wait for completion before cancelling */
+   HANDLE cancel;    /* signalled when the calling thread is interrupted */
+   int cancelled;
+
+   struct port_data *pd;   /* counters and capture of the port */
+   LONG_LONG stamp;     /* when a read returned, see monotonic_ns */
+   long break_us;       /* send a break first if > 0, see send_break */
+   long mab_us;
+};
+
+/*
+ * :nodoc: Nanoseconds on the QueryPerformanceCounter clock, which
+ * Process.clock_gettime uses for CLOCK_MONOTONIC, for receive timestamps.
+ */
+static LONG_LONG monotonic_ns(void)
+{
+   static LONG_LONG freq;
+   LARGE_INTEGER count;
+
+   if (freq == 0)
+   {
+      LARGE_INTEGER f;
+
+      QueryPerformanceFrequency(&f);
+      freq = f.QuadPart;
+   }
+   QueryPerformanceCounter(&count);
+
+   /* split up so that count * 10^9 can't overflow */
+   return count.QuadPart / freq * 1000000000 +
+          count.QuadPart % freq * 1000000000 / freq;
+}
+
+/* Sleep() is only good to the timer tick, the rest of a break is spun */
+#define BREAK_SPIN_NS 16000000
+
+/*
+ * :nodoc: Wait until monotonic_ns reaches deadline.
+ */
+static void wait_until_ns(deadline)
+   LONG_LONG deadline;
+{
+   LONG_LONG left;
+
+   while ((left = deadline - monotonic_ns()) > 0)
+   {
+      if (left > BREAK_SPIN_NS)
+      {
+         Sleep((DWORD) ((left - BREAK_SPIN_NS) / 1000000));
+      }
+   }
+}
+
+/*
+ * :nodoc: Once the output has been sent, hold the line in break for
+ * break_us microseconds, then at mark for mab_us. Returns FALSE with the
+ * error in GetLastError on failure. Called with the GVL released.
+ */
+static BOOL send_break(fh, break_us, mab_us)
+   HANDLE fh;
+   long break_us, mab_us;
+{
+   FlushFileBuffers(fh);
+   if (SetCommBreak(fh) == 0)
+   {
+      return FALSE;
+   }
+   wait_until_ns(monotonic_ns() + (LONG_LONG) break_us * 1000);
+
+   if (ClearCommBreak(fh) == 0)
+   {
+      return FALSE;
+   }
+   if (mab_us > 0)
+   {
+      wait_until_ns(monotonic_ns() + (LONG_LONG) mab_us * 1000);
+   }
+
+   return TRUE;
+}
+
+/*
+ * :nodoc: Issue an overlapped ReadFile or WriteFile and wait for it.
+ * The request is cancelled when io->wait expires or io->cancel is
+ * signalled; either way it has finished, and io->result holds what was
+ * transferred, before this returns.
+ */
+static void overlapped_io(io)
+   struct blocking_io *io;
+{
+   OVERLAPPED ov;
+   HANDLE events[2];
+   DWORD ret;
+
+   ZeroMemory(&ov, sizeof(ov));
+   ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (ov.hEvent == NULL)
+   {
+      io->ok = FALSE;
+      io->error = GetLastError();
+      return;
+   }
+
+   if (io->write)
+   {
+      io->ok = WriteFile(io->fh, io->buf, io->len, NULL, &ov);
+   }
+   else
+   {
+      io->ok = ReadFile(io->fh, io->buf, io->len, NULL, &ov);
+   }
+
+   if (io->ok || GetLastError() == ERROR_IO_PENDING)
+   {
+      if (!io->ok)
+      {
+         events[0] = ov.hEvent;
+         events[1] = io->cancel;
+         ret = WaitForMultipleObjects(2, events, FALSE, io->wait);
+         if (ret != WAIT_OBJECT_0)
+         {
+            io->cancelled = (ret == WAIT_OBJECT_0 + 1);
+            CancelIo(io->fh);
+         }
+      }
+
+      io->ok = GetOverlappedResult(io->fh, &ov, &io->result, TRUE);
+      if (!io->ok && GetLastError() == ERROR_OPERATION_ABORTED)
+      {
+         /* cancelled by us, io->result counts what got through */
+         io->ok = TRUE;
+      }
+   }
+
+   io->error = (io->ok ? 0 : GetLastError());
+   CloseHandle(ov.hEvent);
+}
+
+/*
+ * :nodoc: Single ReadFile or WriteFile call, made with the GVL released.
+ */
+static void *blocking_io_func(ptr)
+   void *ptr;
+{
+   struct blocking_io *io = (struct blocking_io *) ptr;
+
+   io->result = 0;
+   if (io->break_us > 0)
+   {
+      /* in the same call as the write, so it follows the break closely */
+      if (!send_break(io->fh, io->break_us, io->mab_us))
+      {
+         io->ok = FALSE;
+         io->error = GetLastError();
+         return NULL;
+      }
+      io->break_us = 0;
+   }
+
+   if (io->overlapped)
+   {
+      overlapped_io(io);
+   }
+   else if (io->write)
+   {
+      io->ok = WriteFile(io->fh, io->buf, io->len, &io->result, NULL);
+      io->error = (io->ok ? 0 : GetLastError());
+   }
+   else
+   {
+      io->ok = ReadFile(io->fh, io->buf, io->len, &io->result, NULL);
+      io->error = (io->ok ? 0 : GetLastError());
+   }
+
+   if (!io->write)
+   {
+      io->stamp = monotonic_ns();
+   }
+
+   return NULL;
+}
+
+/*
+ * :nodoc: Wake an overlapped request when its thread is interrupted.
+ */
+static void cancel_io(ptr)
+   void *ptr;
+{
+   SetEvent(((struct blocking_io *) ptr)->cancel);
+}
+
+/*
+ * :nodoc: Run io with the GVL released. Overlapped requests get their own
+ * unblocking function, which cancels them instead of leaving the
+ * OVERLAPPED structure to a request still in flight.
+ */
+static void run_blocking_io(io)
+   struct blocking_io *io;
+{
+   struct port_stats *st = &io->pd->stats;
+
+   io->cancelled = 0;
+   if (!io->overlapped)
+   {
+      sp_blocking_call(blocking_io_func, io);
+   }
+   else
+   {
+      io->cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (io->cancel == NULL)
+      {
+         _rb_win32_fail("CreateEvent");
+      }
+      sp_blocking_call_ubf(blocking_io_func, io, cancel_io, io);
+      CloseHandle(io->cancel);
+   }
+
+   if (!io->ok)
+   {
+      return;
+   }
+   if (io->write)
+   {
+      st->writes++;
+      st->bytes_out += io->result;
+      sp_capture_record(io->pd, CAPTURE_TX, io->buf, io->result, monotonic_ns());
+   }
+   else
+   {
+      st->reads++;
+      st->bytes_in += io->result;
+      if (io->result < io->len)
+      {
+         st->short_reads++;
+      }
+      sp_capture_record(io->pd, CAPTURE_RX, io->buf, io->result, io->stamp);
+      sp_share_publish(io->pd, io->buf, io->result);
+   }
+}
+
+static void init_blocking_io(self, io, write, buf, len)
+   VALUE self;
+   struct blocking_io *io;
+   int write;
+   char *buf;
+   long len;
+{
+   io->fh = get_handle_helper(self);
+   io->write = write;
+   io->buf = buf;
+   io->len = len;
+   io->overlapped = get_port_data(self)->overlapped;
+   io->wait = INFINITE;
+   io->pd = get_port_data(self);
+   io->break_us = 0;
+}
+
+static void blocking_io_fail(io)
+   struct blocking_io *io;
+{
+   SetLastError(io->error);
+   _rb_win32_fail(io->write ? "WriteFile" : "ReadFile");
+}
+
+/*
+ * :nodoc: sp_read_impl on a port without a receive thread, storing when
+ * the data arrived in *stamp.
+ */
+static long direct_read(self, pd, buf, len, timeout, stamp)
+   VALUE self;
+   struct port_data *pd;
+   char *buf;
+   long len;
+   int timeout;
+   LONG_LONG *stamp;
+{
+   HANDLE fh;
+   COMMTIMEOUTS saved, ctout;
+   struct blocking_io io;
+   DWORD slice, start, elapsed;
+   int remaining = timeout;
+
+   init_blocking_io(self, &io, 0, buf, len);
+   fh = io.fh;
+   if (GetCommTimeouts(fh, &saved) == 0)
+   {
+      _rb_win32_fail(sGetCommTimeouts);
+   }
+
+   start = GetTickCount();
+   do
+   {
+      if (io.overlapped)
+      {
+         /* interrupts cancel the request, no need to wake up periodically */
+         slice = (remaining < 0 ? MAXDWORD - 1 : (DWORD) remaining);
+      }
+      else
+      {
+         slice = (remaining < 0 || remaining > READ_SLICE_MS) ? READ_SLICE_MS : remaining;
+      }
+
+      /* return as soon as any byte is available, or after slice ms */
+      ctout = saved;
+      ctout.ReadIntervalTimeout = MAXDWORD;
+      ctout.ReadTotalTimeoutMultiplier = (slice == 0 ? 0 : MAXDWORD);
+      ctout.ReadTotalTimeoutConstant = slice;
+      if (SetCommTimeouts(fh, &ctout) == 0)
+      {
+         _rb_win32_fail(sSetCommTimeouts);
+      }
+
+      run_blocking_io(&io);
+
+      if (!io.ok || io.result > 0)
+      {
+         break;
+      }
+
+      SetCommTimeouts(fh, &saved);
+      if (timeout > 0)
+      {
+         elapsed = GetTickCount() - start;
+         remaining = (elapsed >= (DWORD) timeout ? 0 : timeout - elapsed);
+      }
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   } while (remaining != 0);
+
+   SetCommTimeouts(fh, &saved);
+
+   if (!io.ok)
+   {
+      blocking_io_fail(&io);
+   }
+   if (io.result == 0)
+   {
+      pd->stats.timeouts++;
+   }
+
+   *stamp = io.stamp;
+   return io.result;
+}
+
+long RB_SERIAL_EXPORT sp_read_impl(self, buf, len, timeout)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout;
+{
+   struct port_data *pd = get_port_data(self);
+   LONG_LONG stamp;
+   long n;
+
+   if (pd->ring != NULL)
+   {
+      n = sp_ring_read(pd->ring, buf, len, timeout);
+      if (n == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return n;
+   }
+
+   return direct_read(self, pd, buf, len, timeout, &stamp);
+}
+
+long RB_SERIAL_EXPORT sp_read_stamped_impl(self, buf, len, timeout, stamps, offset)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout;
+   VALUE stamps;
+   long offset;
+{
+   struct port_data *pd = get_port_data(self);
+   LONG_LONG stamp;
+   long n;
+
+   if (pd->ring != NULL)
+   {
+      n = sp_ring_read_stamped(pd->ring, buf, len, timeout, stamps, offset);
+      if (n == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return n;
+   }
+
+   n = direct_read(self, pd, buf, len, timeout, &stamp);
+   if (n > 0)
+   {
+      sp_stamp_append(stamps, offset + n, stamp);
+   }
+
+   return n;
+}
+
+long RB_SERIAL_EXPORT sp_read_timed_impl(self, buf, len, timeout, interval)
+   VALUE self;
+   char *buf;
+   long len;
+   int timeout, interval;
+{
+   HANDLE fh;
+   COMMTIMEOUTS saved, ctout;
+   struct blocking_io io;
+   struct port_data *pd = get_port_data(self);
+   long n;
+
+   if (pd->ring != NULL)
+   {
+      n = sp_ring_read_timed(pd->ring, buf, len, timeout, interval);
+      if (n == 0)
+      {
+         pd->stats.timeouts++;
+      }
+      return n;
+   }
+
+   init_blocking_io(self, &io, 0, buf, len);
+   fh = io.fh;
+   if (GetCommTimeouts(fh, &saved) == 0)
+   {
+      _rb_win32_fail(sGetCommTimeouts);
+   }
+
+   /* the driver already keeps millisecond total and interval timers */
+   ctout = saved;
+   ctout.ReadTotalTimeoutMultiplier = 0;
+   if (timeout == 0)
+   {
+      ctout.ReadIntervalTimeout = MAXDWORD;
+      ctout.ReadTotalTimeoutConstant = 0;
+   }
+   else
+   {
+      ctout.ReadIntervalTimeout = (interval < 0 ? 0 : (interval == 0 ? 1 : interval));
+      ctout.ReadTotalTimeoutConstant = (timeout < 0 ? 0 : timeout);
+   }
+   if (SetCommTimeouts(fh, &ctout) == 0)
+   {
+      _rb_win32_fail(sSetCommTimeouts);
+   }
+
+   run_blocking_io(&io);
+
+   SetCommTimeouts(fh, &saved);
+
+#ifdef RUBY_1_9
+   if (io.cancelled)
+   {
+      rb_thread_check_ints();
+   }
+#endif
+
+   if (!io.ok)
+   {
+      blocking_io_fail(&io);
+   }
+   if (io.result == 0)
+   {
+      pd->stats.timeouts++;
+   }
+
+   return io.result;
+}
+
+long RB_SERIAL_EXPORT sp_write_impl(self, buf, len, timeout)
+   VALUE self;
+   const char *buf;
+   long len;
+   int timeout;
+{
+   return sp_break_write_impl(self, buf, len, 0, 0, timeout);
+}
+
+long RB_SERIAL_EXPORT sp_break_write_impl(self, buf, len, break_us, mab_us, timeout)
+   VALUE self;
+   const char *buf;
+   long len;
+   long break_us, mab_us;
+   int timeout;
+{
+   HANDLE fh;
+   COMMTIMEOUTS saved, ctout;
+   struct blocking_io io;
+   int set_timeouts;
+
+   init_blocking_io(self, &io, 1, (char *) buf, len);
+   io.break_us = break_us;
+   io.mab_us = mab_us;
+   fh = io.fh;
+
+   /*
+    * Overlapped writes time out by cancelling the request, leaving the
+    * timeouts alone for a read running in another thread.
+    */
+   set_timeouts = (timeout >= 0 && !io.overlapped);
+   if (timeout >= 0 && io.overlapped)
+   {
+      io.wait = timeout;
+   }
+
+   if (set_timeouts)
+   {
+      if (GetCommTimeouts(fh, &saved) == 0)
+      {
+         _rb_win32_fail(sGetCommTimeouts);
+      }
+
+      ctout = saved;
+      ctout.WriteTotalTimeoutMultiplier = 0;
+      ctout.WriteTotalTimeoutConstant = (timeout == 0 ? 1 : timeout);
+      if (SetCommTimeouts(fh, &ctout) == 0)
+      {
+         _rb_win32_fail(sSetCommTimeouts);
+      }
+   }
+
+   run_blocking_io(&io);
+
+   if (set_timeouts)
+   {
+      SetCommTimeouts(fh, &saved);
+   }
+
+#ifdef RUBY_1_9
+   if (io.cancelled)
+   {
+      rb_thread_check_ints();
+   }
+#endif
+
+   if (!io.ok)
+   {
+      blocking_io_fail(&io);
+   }
+   if (io.result < io.len)
+   {
+      io.pd->stats.timeouts++;
+   }
+
+   return io.result;
+}
+
+/*
+ * The pieces are copied into one buffer so that they go out with a
+ * single WriteFile.
+ */
+long RB_SERIAL_EXPORT sp_writev_impl(self, strs, timeout)
+   VALUE self, strs;
+   int timeout;
+{
+   long i, n = RARRAY_LEN(strs), total = 0, written;
+   VALUE str, buf;
+   char *p;
+
+   if (n == 1)
+   {
+      str = rb_ary_entry(strs, 0);
+      return sp_write_impl(self, RSTRING_PTR(str), RSTRING_LEN(str), timeout);
+   }
+
+   for (i = 0; i < n; i++)
+   {
+      total += RSTRING_LEN(rb_ary_entry(strs, i));
+   }
+
+   buf = rb_str_buf_new(total);
+   p = RSTRING_PTR(buf);
+   for (i = 0; i < n; i++)
+   {
+      str = rb_ary_entry(strs, i);
+      memcpy(p, RSTRING_PTR(str), RSTRING_LEN(str));
+      p += RSTRING_LEN(str);
+   }
+   rb_str_set_len(buf, total);
+
+   written = sp_write_impl(self, RSTRING_PTR(buf), total, timeout);
+   RB_GC_GUARD(buf);
+
+   return written;
+}
+
+/*
+ * :nodoc: ClearCommError, adding the line errors it clears to st (if not
+ * NULL) so that SerialPort#stats still sees them.
+ */
+static BOOL comm_status(fh, st, stat)
+   HANDLE fh;
+   struct port_stats *st;
+   COMSTAT *stat;
+{
+   DWORD errors;
+
+   if (ClearCommError(fh, &errors, stat) == 0)
+   {
+      return FALSE;
+   }
+
+   if (st != NULL)
+   {
+      if (errors & CE_FRAME)
+      {
+         st->frame++;
+      }
+      if (errors & CE_RXPARITY)
+      {
+         st->parity++;
+      }
+      if (errors & (CE_OVERRUN | CE_RXOVER))
+      {
+         st->overrun++;
+      }
+   }
+
+   return TRUE;
+}
+
+static DWORD queued_bytes(fh, st)
+   HANDLE fh;
+   struct port_stats *st;
+{
+   COMSTAT stat;
+
+   if (!comm_status(fh, st, &stat))
+   {
+      _rb_win32_fail("ClearCommError");
+   }
+
+   return stat.cbInQue;
+}
+
+long RB_SERIAL_EXPORT sp_bytes_available_impl(self)
+   VALUE self;
+{
+   return queued_bytes(get_handle_helper(self), &get_port_data(self)->stats);
+}
+
+long RB_SERIAL_EXPORT sp_output_queue_impl(self)
+   VALUE self;
+{
+   COMSTAT stat;
+
+   if (!comm_status(get_handle_helper(self), &get_port_data(self)->stats, &stat))
+   {
+      _rb_win32_fail("ClearCommError");
+   }
+
+   return stat.cbOutQue;
+}
+
+/*
+ * Each ClearCommError call reports whether an error happened since the
+ * last one, so the counts are of calls that saw the error.
+ */
+int RB_SERIAL_EXPORT sp_get_line_errors_impl(self, st)
+   VALUE self;
+   struct port_stats *st;
+{
+   struct port_stats *kept = &get_port_data(self)->stats;
+   COMSTAT stat;
+
+   if (!comm_status(get_handle_helper(self), kept, &stat))
+   {
+      _rb_win32_fail("ClearCommError");
+   }
+
+   st->frame = kept->frame;
+   st->parity = kept->parity;
+   st->overrun = kept->overrun;
+   return 1;
+}
+
+#define DRAIN_POLL_MS  2
+
+struct drain_wait
+{
+   HANDLE fh;
+   HANDLE cancel;    /* signalled when the calling thread is interrupted */
+   DWORD timeout;
+   int done;
+   DWORD error;
+   struct port_stats *stats;
+};
+
+/*
+ * :nodoc: Wait for the output queue to empty, with the GVL released.
+ * FlushFileBuffers waits for the bytes the driver already handed to the
+ * UART.
+ */
+static void *drain_func(ptr)
+   void *ptr;
+{
+   struct drain_wait *w = (struct drain_wait *) ptr;
+   DWORD start = GetTickCount(), elapsed, slice;
+   COMSTAT stat;
+
+   for (;;)
+   {
+      if (!comm_status(w->fh, w->stats, &stat))
+      {
+         w->error = GetLastError();
+         return NULL;
+      }
+      if (stat.cbOutQue == 0)
+      {
+         break;
+      }
+
+      slice = DRAIN_POLL_MS;
+      if (w->timeout != INFINITE)
+      {
+         elapsed = GetTickCount() - start;
+         if (elapsed >= w->timeout)
+         {
+            return NULL;
+         }
+         if (w->timeout - elapsed < slice)
+         {
+            slice = w->timeout - elapsed;
+         }
+      }
+
+      if (WaitForSingleObject(w->cancel, slice) == WAIT_OBJECT_0)
+      {
+         return NULL;
+      }
+   }
+
+   FlushFileBuffers(w->fh);
+   w->done = 1;
+   return NULL;
+}
+
+static void drain_cancel(ptr)
+   void *ptr;
+{
+   SetEvent((HANDLE) ptr);
+}
+
+int RB_SERIAL_EXPORT sp_drain_impl(self, timeout)
+   VALUE self;
+   int timeout;
+{
+   struct drain_wait w;
+   DWORD start = GetTickCount(), elapsed;
+
+   w.fh = get_handle_helper(self);
+   w.stats = &get_port_data(self)->stats;
+
+   for (;;)
+   {
+      w.done = 0;
+      w.error = 0;
+      w.timeout = INFINITE;
+      if (timeout >= 0)
+      {
+         elapsed = GetTickCount() - start;
+         w.timeout = (elapsed >= (DWORD) timeout ? 0 : timeout - elapsed);
+      }
+
+      w.cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (w.cancel == NULL)
+      {
+         _rb_win32_fail("CreateEvent");
+      }
+      sp_blocking_call_ubf(drain_func, &w, drain_cancel, w.cancel);
+      CloseHandle(w.cancel);
+
+      if (w.error != 0)
+      {
+         SetLastError(w.error);
+         _rb_win32_fail("ClearCommError");
+      }
+
+      if (w.done || w.timeout == 0 ||
+          (timeout > 0 && GetTickCount() - start >= (DWORD) timeout))
+      {
+         return w.done;
+      }
+
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+}
+
+void RB_SERIAL_EXPORT sp_flush_impl(self, input, output)
+   VALUE self;
+   int input, output;
+{
+   DWORD flags = (input ? PURGE_RXABORT | PURGE_RXCLEAR : 0) |
+                 (output ? PURGE_TXABORT | PURGE_TXCLEAR : 0);
+
+   if (PurgeComm(get_handle_helper(self), flags) == 0)
+   {
+      _rb_win32_fail("PurgeComm");
+   }
+}
+
+/*
+ * Selector back end: an overlapped WaitCommEvent(EV_RXCHAR) per port and
+ * one WaitForMultipleObjects over their events.
+ */
+struct selector_wait
+{
+   DWORD count;
+   HANDLE *events;
+   DWORD timeout;
+};
+
+void RB_SERIAL_EXPORT sp_selector_init_impl(sel)
+   struct selector *sel;
+{
+   sel->backend = -1;
+}
+
+void RB_SERIAL_EXPORT sp_selector_close_impl(sel)
+   struct selector *sel;
+{
+   (void) sel;
+}
+
+intptr_t RB_SERIAL_EXPORT sp_selector_add_impl(sel, port)
+   struct selector *sel;
+   VALUE port;
+{
+   if (!get_port_data(port)->overlapped)
+   {
+      rb_raise(rb_eArgError, "the port must be opened with :overlapped => true");
+   }
+
+   /* one wait slot stays reserved for interrupting the wait */
+   if (sel->count >= MAXIMUM_WAIT_OBJECTS - 1)
+   {
+      rb_raise(rb_eArgError, "at most %d ports per selector", MAXIMUM_WAIT_OBJECTS - 1);
+   }
+
+   return (intptr_t) get_handle_helper(port);
+}
+
+void RB_SERIAL_EXPORT sp_selector_remove_impl(sel, handle)
+   struct selector *sel;
+   intptr_t handle;
+{
+   /* the handles are waited for afresh by each select */
+   (void) sel;
+   (void) handle;
+}
+
+static void *selector_wait_func(ptr)
+   void *ptr;
+{
+   struct selector_wait *w = (struct selector_wait *) ptr;
+
+   WaitForMultipleObjects(w->count, w->events, FALSE, w->timeout);
+
+   return NULL;
+}
+
+static void selector_cancel(ptr)
+   void *ptr;
+{
+   SetEvent((HANDLE) ptr);
+}
+
+long RB_SERIAL_EXPORT sp_selector_event_size_impl(void)
+{
+   return sizeof(HANDLE);
+}
+
+/*
+ * The per-port state stays on the stack, sp_selector_add_impl allows
+ * fewer than MAXIMUM_WAIT_OBJECTS ports.
+ */
+long RB_SERIAL_EXPORT sp_selector_wait_impl(sel, handles, n, timeout, ready, wait_events)
+   struct selector *sel;
+   intptr_t *handles;
+   long n;
+   int timeout;
+   char *ready;
+   char *wait_events;
+{
+   OVERLAPPED *ov = ALLOCA_N(OVERLAPPED, n + 1);
+   DWORD *saved = ALLOCA_N(DWORD, n + 1);
+   DWORD *evmask = ALLOCA_N(DWORD, n + 1);
+   int *pending = ALLOCA_N(int, n + 1);
+   HANDLE *events = (HANDLE *) wait_events;
+   HANDLE fh, cancel;
+   struct selector_wait w;
+   DWORD start, elapsed, dummy;
+   int remaining = timeout;
+   long i, count;
+
+   (void) sel;
+   start = GetTickCount();
+   for (;;)
+   {
+      cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (cancel == NULL)
+      {
+         _rb_win32_fail("CreateEvent");
+      }
+
+      /* arm the waits first, so no byte slips in after the check below */
+      w.count = 0;
+      for (i = 0; i < n; i++)
+      {
+         fh = (HANDLE) handles[i];
+         ZeroMemory(&ov[i], sizeof(OVERLAPPED));
+         ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+         pending[i] = 0;
+         if (ov[i].hEvent == NULL || GetCommMask(fh, &saved[i]) == 0)
+         {
+            continue;
+         }
+
+         SetCommMask(fh, saved[i] | EV_RXCHAR);
+         if (!WaitCommEvent(fh, &evmask[i], &ov[i]) && GetLastError() == ERROR_IO_PENDING)
+         {
+            pending[i] = 1;
+            events[w.count++] = ov[i].hEvent;
+         }
+      }
+
+      count = 0;
+      for (i = 0; i < n; i++)
+      {
+         ready[i] = ready[i] || queued_bytes((HANDLE) handles[i], NULL) > 0;
+         count += ready[i];
+      }
+
+      if (count == 0 && remaining != 0)
+      {
+         events[w.count++] = cancel;
+         w.events = events;
+         w.timeout = (remaining < 0 ? INFINITE : (DWORD) remaining);
+         sp_blocking_call_ubf(selector_wait_func, &w, selector_cancel, cancel);
+      }
+
+      /* restoring the mask completes any WaitCommEvent still pending */
+      for (i = 0; i < n; i++)
+      {
+         fh = (HANDLE) handles[i];
+         if (ov[i].hEvent == NULL)
+         {
+            continue;
+         }
+         SetCommMask(fh, saved[i]);
+         if (pending[i])
+         {
+            GetOverlappedResult(fh, &ov[i], &dummy, TRUE);
+         }
+         CloseHandle(ov[i].hEvent);
+      }
+      CloseHandle(cancel);
+
+      for (i = 0; i < n && count == 0; i++)
+      {
+         ready[i] = (queued_bytes((HANDLE) handles[i], NULL) > 0);
+      }
+      for (i = 0, count = 0; i < n; i++)
+      {
+         count += ready[i];
+      }
+
+      if (count > 0 || remaining == 0)
+      {
+         return count;
+      }
+
+      if (timeout > 0)
+      {
+         elapsed = GetTickCount() - start;
+         remaining = (elapsed >= (DWORD) timeout ? 0 : timeout - elapsed);
+      }
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+}
+
+double RB_SERIAL_EXPORT sp_monotonic_ms_impl(void)
+{
+   return GetTickCount();
+}
+
+LONG_LONG RB_SERIAL_EXPORT sp_monotonic_ns_impl(void)
+{
+   return monotonic_ns();
+}
+
+/*
+ * Receive thread: drains the port into the ring as soon as data arrives.
+ * Its reads return after at most RX_SLICE_MS without data, so the thread
+ * notices a stop request even on ports not opened for overlapped I/O.
+ * The thread reads a duplicate of the port handle, closed once it has
+ * exited, so a port garbage collected without SerialPort#close can't
+ * close the handle under it.
+ */
+#define RX_SLICE_MS  100
+
+struct rx_thread
+{
+   HANDLE thread;
+   HANDLE fh;
+   HANDLE data;         /* set when bytes or end of file arrive */
+   HANDLE stop;         /* set to make the thread exit */
+   HANDLE space;        /* set when Ruby makes room in a full ring */
+   int overlapped;
+   COMMTIMEOUTS saved;
+};
+
+struct ring_wait
+{
+   struct rx_ring *ring;
+   HANDLE cancel;
+   DWORD timeout;
+   int interrupted;
+};
+
+/*
+ * :nodoc: The read timeouts to restore when the receive thread of self
+ * stops, or NULL without a receive thread.
+ */
+static COMMTIMEOUTS *rx_thread_timeouts(self)
+   VALUE self;
+{
+   struct rx_ring *ring = get_port_data(self)->ring;
+
+   return ring == NULL ? NULL : &((struct rx_thread *) ring->impl)->saved;
+}
+
+static void rx_notify(ring)
+   struct rx_ring *ring;
+{
+   SP_MEMORY_BARRIER();
+   if (ring->waiting)
+   {
+      SetEvent(((struct rx_thread *) ring->impl)->data);
+   }
+}
+
+/*
+ * :nodoc: One ReadFile of at most len bytes. Returns FALSE on failure,
+ * with *got set to 0 when asked to stop.
+ */
+static BOOL rx_read(t, buf, len, got)
+   struct rx_thread *t;
+   char *buf;
+   DWORD len;
+   DWORD *got;
+{
+   OVERLAPPED ov;
+   HANDLE events[2];
+   BOOL ok;
+
+   *got = 0;
+   if (!t->overlapped)
+   {
+      return ReadFile(t->fh, buf, len, got, NULL);
+   }
+
+   ZeroMemory(&ov, sizeof(ov));
+   ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (ov.hEvent == NULL)
+   {
+      return FALSE;
+   }
+
+   ok = ReadFile(t->fh, buf, len, NULL, &ov);
+   if (ok || GetLastError() == ERROR_IO_PENDING)
+   {
+      events[0] = ov.hEvent;
+      events[1] = t->stop;
+      if (!ok && WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0)
+      {
+         CancelIo(t->fh);
+      }
+      ok = GetOverlappedResult(t->fh, &ov, got, TRUE);
+      if (!ok && GetLastError() == ERROR_OPERATION_ABORTED)
+      {
+         ok = TRUE;
+      }
+   }
+
+   CloseHandle(ov.hEvent);
+   return ok;
+}
+
+static DWORD WINAPI rx_thread_func(ptr)
+   LPVOID ptr;
+{
+   struct rx_ring *ring = (struct rx_ring *) ptr;
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   unsigned long head, space, off;
+   HANDLE events[2];
+   DWORD got;
+
+   events[0] = t->stop;
+   events[1] = t->space;
+
+   while (!ring->stop)
+   {
+      head = ring->head;
+      space = ring->mask + 1 - (head - ring->tail);
+      if (space == 0)
+      {
+         /*
+          * Full, leave the data to the driver until Ruby catches up. Once
+          * full is seen, taking data out of the ring sets t->space.
+          */
+         ring->full = 1;
+         SP_MEMORY_BARRIER();
+         if (ring->head == ring->tail + ring->mask + 1)
+         {
+            WaitForMultipleObjects(2, events, FALSE, INFINITE);
+         }
+         ring->full = 0;
+         continue;
+      }
+
+      off = head & ring->mask;
+      if (space > ring->mask + 1 - off)
+      {
+         space = ring->mask + 1 - off;
+      }
+
+      if (!rx_read(t, ring->buf + off, space, &got))
+      {
+         ring->error = GetLastError();
+         break;
+      }
+
+      if (got > 0)
+      {
+         ring->reads++;
+         sp_ring_stamp(ring, head + got, monotonic_ns());
+         SP_MEMORY_BARRIER();
+         ring->head = head + got;
+         rx_notify(ring);
+      }
+   }
+
+   rx_notify(ring);
+   return 0;
+}
+
+void RB_SERIAL_EXPORT sp_rx_thread_start_impl(self, ring)
+   VALUE self;
+   struct rx_ring *ring;
+{
+   struct rx_thread *t;
+   COMMTIMEOUTS ctout;
+   DWORD id;
+
+   t = ALLOC(struct rx_thread);
+   ZeroMemory(t, sizeof(*t));
+   t->overlapped = get_port_data(self)->overlapped;
+
+   if (!DuplicateHandle(GetCurrentProcess(), get_handle_helper(self),
+                        GetCurrentProcess(), &t->fh, 0, FALSE,
+                        DUPLICATE_SAME_ACCESS))
+   {
+      xfree(t);
+      sp_ring_free(ring);
+      _rb_win32_fail("DuplicateHandle");
+   }
+
+   if (GetCommTimeouts(t->fh, &t->saved) == 0)
+   {
+      DWORD err = GetLastError();
+
+      CloseHandle(t->fh);
+      xfree(t);
+      sp_ring_free(ring);
+      SetLastError(err);
+      _rb_win32_fail(sGetCommTimeouts);
+   }
+
+   /* return as soon as any byte is available, or after RX_SLICE_MS */
+   ctout = t->saved;
+   ctout.ReadIntervalTimeout = MAXDWORD;
+   ctout.ReadTotalTimeoutMultiplier = MAXDWORD;
+   ctout.ReadTotalTimeoutConstant = RX_SLICE_MS;
+   SetCommTimeouts(t->fh, &ctout);
+
+   t->data = CreateEvent(NULL, FALSE, FALSE, NULL);
+   t->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+   t->space = CreateEvent(NULL, FALSE, FALSE, NULL);
+   ring->impl = t;
+   if (t->data != NULL && t->stop != NULL && t->space != NULL)
+   {
+      t->thread = CreateThread(NULL, 0, rx_thread_func, ring, 0, &id);
+   }
+
+   if (t->thread == NULL)
+   {
+      SetCommTimeouts(t->fh, &t->saved);
+      if (t->data != NULL)
+      {
+         CloseHandle(t->data);
+      }
+      if (t->stop != NULL)
+      {
+         CloseHandle(t->stop);
+      }
+      if (t->space != NULL)
+      {
+         CloseHandle(t->space);
+      }
+      CloseHandle(t->fh);
+      xfree(t);
+      sp_ring_free(ring);
+      _rb_win32_fail("CreateThread");
+   }
+}
+
+void RB_SERIAL_EXPORT sp_rx_thread_stop_impl(ring, port_open)
+   struct rx_ring *ring;
+   int port_open;
+{
+   struct rx_thread *t = (struct rx_thread *) ring->impl;
+   COMMTIMEOUTS ctout;
+
+   ring->stop = 1;
+   SP_MEMORY_BARRIER();
+   SetEvent(t->stop);
+   WaitForSingleObject(t->thread, INFINITE);
+
+   if (port_open && GetCommTimeouts(t->fh, &ctout))
+   {
+      /* the write timeouts may have changed meanwhile */
+      ctout.ReadIntervalTimeout = t->saved.ReadIntervalTimeout;
+      ctout.ReadTotalTimeoutMultiplier = t->saved.ReadTotalTimeoutMultiplier;
+      ctout.ReadTotalTimeoutConstant = t->saved.ReadTotalTimeoutConstant;
+      SetCommTimeouts(t->fh, &ctout);
+   }
+
+   CloseHandle(t->thread);
+   CloseHandle(t->data);
+   CloseHandle(t->stop);
+   CloseHandle(t->space);
+   CloseHandle(t->fh);
+   xfree(t);
+}
+
+void RB_SERIAL_EXPORT sp_rx_thread_space_impl(ring)
+   struct rx_ring *ring;
+{
+   SetEvent(((struct rx_thread *) ring->impl)->space);
+}
+
+static void *ring_wait_func(ptr)
+   void *ptr;
+{
+   struct ring_wait *w = (struct ring_wait *) ptr;
+   struct rx_ring *ring = w->ring;
+   HANDLE events[2];
+
+   events[0] = ((struct rx_thread *) ring->impl)->data;
+   events[1] = w->cancel;
+
+   ring->waiting = 1;
+   SP_MEMORY_BARRIER();
+   if (ring->head == ring->tail && !ring->eof && !ring->error)
+   {
+      if (WaitForMultipleObjects(2, events, FALSE, w->timeout) == WAIT_OBJECT_0 + 1)
+      {
+         w->interrupted = 1;
+      }
+   }
+   ring->waiting = 0;
+
+   return NULL;
+}
+
+static void ring_wait_ubf(ptr)
+   void *ptr;
+{
+   SetEvent(((struct ring_wait *) ptr)->cancel);
+}
+
+int RB_SERIAL_EXPORT sp_ring_wait_impl(ring, timeout)
+   struct rx_ring *ring;
+   int timeout;
+{
+   struct ring_wait w;
+   DWORD start = GetTickCount(), elapsed;
+   int remaining = timeout;
+
+   w.ring = ring;
+   for (;;)
+   {
+      if (ring->head != ring->tail || ring->eof)
+      {
+         return 1;
+      }
+      if (ring->error)
+      {
+         SetLastError(ring->error);
+         _rb_win32_fail("ReadFile");
+      }
+      if (remaining == 0)
+      {
+         return 0;
+      }
+
+      w.cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (w.cancel == NULL)
+      {
+         _rb_win32_fail("CreateEvent");
+      }
+      w.timeout = (remaining < 0 ? INFINITE : (DWORD) remaining);
+      w.interrupted = 0;
+
+      sp_blocking_call_ubf(ring_wait_func, &w, ring_wait_ubf, &w);
+      CloseHandle(w.cancel);
+
+      if (timeout > 0)
+      {
+         elapsed = GetTickCount() - start;
+         remaining = (elapsed >= (DWORD) timeout ? 0 : timeout - elapsed);
+      }
+#ifdef RUBY_1_9
+      if (w.interrupted)
+      {
+         rb_thread_check_ints();
+      }
+#endif
+   }
+}
+
+#define SIGNAL_POLL_MS  10
+
+struct signal_wait
+{
+   HANDLE fh;
+   HANDLE cancel;       /* signalled when the calling thread is interrupted */
+   OVERLAPPED *ov;      /* pending WaitCommEvent, NULL to poll instead */
+   DWORD timeout;
+   DWORD start_status;
+   int mask;
+   int changed;
+   DWORD error;
+};
+
+static int events_to_lines(evmask)
+   DWORD evmask;
+{
+   return (evmask & EV_CTS ? LINE_CTS : 0) |
+          (evmask & EV_DSR ? LINE_DSR : 0) |
+          (evmask & EV_RLSD ? LINE_DCD : 0) |
+          (evmask & EV_RING ? LINE_RI : 0);
+}
+
+/*
+ * :nodoc: Wait for the pending WaitCommEvent or, on ports opened without
+ * :overlapped, poll the modem status, with the GVL released.
+ */
+static void *signal_wait_func(ptr)
+   void *ptr;
+{
+   struct signal_wait *w = (struct signal_wait *) ptr;
+   DWORD start = GetTickCount(), elapsed, slice, status;
+   HANDLE events[2];
+
+   if (w->ov != NULL)
+   {
+      events[0] = w->ov->hEvent;
+      events[1] = w->cancel;
+      WaitForMultipleObjects(2, events, FALSE, w->timeout);
+      return NULL;
+   }
+
+   for (;;)
+   {
+      if (GetCommModemStatus(w->fh, &status) == 0)
+      {
+         w->error = GetLastError();
+         return NULL;
+      }
+
+      w->changed = status_to_lines(status ^ w->start_status) & w->mask;
+      if (w->changed)
+      {
+         return NULL;
+      }
+
+      slice = SIGNAL_POLL_MS;
+      if (w->timeout != INFINITE)
+      {
+         elapsed = GetTickCount() - start;
+         if (elapsed >= w->timeout)
+         {
+            return NULL;
+         }
+         if (w->timeout - elapsed < slice)
+         {
+            slice = w->timeout - elapsed;
+         }
+      }
+
+      if (WaitForSingleObject(w->cancel, slice) == WAIT_OBJECT_0)
+      {
+         return NULL;
+      }
+   }
+}
+
+static void signal_wait_cancel(ptr)
+   void *ptr;
+{
+   SetEvent((HANDLE) ptr);
+}
+
+int RB_SERIAL_EXPORT sp_wait_signal_change_impl(self, mask, timeout)
+   VALUE self;
+   int mask, timeout;
+{
+   struct signal_wait w;
+   OVERLAPPED ov;
+   DWORD saved = 0, events, evmask = 0, dummy, start, elapsed;
+   int pending;
+
+   w.fh = get_handle_helper(self);
+   w.mask = mask;
+   start = GetTickCount();
+
+   events = (mask & LINE_CTS ? EV_CTS : 0) |
+            (mask & LINE_DSR ? EV_DSR : 0) |
+            (mask & LINE_DCD ? EV_RLSD : 0) |
+            (mask & LINE_RI ? EV_RING : 0);
+
+   for (;;)
+   {
+      w.changed = 0;
+      w.error = 0;
+      w.ov = NULL;
+      pending = 0;
+
+      if (GetCommModemStatus(w.fh, &w.start_status) == 0)
+      {
+         _rb_win32_fail("GetCommModemStatus");
+      }
+
+      w.timeout = INFINITE;
+      if (timeout >= 0)
+      {
+         elapsed = GetTickCount() - start;
+         w.timeout = (elapsed >= (DWORD) timeout ? 0 : timeout - elapsed);
+      }
+
+      w.cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (w.cancel == NULL)
+      {
+         _rb_win32_fail("CreateEvent");
+      }
+
+      if (get_port_data(self)->overlapped)
+      {
+         ZeroMemory(&ov, sizeof(ov));
+         ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+         if (ov.hEvent == NULL || GetCommMask(w.fh, &saved) == 0 ||
+             SetCommMask(w.fh, events) == 0)
+         {
+            w.error = GetLastError();
+            if (ov.hEvent != NULL)
+            {
+               CloseHandle(ov.hEvent);
+            }
+            CloseHandle(w.cancel);
+            SetLastError(w.error);
+            _rb_win32_fail("SetCommMask");
+         }
+
+         if (WaitCommEvent(w.fh, &evmask, &ov))
+         {
+            w.changed = events_to_lines(evmask) & mask;
+         }
+         else if (GetLastError() == ERROR_IO_PENDING)
+         {
+            pending = 1;
+            w.ov = &ov;
+         }
+         else
+         {
+            w.error = GetLastError();
+         }
+      }
+
+      if (w.ov != NULL || (!w.changed && !w.error && !get_port_data(self)->overlapped))
+      {
+         sp_blocking_call_ubf(signal_wait_func, &w, signal_wait_cancel, w.cancel);
+      }
+
+      if (get_port_data(self)->overlapped)
+      {
+         /* restoring the mask completes the WaitCommEvent if still pending */
+         SetCommMask(w.fh, saved);
+         if (pending && GetOverlappedResult(w.fh, &ov, &dummy, TRUE))
+         {
+            w.changed = events_to_lines(evmask) & mask;
+         }
+         CloseHandle(ov.hEvent);
+      }
+      CloseHandle(w.cancel);
+
+      if (w.error != 0)
+      {
+         SetLastError(w.error);
+         _rb_win32_fail(w.ov != NULL ? "WaitCommEvent" : "GetCommModemStatus");
+      }
+
+      if (w.changed || timeout == 0 ||
+          (timeout > 0 && GetTickCount() - start >= (DWORD) timeout))
+      {
+         return w.changed;
+      }
+
+      /* interrupted, or woken by an event outside mask */
+#ifdef RUBY_1_9
+      rb_thread_check_ints();
+#endif
+   }
+}
+
+VALUE RB_SERIAL_EXPORT sp_get_line_counters_impl(self)
+   VALUE self;
+{
+   rb_notimplement();
+   return self;
+}
+
+/*
+ * Port enumeration for SerialPort.list, from SetupAPI where available and
+ * the SERIALCOMM registry key otherwise. No port is opened, so slow
+ * Bluetooth ports don't hold it up.
+ */
+static VALUE new_port_entry(name)
+   const char *name;
+{
+   VALUE hash = rb_hash_new();
+
+   rb_hash_aset(hash, rb_str_new2("path"), rb_str_new2(name));
+   rb_hash_aset(hash, rb_str_new2("description"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("manufacturer"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("serial_number"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("vid"), Qnil);
+   rb_hash_aset(hash, rb_str_new2("pid"), Qnil);
+
+   return hash;
+}
+
+#if defined(HAVE_SETUPAPI_H)
+
+/* GUID_DEVCLASS_PORTS, serial and parallel ports */
+static const GUID ports_class =
+   { 0x4d36e978, 0xe325, 0x11ce, { 0xbf, 0xc1, 0x08, 0x00, 0x2b, 0xe1, 0x03, 0x18 } };
+
+static VALUE device_property(set, info, prop)
+   HDEVINFO set;
+   SP_DEVINFO_DATA *info;
+   DWORD prop;
+{
+   char buf[256];
+
+   if (!SetupDiGetDeviceRegistryPropertyA(set, info, prop, NULL, (BYTE *) buf,
+                                          sizeof(buf) - 1, NULL))
+   {
+      return Qnil;
+   }
+   buf[sizeof(buf) - 1] = '\0';
+
+   return rb_str_new2(buf);
+}
+
+/*
+ * :nodoc: VID, PID and serial number from a USB device instance id such
+ * as USB\VID_0403&PID_6001\A600XYZ, or FTDIBUS\VID_0403+PID_6001+A600XYZA\0000
+ * for FTDI's own driver.
+ */
+static void usb_ids(hash, id)
+   VALUE hash;
+   char *id;
+{
+   char *vid = strstr(id, "VID_"), *pid = strstr(id, "PID_"), *serial, *end;
+
+   if (vid == NULL || pid == NULL)
+   {
+      return;
+   }
+   rb_hash_aset(hash, rb_str_new2("vid"), INT2FIX(strtol(vid + 4, NULL, 16)));
+   rb_hash_aset(hash, rb_str_new2("pid"), INT2FIX(strtol(pid + 4, NULL, 16)));
+
+   end = pid + strcspn(pid, "\\+");
+   if (*end == '\0')
+   {
+      return;
+   }
+   serial = end + 1;
+   end = serial + strcspn(serial, "\\+");
+
+   /* Windows makes up instance ids containing & for devices without one */
+   if (end > serial && memchr(serial, '&', end - serial) == NULL)
+   {
+      if (pid[-1] == '+' && end[-1] == 'A')
+      {
+         /* FTDI appends the port letter */
+         end--;
+      }
+      rb_hash_aset(hash, rb_str_new2("serial_number"), rb_str_new(serial, end - serial));
+   }
+}
+
+VALUE RB_SERIAL_EXPORT sp_list_impl(void)
+{
+   VALUE ports = rb_ary_new(), hash;
+   HDEVINFO set;
+   SP_DEVINFO_DATA info;
+   DWORD i, type, size;
+   HKEY key;
+   char name[64], id[512];
+   LONG rc;
+
+   set = SetupDiGetClassDevsA(&ports_class, NULL, NULL, DIGCF_PRESENT);
+   if (set == INVALID_HANDLE_VALUE)
+   {
+      _rb_win32_fail("SetupDiGetClassDevs");
+   }
+
+   info.cbSize = sizeof(info);
+   for (i = 0; SetupDiEnumDeviceInfo(set, i, &info); i++)
+   {
+      key = SetupDiOpenDevRegKey(set, &info, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_READ);
+      if (key == INVALID_HANDLE_VALUE)
+      {
+         continue;
+      }
+      size = sizeof(name) - 1;
+      rc = RegQueryValueExA(key, "PortName", NULL, &type, (BYTE *) name, &size);
+      RegCloseKey(key);
+
+      /* parallel ports share the class */
+      if (rc != ERROR_SUCCESS || type != REG_SZ || strncmp(name, "COM", 3) != 0)
+      {
+         continue;
+      }
+      name[size] = '\0';
+
+      hash = new_port_entry(name);
+      rb_hash_aset(hash, rb_str_new2("description"),
+                   device_property(set, &info, SPDRP_FRIENDLYNAME));
+      rb_hash_aset(hash, rb_str_new2("manufacturer"),
+                   device_property(set, &info, SPDRP_MFG));
+      if (SetupDiGetDeviceInstanceIdA(set, &info, id, sizeof(id), NULL))
+      {
+         usb_ids(hash, id);
+      }
+      rb_ary_push(ports, hash);
+   }
+
+   SetupDiDestroyDeviceInfoList(set);
+   return ports;
+}
+
+#else
+
+VALUE RB_SERIAL_EXPORT sp_list_impl(void)
+{
+   VALUE ports = rb_ary_new();
+   HKEY key;
+   DWORD i, type, name_len, data_len;
+   char name[256], data[64];
+
+   if (RegOpenKeyExA(HKEY_LOCAL_MACHINE, "HARDWARE\\DEVICEMAP\\SERIALCOMM", 0,
+                     KEY_READ, &key) != ERROR_SUCCESS)
+   {
+      return ports;
+   }
+
+   for (i = 0; ; i++)
+   {
+      name_len = sizeof(name);
+      data_len = sizeof(data) - 1;
+      if (RegEnumValueA(key, i, name, &name_len, NULL, &type, (BYTE *) data,
+                        &data_len) != ERROR_SUCCESS)
+      {
+         break;
+      }
+      if (type == REG_SZ)
+      {
+         data[data_len] = '\0';
+         rb_ary_push(ports, new_port_entry(data));
+      }
+   }
+   RegCloseKey(key);
+
+   return ports;
+}
+
+#endif
+
+/*
+ * Shared memory is a named file mapping backed by the paging file, e.g.
+ * "Local\\gps". It exists while the owner or any reader has it open, so
+ * a new owner can only take the name once every reader has let go.
+ */
+char * RB_SERIAL_EXPORT sp_shm_create_impl(name, size, impl)
+   const char *name;
+   unsigned long size;
+   void **impl;
+{
+   HANDLE mapping;
+   char *addr;
+
+   mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+                                0, size, name);
+   if (mapping == NULL)
+   {
+      _rb_win32_fail("CreateFileMapping");
+   }
+   if (GetLastError() == ERROR_ALREADY_EXISTS)
+   {
+      CloseHandle(mapping);
+      rb_raise(rb_eIOError, "shared memory %s is still in use", name);
+   }
+
+   addr = (char *) MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+   if (addr == NULL)
+   {
+      DWORD err = GetLastError();
+
+      CloseHandle(mapping);
+      SetLastError(err);
+      _rb_win32_fail("MapViewOfFile");
+   }
+
+   *impl = mapping;
+   return addr;
+}
+
+char * RB_SERIAL_EXPORT sp_shm_open_impl(name, size, impl)
+   const char *name;
+   unsigned long *size;
+   void **impl;
+{
+   HANDLE mapping;
+   MEMORY_BASIC_INFORMATION info;
+   char *addr;
+
+   mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+   if (mapping == NULL)
+   {
+      _rb_win32_fail("OpenFileMapping");
+   }
+
+   addr = (char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   if (addr == NULL)
+   {
+      DWORD err = GetLastError();
+
+      CloseHandle(mapping);
+      SetLastError(err);
+      _rb_win32_fail("MapViewOfFile");
+   }
+
+   /* the view covers the whole mapping, rounded up to pages */
+   VirtualQuery(addr, &info, sizeof(info));
+   *size = (unsigned long) info.RegionSize;
+   *impl = mapping;
+   return addr;
+}
+
+void RB_SERIAL_EXPORT sp_shm_close_impl(name, addr, size, impl, owner)
+   const char *name;
+   char *addr;
+   unsigned long size;
+   void *impl;
+   int owner;
+{
+   /* the mapping goes away with its last handle */
+   (void) name;
+   (void) size;
+   (void) owner;
+   UnmapViewOfFile(addr);
+   CloseHandle((HANDLE) impl);
+}
+
 #endif /* defined(OS_MSWIN) || defined(OS_BCCWIN) || defined(OS_MINGW) */
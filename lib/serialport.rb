@@ -1,7 +1,7 @@
 require 'serialport.so'
 
 class SerialPort
-   private_class_method(:create)
+   private_class_method(:create, :list_ports)
 
    # Creates a serial port object.
    #
@@ -12,28 +12,161 @@ class SerialPort
    #
    # <tt>params</tt> can be used to configure the serial port.
    # See SerialPort#set_modem_params for details
+   #
+   # Symbol keys of a trailing hash are options for opening the port
+   # rather than modem parameters:
+   # [:overlapped] On Windows, open the port for overlapped I/O, so
+   #               that a read and a write in different threads proceed
+   #               at the same time. Ignored elsewhere.
+   # [:rx_buffer, :tx_buffer] Sizes in bytes of the driver's receive and
+   #                          transmit queues, 1024 by default on Windows.
+   #                          On Linux :tx_buffer sets the UART transmit
+   #                          FIFO size (TIOCSSERIAL, which usually needs
+   #                          root) and :rx_buffer is ignored, the tty
+   #                          layer grows its receive buffer as needed.
+   # [:rx_thread] true, or a ring size in bytes (1 MiB by default): start
+   #              a native thread that drains the port into a ring as
+   #              soon as data arrives, so neither slow Ruby scheduling
+   #              nor GC pauses overrun the driver. The native readers
+   #              (SerialPort#sysread_timeout, #read_timed, #read_into,
+   #              #each_frame) then consume from the ring; IO#read and
+   #              friends must not be used on the port.
+   # [:nonblock] On POSIX systems, leave the port in non-blocking mode.
+   #             The native readers and writers then wait for it with
+   #             rb_io_wait and keep their timeouts themselves, so a
+   #             fiber scheduler (Fiber.set_scheduler) runs other fibers
+   #             meanwhile, and IO#read, #wait_readable and friends wait
+   #             the way they do on sockets; read_timeout only shapes
+   #             what a single read returns. Can't be combined with
+   #             :rx_thread. Ignored on Windows.
+   #
+   #    sp = SerialPort.new("COM3", "baud" => 115200, :overlapped => true)
    def SerialPort::new(port, *params)
-      sp = create(port)
-      begin
-         sp.set_modem_params(*params)
-      rescue
-         sp.close
-         raise
+      params, options = split_open_options(params)
+      # applied by the same tcsetattr or SetCommState as the raw mode
+      return create(port, options, params)
+   end
+
+   # Options understood by SerialPort#new and SerialPort#open
+   OPEN_OPTIONS = [:overlapped, :rx_buffer, :tx_buffer, :rx_thread, :nonblock]
+
+   # Separate the open options from the modem parameters
+   def SerialPort::split_open_options(params) # :nodoc:
+      return [params, {}] unless params.last.kind_of?(Hash)
+      modem, options = {}, {}
+      params.last.each do |key, value|
+         if key.kind_of?(Symbol)
+            unless OPEN_OPTIONS.include?(key)
+               raise ArgumentError, "unknown option: #{key.inspect}"
+            end
+            options[key] = value
+         else
+            modem[key] = value
+         end
       end
-      return sp
+      params = params[0...-1]
+      params << modem unless modem.empty?
+      return [params, options]
+   end
+   private_class_method(:split_open_options)
+
+   # The serial ports of the system, found without opening any of them:
+   # through sysfs on Linux, IOKit on Mac OS X and SetupAPI on Windows
+   # (elsewhere only the device names in /dev are known). Each port is a
+   # hash with the keys "path" (to pass to SerialPort::new),
+   # "description", "manufacturer", "serial_number", "vid" and "pid"; all
+   # but the path are nil unless the port is on USB.
+   #
+   #    ftdi = SerialPort.list.find { |port| port["vid"] == 0x0403 }
+   #    sp = SerialPort.new(ftdi["path"], 115200) if ftdi
+   def SerialPort::list
+      return list_ports.sort_by { |port| port["path"] }
+   end
+
+   # Where Linux exposes the latency timer of a USB serial adapter
+   LATENCY_TIMER_PATH = "/sys/bus/usb-serial/devices/%s/latency_timer"
+
+   # The sysfs latency_timer file of device, following symlinks such
+   # as /dev/serial/by-id/...
+   def SerialPort::latency_timer_file(device) # :nodoc:
+      while File.symlink?(device)
+         device = File.expand_path(File.readlink(device), File.dirname(device))
+      end
+      path = LATENCY_TIMER_PATH % File.basename(device)
+      unless File.exist?(path)
+         raise ArgumentError, "#{device} has no latency timer"
+      end
+      return path
+   end
+   private_class_method(:latency_timer_file)
+
+   # Get the latency timer, in milliseconds, of a USB serial adapter such
+   # as an FTDI ttyUSB device. Linux only.
+   def SerialPort::latency_timer(device)
+      return File.read(latency_timer_file(device)).to_i
+   end
+
+   # Set the latency timer of a USB serial adapter. FTDI chips hold
+   # received bytes for up to this many milliseconds (16 by default)
+   # before sending them to the host; 1 makes short request/response
+   # exchanges much faster. Linux only, and writing the sysfs file
+   # usually requires root or a udev rule.
+   #
+   #    SerialPort.set_latency_timer("/dev/ttyUSB0", 1)
+   def SerialPort::set_latency_timer(device, ms)
+      ms = Integer(ms)
+      raise ArgumentError, "invalid latency timer" unless (1..255).include?(ms)
+      File.open(latency_timer_file(device), "w") { |f| f.write(ms.to_s) }
+      return ms
+   end
+
+   # Settings collected by SerialPort#configure. Attributes left at nil
+   # keep their current value.
+   class Configuration
+      attr_accessor :baud, :data_bits, :stop_bits, :parity
+      attr_accessor :flow_control, :read_timeout, :write_timeout
+
+      # The settings as a hash accepted by SerialPort#set_modem_params
+      def to_hash
+         hash = {}
+         hash["baud"] = @baud unless @baud.nil?
+         hash["data_bits"] = @data_bits unless @data_bits.nil?
+         hash["stop_bits"] = @stop_bits unless @stop_bits.nil?
+         hash["parity"] = @parity unless @parity.nil?
+         hash["flow_control"] = @flow_control unless @flow_control.nil?
+         hash["read_timeout"] = @read_timeout unless @read_timeout.nil?
+         hash["write_timeout"] = @write_timeout unless @write_timeout.nil?
+         return hash
+      end
+   end
+
+   # Change several settings at once. The block receives a
+   # SerialPort::Configuration; everything assigned to it is applied to
+   # the port in a single update when the block returns, instead of one
+   # tcsetattr (or SetCommState) per setter:
+   #
+   #    sp.configure do |c|
+   #       c.baud = 115200
+   #       c.parity = SerialPort::NONE
+   #       c.flow_control = SerialPort::HARD
+   #       c.read_timeout = 100
+   #    end
+   #
+   # Nothing is changed if the block raises.
+   def configure
+      config = Configuration.new
+      yield config
+      set_modem_params(config.to_hash)
+      return self
    end
 
    # This behaves like SerialPort#new, except that you can pass a block
    # to which the new serial port object will be passed. In this case
    # the connection is automaticaly closed when the block has finished.
    def SerialPort::open(port, *params)
-      sp = create(port)
-      begin
-         sp.set_modem_params(*params)
-      rescue
-         sp.close
-         raise
-      end
+      params, options = split_open_options(params)
+      # applied by the same tcsetattr or SetCommState as the raw mode
+      sp = create(port, options, params)
       if (block_given?)
         begin
            yield sp
@@ -44,4 +177,105 @@ class SerialPort
       end
       return sp
    end
+
+   # Reading and replaying the capture files written by
+   # SerialPort#start_capture.
+   module Capture
+      # First bytes of a capture file
+      MAGIC = "SPCAP001"
+
+      # Record kinds: data received, data sent, start of a capture run
+      RX, TX, START = 0, 1, 2
+
+      # Yields the kind, the time in nanoseconds and the data of each
+      # record in the capture file at path. The data of a START record is
+      # the wall clock time the run began, as a Time.
+      #
+      #    SerialPort::Capture.each_record("field.spcap") do |kind, ns, data|
+      #       puts "#{ns} #{kind == SerialPort::Capture::RX ? '<' : '>'} #{data.inspect}"
+      #    end
+      def Capture::each_record(path)
+         File.open(path, "rb") do |f|
+            unless f.read(MAGIC.size) == MAGIC
+               raise ArgumentError, "#{path} is not a capture file"
+            end
+            while header = f.read(16)
+               break if header.size < 16
+               lo, hi, len, kind = header.unpack("VVVC")
+               data = f.read(len)
+               break if data.nil? || data.size < len   # cut short by a crash
+               if kind == START
+                  s_lo, s_hi = data.unpack("VV")
+                  data = Time.at(s_hi << 32 | s_lo)
+               end
+               yield kind, hi << 32 | lo, data
+            end
+         end
+         return nil
+      end
+
+      # Write the data the port received (or with :direction => TX, sent)
+      # in a capture file to io, keeping the original gaps. Options:
+      # [:speed] Timing factor, 2.0 replays twice as fast. nil or 0
+      #          writes everything as fast as io accepts it. Default 1.0.
+      # [:direction] RX (the default) or TX.
+      # The gaps between capture runs appended to one file are skipped.
+      # Returns the number of bytes written.
+      def Capture::replay(path, io, options = {})
+         speed = options.fetch(:speed, 1.0)
+         direction = options.fetch(:direction, RX)
+         base = nil
+         bytes = 0
+         each_record(path) do |kind, ns, data|
+            if kind == START
+               base = nil
+               next
+            end
+            next unless kind == direction
+            if speed && speed > 0
+               if base.nil?
+                  base = [now, ns]
+               else
+                  delay = base[0] + (ns - base[1]) / 1e9 / speed - now
+                  sleep(delay) if delay > 0
+               end
+            end
+            io.write(data)
+            bytes += data.size
+         end
+         return bytes
+      end
+
+      # Replay a capture through a new pseudo terminal, for load tests of
+      # programs that talk to a serial port. The block gets the device
+      # path of the terminal to open while the received data of the
+      # capture plays on it; the replay stops when the block returns.
+      # Returns the value of the block. POSIX only.
+      #
+      #    SerialPort::Capture.replay_pty("field.spcap", :speed => 10) do |device|
+      #       run_parser(SerialPort.new(device, 115200))
+      #    end
+      def Capture::replay_pty(path, options = {})
+         require 'pty'
+         master, slave = PTY.open
+         begin
+            master.binmode
+            player = Thread.new { replay(path, master, options) }
+            return yield(slave.path)
+         ensure
+            player.kill if player
+            master.close
+            slave.close
+         end
+      end
+
+      def Capture::now # :nodoc:
+         if defined?(Process::CLOCK_MONOTONIC)
+            Process.clock_gettime(Process::CLOCK_MONOTONIC)
+         else
+            Time.now.to_f
+         end
+      end
+      private_class_method(:now)
+   end
 end
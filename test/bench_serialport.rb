@@ -0,0 +1,189 @@
+require 'rubygems'
+require 'serialport'
+require 'pty'
+
+# Throughput and latency of the SerialPort read modes.
+#
+#    rake bench
+#    ruby test/bench_serialport.rb [pty|socat|loopback]
+#
+# pty:      an openpty pair, the benchmark holds the master (default)
+# socat:    two linked socat virtual ports, both opened as SerialPort
+# loopback: BENCH_DEVICE, a real port with TX wired to RX
+#
+# BENCH_BYTES (bytes per throughput run), BENCH_ROUNDS (round trips),
+# BENCH_BAUD and BENCH_DEVICE tune the runs.
+#
+# Reported per mode: bytes/s, reads returning data per KB received,
+# p50/p99 round trip in milliseconds and objects allocated per MB. The
+# allocations include the feeding thread's, about one per 4 KB write.
+
+BENCH_BAUD = (ENV['BENCH_BAUD'] || 115200).to_i
+BENCH_ROUNDS = (ENV['BENCH_ROUNDS'] || 500).to_i
+CHUNK = 4096
+MESSAGE = "0123456789abcdef"
+READ_OPTIONS = { :timeout => 100 }
+
+def now
+   if defined?(Process::CLOCK_MONOTONIC)
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+   else
+      Time.now.to_f
+   end
+end
+
+def allocated
+   GC.stat[:total_allocated_objects] if GC.respond_to?(:stat)
+end
+
+# Each mode reads whatever is available, returning a String or nil
+MODES = [
+   ["readpartial", {}, lambda { |sp, buf| sp.readpartial(CHUNK) }],
+   ["sysread_timeout", {}, lambda { |sp, buf| sp.sysread_timeout(CHUNK, 100) }],
+   ["read_timed", {}, lambda { |sp, buf| sp.read_timed(CHUNK, 100, 2) }],
+   ["read_into", {}, lambda { |sp, buf| sp.read_into(buf, CHUNK, READ_OPTIONS) && buf }],
+   ["rx_thread sysread_timeout", { :rx_thread => true },
+    lambda { |sp, buf| sp.sysread_timeout(CHUNK, 100) }],
+   ["rx_thread read_into", { :rx_thread => true },
+    lambda { |sp, buf| sp.read_into(buf, CHUNK, READ_OPTIONS) && buf }],
+]
+
+# A port under test and the peer that feeds and echoes it
+class Wiring
+   attr_reader :name, :bytes
+
+   def self.pty
+      master, slave = PTY.open
+      w = new("pty", slave.path, master, 8 << 20)
+      w.instance_variable_set(:@keep, slave)
+      w
+   end
+
+   def self.socat
+      dir = "/tmp/bench_serialport.#{$$}"
+      pid = spawn("socat", "pty,raw,echo=0,link=#{dir}.a", "pty,raw,echo=0,link=#{dir}.b",
+                  :err => File::NULL)
+      50.times { break if File.exist?("#{dir}.b"); sleep 0.05 }
+      peer = SerialPort.new("#{dir}.a", BENCH_BAUD)
+      w = new("socat", "#{dir}.b", peer, 4 << 20)
+      w.instance_variable_set(:@pid, pid)
+      w
+   end
+
+   def self.loopback
+      device = ENV['BENCH_DEVICE'] or abort("set BENCH_DEVICE to a port with TX wired to RX")
+      # about two seconds of data at the line rate
+      new("loopback", device, nil, (ENV['BENCH_BYTES'] || BENCH_BAUD / 5).to_i)
+   end
+
+   def initialize(name, path, peer, bytes)
+      @name, @path, @peer = name, path, peer
+      @bytes = (ENV['BENCH_BYTES'] || bytes).to_i
+   end
+
+   def open(options)
+      @sp = SerialPort.new(@path, BENCH_BAUD, options)
+      @sp.binmode
+      @sp
+   end
+
+   def close
+      @sp.close
+   end
+
+   # Writes go through the peer, or the port itself on a loopback
+   def writer
+      @peer || @sp
+   end
+
+   def finish
+      @peer.close if @peer
+      if @pid
+         Process.kill("TERM", @pid)
+         Process.wait(@pid)
+      end
+   end
+end
+
+def throughput(wiring, sp, reader)
+   data = "\x55" * CHUNK
+   buf = ""
+   total = wiring.bytes
+   reads = 0
+   got = 0
+
+   GC.start
+   objects = allocated
+   start = now
+   writer = Thread.new do
+      left = total
+      while left > 0
+         left -= wiring.writer.syswrite(left < CHUNK ? data[0, left] : data)
+      end
+   end
+   while got < total
+      s = reader.call(sp, buf)
+      next unless s
+      reads += 1
+      got += s.size
+   end
+   elapsed = now - start
+   objects = allocated - objects if objects
+   writer.join
+
+   [got / elapsed, reads / (got / 1024.0),
+    objects && objects / (got / 1048576.0)]
+end
+
+def round_trips(wiring, sp, reader)
+   buf = ""
+   times = []
+   BENCH_ROUNDS.times do
+      start = now
+      wiring.writer.write(MESSAGE)
+      got = 0
+      while got < MESSAGE.size
+         s = reader.call(sp, buf)
+         got += s.size if s
+      end
+      if wiring.writer != sp
+         # echo it back to the peer
+         sp.write(MESSAGE)
+         got = 0
+         got += wiring.writer.readpartial(MESSAGE.size - got).size while got < MESSAGE.size
+      end
+      times << (now - start) * 1000
+   end
+   times.sort!
+   [times[(times.size - 1) / 2], times[((times.size - 1) * 0.99).round]]
+end
+
+kind = ARGV[0] || 'pty'
+unless %w(pty socat loopback).include?(kind)
+   abort("Usage: ruby #{$0} [pty|socat|loopback]")
+end
+wiring = Wiring.send(kind)
+
+printf("%s, %d baud, %d bytes, %d round trips of %d bytes\n",
+       wiring.name, BENCH_BAUD, wiring.bytes, BENCH_ROUNDS, MESSAGE.size)
+printf("%-26s %12s %10s %9s %9s %11s\n",
+       "mode", "bytes/s", "reads/KB", "p50 ms", "p99 ms", "objects/MB")
+begin
+   MODES.each do |name, options, reader|
+      begin
+         sp = wiring.open(options)
+      rescue ArgumentError, NotImplementedError
+         next
+      end
+      begin
+         rate, wakeups, objects = throughput(wiring, sp, reader)
+         p50, p99 = round_trips(wiring, sp, reader)
+      ensure
+         wiring.close
+      end
+      printf("%-26s %12.0f %10.2f %9.3f %9.3f %11s\n", name, rate, wakeups,
+             p50, p99, objects ? objects.round.to_s : "-")
+   end
+ensure
+   wiring.finish
+end
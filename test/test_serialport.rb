@@ -1,36 +1,20 @@
 require 'rubygems'
 require 'serialport'
 require 'test/unit'
+require 'tmpdir'
+require 'stringio'
+require 'fcntl'
 
 
 class TestSerialPort < Test::Unit::TestCase #:nodoc:
 
   def setup
     return unless @device.nil?
-    if File::directory?("/dev")
-      # POSIX
-      # Currently only searches for USB<->Serial cables
-      Dir.foreach("/dev") do |device|
-        if device.index("ttyUSB")
-          @device = "/dev/" + device
-          break
-        elsif device.index("cu.usbserial")
-          @device = "/dev/" + device
-          break
-        end
-      end
-    else
-      # Windows
-      (1..9).each do |port|
-        begin
-          sp = SerialPort.new("COM#{port}")
-          sp.close
-          @device = "COM#{port}"
-        rescue Errno::ENOENT
-          # Not a valid serial port
-        end
-      end
-    end
+    # Prefer USB adapters, the only ports likely to be wired for testing
+    ports = SerialPort.list
+    port = ports.find { |p| p["vid"] }
+    port ||= ports.first unless File::directory?("/dev")
+    @device = port["path"] if port
 
     if @device.nil?
       abort "Could not find serial port"
@@ -64,6 +48,13 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert(@params.has_key?('read_timeout'))
   end
 
+  def test_new_with_invalid_params
+    assert_raise(ArgumentError) { SerialPort.new(@device, "data_bits" => 9) }
+    assert_raise(ArgumentError) { SerialPort.new(@device, 9600, 8, 3) }
+    @sp = SerialPort.new(@device, "read_timeout" => 200)
+    assert_equal(200, @sp.read_timeout)
+  end
+
   def test_new_with_hash_params
     params = {
       "baud"         => 19200,
@@ -121,6 +112,18 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert_equal(params['read_timeout'], actual['read_timeout'])
   end
 
+  def test_exact_baud
+    return unless /linux/ =~ RUBY_PLATFORM
+    @sp = SerialPort.new(@device, 250000)
+    assert_equal(250000, @sp.baud)
+    @sp.data_bits = 7
+    @sp.refresh!
+    assert_equal(250000, @sp.baud)
+    @sp.baud = 9600
+    @sp.refresh!
+    assert_equal(9600, @sp.baud)
+  end
+
   def test_invalid_baud
     @sp = SerialPort.new(@device)
     initial_baud = @sp.baud
@@ -176,6 +179,46 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert_equal(params['read_timeout'], @actual['read_timeout'])
   end
 
+  def test_configure
+    @sp = SerialPort.new(@device)
+    assert_nothing_raised(Exception) {
+      @sp.configure do |c|
+        c.baud = 19200
+        c.data_bits = 7
+        c.stop_bits = 2
+        c.parity = SerialPort::EVEN
+        c.flow_control = SerialPort::SOFT
+        c.read_timeout = 100
+      end
+    }
+    assert_equal(19200, @sp.baud)
+    assert_equal(7, @sp.data_bits)
+    assert_equal(2, @sp.stop_bits)
+    assert_equal(SerialPort::EVEN, @sp.parity)
+    assert_equal(SerialPort::SOFT, @sp.flow_control)
+    assert_equal(100, @sp.read_timeout)
+    assert_nothing_raised(Exception) { @sp.configure { |c| c.stop_bits = 1 } }
+    assert_equal(1, @sp.stop_bits)
+    assert_equal(7, @sp.data_bits)
+    assert_raise(ArgumentError) { @sp.configure { |c| c.data_bits = 9 } }
+    assert_equal(7, @sp.data_bits)
+  end
+
+  def test_refresh
+    @sp = SerialPort.new(@device, {"baud" => 19200, "read_timeout" => 100})
+    params = @sp.modem_params
+    assert_same(@sp, @sp.refresh!)
+    assert_equal(params, @sp.modem_params)
+    other = SerialPort.new(@device)
+    begin
+      other.baud = 38400
+      assert_equal(19200, @sp.baud)
+      assert_equal(38400, @sp.refresh!.baud)
+    ensure
+      other.close
+    end
+  end
+
   def test_parity
     @sp = SerialPort.new(@device)
     assert_nothing_raised(Exception) { @sp.parity = SerialPort::NONE }
@@ -204,6 +247,35 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert_raise(TypeError) { @sp.read_timeout = 'not a number' }
   end
 
+  def test_read_min_bytes
+    @sp = SerialPort.new(@device, {"read_timeout" => 100})
+    assert_equal(0, @sp.read_min_bytes)
+    assert_nothing_raised(Exception) { @sp.read_min_bytes = 64 }
+    assert_equal(64, @sp.read_min_bytes)
+    assert_equal(100, @sp.read_timeout)
+    assert_nothing_raised(Exception) { @sp.read_timeout = 0 }
+    assert_equal(0, @sp.read_timeout)
+    assert_equal(0, @sp.refresh!.read_timeout)
+    assert_raise(ArgumentError) { @sp.read_min_bytes = -1 }
+    assert_raise(ArgumentError) { @sp.read_min_bytes = 256 }
+    assert_raise(TypeError) { @sp.read_min_bytes = 'not a number' }
+    assert_equal(64, @sp.read_min_bytes)
+  end
+
+  def test_read_min_bytes_native_readers
+    @sp = SerialPort.new(@device, {"read_timeout" => 0})
+    @sp.read_min_bytes = 64
+    # the native readers return what arrived by their own deadline
+    start = Time.now
+    data = @sp.sysread_timeout(16, 100)
+    assert(data.nil? || data.size <= 16)
+    assert(Time.now - start < 1)
+    data = @sp.read_timed(16, 100, 10)
+    assert(data.nil? || data.size <= 16)
+    assert(Time.now - start < 2)
+    assert_equal(64, @sp.read_min_bytes)
+  end
+
   def test_stop_bits
     @sp = SerialPort.new(@device)
     assert_nothing_raised(Exception) { @sp.stop_bits = 1 }
@@ -218,6 +290,197 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert_equal(1, @sp.stop_bits)
   end
 
+  def test_sysread_timeout
+    @sp = SerialPort.new(@device)
+    assert_nothing_raised(Exception) { @data = @sp.sysread_timeout(16, 100) }
+    assert(@data.nil? || @data.length <= 16)
+    assert_equal("", @sp.sysread_timeout(0, 100))
+    assert_raise(ArgumentError) { @sp.sysread_timeout(-1, 100) }
+    assert_raise(ArgumentError) { @sp.sysread_timeout(16, -1) }
+    assert_raise(TypeError) { @sp.sysread_timeout(16, 'not a number') }
+  end
+
+  def test_syswrite_timeout
+    @sp = SerialPort.new(@device)
+    assert_equal(0, @sp.syswrite_timeout("", 100))
+    assert_nothing_raised(Exception) { @written = @sp.syswrite_timeout("AT\r", 1000) }
+    assert(@written >= 0 && @written <= 3)
+  end
+
+  def test_write_v
+    @sp = SerialPort.new(@device)
+    assert_equal(13, @sp.write_v("HDR!", "payload", "", "\x01\x02"))
+    assert_equal(0, @sp.write_v)
+  end
+
+  def test_write_partial
+    @sp = SerialPort.new(@device)
+    n = @sp.write_partial("write_partial")
+    assert(n >= 0 && n <= 13)
+    assert_kind_of(Integer, @sp.output_queue_size)
+    assert_equal(true, @sp.drain(1000))
+    assert_equal(0, @sp.output_queue_size)
+    @sp.flush_input
+    @sp.flush_output
+    assert_kind_of(Integer, @sp.input_queue_size)
+  end
+
+  def test_overlapped
+    @sp = SerialPort.new(@device, "read_timeout" => 100, :overlapped => true)
+    assert_equal(100, @sp.read_timeout)
+    assert_nothing_raised(Exception) { @written = @sp.syswrite_timeout("AT\r", 1000) }
+    assert(@written >= 0 && @written <= 3)
+    assert_nothing_raised(Exception) { @data = @sp.sysread_timeout(16, 100) }
+    assert(@data.nil? || @data.length <= 16)
+    @sp.close
+    assert_raise(ArgumentError) { SerialPort.new(@device, :no_such_option => true) }
+  end
+
+  def test_queue_sizes
+    assert_nothing_raised(Exception) { @sp = SerialPort.new(@device, :rx_buffer => 8192) }
+    @sp.close
+    assert_raise(ArgumentError) { SerialPort.new(@device, :rx_buffer => 0) }
+    assert_raise(ArgumentError) { SerialPort.new(@device, :tx_buffer => -1) }
+  end
+
+  def test_low_latency
+    @sp = SerialPort.new(@device)
+    begin
+      @saved = @sp.low_latency
+    rescue NotImplementedError
+      return
+    end
+    assert(@saved == true || @saved == false)
+    begin
+      @sp.low_latency = !@saved
+      assert_equal(!@saved, @sp.low_latency)
+      @sp.low_latency = @saved
+    rescue Errno::EPERM
+      # changing it needs root on some drivers
+    end
+    assert_equal(@saved, @sp.low_latency)
+  end
+
+  def test_latency_timer
+    return unless File.exist?("/sys/bus/usb-serial/devices/#{File.basename(@device)}/latency_timer")
+    assert_nothing_raised(Exception) { @ms = SerialPort.latency_timer(@device) }
+    assert((1..255).include?(@ms))
+    assert_raise(ArgumentError) { SerialPort.set_latency_timer(@device, 0) }
+    assert_raise(ArgumentError) { SerialPort.latency_timer("/dev/null") }
+  end
+
+  def test_rx_thread
+    @sp = SerialPort.new(@device, :rx_thread => 65536)
+    assert(@sp.rx_thread?)
+    assert_nothing_raised(Exception) { @data = @sp.sysread_timeout(16, 100) }
+    assert(@data.nil? || @data.length <= 16)
+    assert_nothing_raised(Exception) { @data = @sp.read_timed(16, 100, 10) }
+    assert(@data.nil? || @data.length <= 16)
+    assert_raise(ArgumentError) { SerialPort::Selector.new.register(@sp) }
+    @sp.close
+    @sp = SerialPort.new(@device)
+    assert(!@sp.rx_thread?)
+    assert_raise(ArgumentError) { SerialPort.new(@device, :rx_thread => 0) }
+  end
+
+  def test_selector
+    posix = (/mingw|mswin|cygwin|bccwin/ =~ RUBY_PLATFORM).nil?
+    @sp = posix ? SerialPort.new(@device) : SerialPort.new(@device, :overlapped => true)
+    sel = SerialPort::Selector.new
+    assert_equal(@sp, sel.register(@sp))
+    sel.register(@sp)
+    assert_equal(1, sel.size)
+    assert(sel.registered?(@sp))
+    assert_nothing_raised(Exception) { @ready = sel.select(100) }
+    assert_instance_of(Array, @ready)
+    @ready.each do |port, bytes|
+      assert_equal(@sp, port)
+      assert_kind_of(Integer, bytes)
+    end
+    assert_raise(ArgumentError) { sel.select(-1) }
+    assert_raise(TypeError) { sel.register("not a port") }
+    assert_equal(@sp, sel.deregister(@sp))
+    assert_nil(sel.deregister(@sp))
+    sel.close
+    assert(sel.closed?)
+    assert_raise(IOError) { sel.select(0) }
+  end
+
+  def test_read_into
+    @sp = SerialPort.new(@device)
+    buf = "keep"
+    assert_nothing_raised(Exception) { @n = @sp.read_into(buf, 16, :offset => 4, :timeout => 50) }
+    assert_equal("keep", buf[0, 4])
+    assert_equal(4 + (@n || 0), buf.length)
+    assert_equal(0, @sp.read_into(buf, 0))
+    assert_raise(ArgumentError) { @sp.read_into(buf, 16, :offset => 100) }
+    assert_raise(ArgumentError) { @sp.read_into(buf, -1) }
+    assert_raise(TypeError) { @sp.read_into(nil, 16) }
+  end
+
+  def test_read_timed
+    @sp = SerialPort.new(@device)
+    assert_nil(@sp.inter_byte_timeout)
+    assert_nothing_raised(Exception) { @sp.inter_byte_timeout = 5 }
+    assert_equal(5, @sp.inter_byte_timeout)
+    assert_nothing_raised(Exception) { @sp.inter_byte_timeout = nil }
+    assert_nil(@sp.inter_byte_timeout)
+    assert_raise(ArgumentError) { @sp.inter_byte_timeout = -1 }
+    start = Time.now
+    assert_nothing_raised(Exception) { @data = @sp.read_timed(16, 20, 5) }
+    assert(Time.now - start < 0.1)
+    assert(@data.nil? || @data.length <= 16)
+  end
+
+  def test_each_frame
+    @sp = SerialPort.new(@device)
+    assert_raise(ArgumentError) { @sp.each_frame({}) { } }
+    assert_raise(ArgumentError) { @sp.each_frame(:delimiter => "") { } }
+    assert_raise(ArgumentError) { @sp.each_frame(:length_prefix => 3) { } }
+    assert_raise(ArgumentError) { @sp.each_frame(:encoding => :base64) { } }
+    assert_raise(ArgumentError) {
+      @sp.each_frame(:delimiter => "\n", :length_prefix => 2) { }
+    }
+    [{:delimiter => "\r\n"}, {:length_prefix => 2},
+     {:encoding => :slip}, {:encoding => :cobs}].each do |opts|
+      assert_nothing_raised(Exception) {
+        assert_same(@sp, @sp.each_frame(opts.merge(:timeout => 10)) { |frame| })
+      }
+    end
+  end
+
+  def test_modbus
+    @sp = SerialPort.new(@device, 9600, 8, 1, SerialPort::EVEN)
+    t15, t35 = @sp.modbus_timing
+    assert_equal(1719, t15)
+    assert_equal(4011, t35)
+    @sp.baud = 115200
+    assert_equal([750, 1750], @sp.modbus_timing)
+    begin
+      @data = @sp.modbus_request(1, "\x03\x00\x00\x00\x01", 50)
+    rescue SerialPort::ModbusError
+      # whatever is connected may answer garbage
+    end
+    assert(@data.nil? || @data.kind_of?(String))
+    assert_nil(@sp.modbus_request(0, "\x06\x00\x01\x00\x03"))
+    assert_equal(1, SerialPort.modbus_requests([[@sp, 1, "\x07"]], 50).size)
+    assert_raise(ArgumentError) { @sp.modbus_request(248, "\x07") }
+    assert_raise(ArgumentError) { @sp.modbus_request(1, "") }
+  end
+
+  def test_checksum
+    assert_equal(0x4B37, SerialPort::Checksum.crc16_modbus("123456789"))
+    assert_equal(0x29B1, SerialPort::Checksum.crc_ccitt("123456789"))
+    assert_equal(0xCBF43926, SerialPort::Checksum.crc32("123456789"))
+    assert_equal(0xCBF43926, SerialPort::Checksum.crc32("56789", SerialPort::Checksum.crc32("1234")))
+    assert_equal(0x23, SerialPort::Checksum.lrc("123456789"))
+    frame = SerialPort::Checksum.append(:crc16_modbus, "\x01\x03\x00\x00\x00\x0A")
+    assert_equal([0xC5, 0xCD], frame[-2, 2].unpack("C*"))
+    assert(SerialPort::Checksum.valid?(:crc16_modbus, frame))
+    assert(!SerialPort::Checksum.valid?(:crc16_modbus, frame.succ))
+    assert_raise(ArgumentError) { SerialPort::Checksum.append(:md5, "") }
+  end
+
   def test_signals
     @sp = SerialPort.new(@device)
     # .dtr and .rts are not supported on Windows
@@ -250,4 +513,210 @@ class TestSerialPort < Test::Unit::TestCase #:nodoc:
     assert_equal(@sp.rts, @signals['rts']) if posix
   end
 
-end
\ No newline at end of file
+  def test_signal_bits
+    @sp = SerialPort.new(@device)
+    posix = (/mingw|mswin|cygwin|bccwin/ =~ RUBY_PLATFORM).nil?
+    @sp.set_signal_bits(SerialPort::LINE_RTS, SerialPort::LINE_DTR)
+    bits = @sp.signal_bits
+    assert_kind_of(Integer, bits)
+    assert_equal(@sp.cts == 1, (bits & SerialPort::LINE_CTS) != 0)
+    assert_equal(1, @sp.rts) if posix
+    assert_equal(0, @sp.dtr) if posix
+    @sp.set_signal_bits(SerialPort::LINE_RTS | SerialPort::LINE_DTR, 0)
+    assert_equal(1, @sp.dtr) if posix
+    assert_raise(ArgumentError) { @sp.set_signal_bits(SerialPort::LINE_CTS, 0) }
+    assert_raise(ArgumentError) { @sp.set_signal_bits(SerialPort::LINE_RTS, SerialPort::LINE_RTS) }
+  end
+
+  def test_wait_for_signal_change
+    @sp = SerialPort.new(@device)
+    lines = SerialPort::LINE_CTS | SerialPort::LINE_DSR | SerialPort::LINE_DCD
+    changed = @sp.wait_for_signal_change(lines, 100)
+    assert(changed.nil? || (changed & ~lines) == 0)
+    assert_raise(ArgumentError) { @sp.wait_for_signal_change(SerialPort::LINE_RTS, 0) }
+    assert_raise(ArgumentError) { @sp.wait_for_signal_change(0, 0) }
+    begin
+      counters = @sp.line_counters
+    rescue NotImplementedError
+      return
+    end
+    assert_kind_of(Integer, counters['cts'])
+    assert_kind_of(Integer, counters['rx'])
+  end
+
+
+  def test_rs485
+    @sp = SerialPort.new(@device)
+    begin
+      saved = @sp.rs485
+    rescue NotImplementedError, Errno::ENOTTY, Errno::EINVAL
+      # the port has no RS-485 support
+      return
+    end
+    assert_raise(ArgumentError) { @sp.rs485 = { "delay_rts_after_send" => -1 } }
+    @sp.rs485 = { "enabled" => true, "delay_rts_after_send" => 1 }
+    assert_equal(true, @sp.rs485["enabled"])
+    @sp.write("x")
+    @sp.rs485 = saved
+    assert_equal(saved["enabled"], @sp.rs485["enabled"])
+  end
+
+  def test_list
+    ports = SerialPort.list
+    assert_kind_of(Array, ports)
+    assert_equal(ports.sort_by { |port| port["path"] }, ports)
+    ports.each do |port|
+      assert_kind_of(String, port["path"])
+      %w(description manufacturer serial_number vid pid).each do |key|
+        assert(port.has_key?(key), key)
+      end
+      assert(port["pid"].nil? || port["vid"], "pid without vid")
+    end
+    assert_raise(NoMethodError) { SerialPort.list_ports }
+  end
+
+  def test_stats
+    @sp = SerialPort.new(@device)
+    st = @sp.stats
+    %w(bytes_in bytes_out reads writes timeouts short_reads eagain eintr).each do |key|
+      assert_equal(0, st[key], key)
+    end
+    assert_equal(1, @sp.syswrite_timeout("x", 1000))
+    @sp.sysread_timeout(1, 0)
+    st = @sp.stats
+    assert_equal(1, st["bytes_out"])
+    assert_equal(1, st["writes"])
+    assert_equal(1, st["reads"] + st["timeouts"])
+  end
+
+  def test_send_break
+    @sp = SerialPort.new(@device)
+    assert_raise(ArgumentError) { @sp.send_break(0) }
+    assert_raise(ArgumentError) { @sp.send_break(100, -1) }
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_equal(@sp, @sp.send_break(20000, 5000))
+    assert(Process.clock_gettime(Process::CLOCK_MONOTONIC) - start >= 0.025)
+    assert_equal(4, @sp.break_and_write("ping", 200, 20, 1000))
+  end
+
+  def test_read_line
+    @sp = SerialPort.new(@device)
+    assert_raise(ArgumentError) { @sp.read_line("") }
+    assert_raise(ArgumentError) { @sp.read_line("\n", 0) }
+    assert_raise(ArgumentError) { @sp.read_line("\n", 16, -1) }
+    line = @sp.read_line("\r\n", 16, 100)
+    assert(line.nil? || line.size <= 16)
+    assert(line.nil? || line.end_with?("\r\n") || line.size == 16)
+  end
+
+  def test_read_line_threads
+    @sp = SerialPort.new(@device)
+    readers = (1..2).map { Thread.new { @sp.read_line("\n", 16, 200) } }
+    readers.each do |t|
+      line = t.value
+      assert(line.nil? || line.size <= 16)
+    end
+    killed = Thread.new { @sp.read_line("\n", 16, nil) }
+    sleep 0.1
+    killed.kill.join
+    assert_nothing_raised(Exception) { @sp.read_line("\n", 16, 0) }
+  end
+
+  def test_read_stamped
+    @sp = SerialPort.new(@device)
+    assert_equal(["", ""], @sp.read_stamped(0))
+    assert_raise(ArgumentError) { @sp.read_stamped(-1) }
+    before = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    data, stamps = @sp.read_stamped(64, 100, 10)
+    return if data.nil?
+    records = stamps.unpack("q*").each_slice(2).to_a
+    assert_equal(data.size, records.last[0])
+    assert_equal(records.map { |o, ns| o }.sort, records.map { |o, ns| o })
+    records.each { |o, ns| assert(ns == -1 || ns >= before) }
+  end
+
+  def test_capture
+    path = File.join(Dir.tmpdir, "test_serialport.#{$$}.spcap")
+    @sp = SerialPort.new(@device)
+    @sp.start_capture(path)
+    assert(@sp.capturing?)
+    assert_raise(IOError) { @sp.start_capture(path) }
+    @sp.syswrite_timeout("ping", 1000)
+    @sp.stop_capture
+    assert(!@sp.capturing?)
+    records = []
+    SerialPort::Capture.each_record(path) { |kind, ns, data| records << [kind, data] }
+    assert_equal(SerialPort::Capture::START, records.first[0])
+    assert_equal("ping", records.select { |kind, data| kind == SerialPort::Capture::TX }.map { |kind, data| data }.join)
+    assert_equal(0, SerialPort::Capture.replay(path, StringIO.new, :speed => 0))
+    assert_equal(4, SerialPort::Capture.replay(path, StringIO.new, :speed => 0,
+                                              :direction => SerialPort::Capture::TX))
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+
+  def test_share
+    name = File::directory?("/dev") ? File.join(Dir.tmpdir, "test_serialport.#{$$}.shm") :
+                                        "Local\\test_serialport.#{$$}"
+    @sp = SerialPort.new(@device)
+    @sp.share(name, 4096)
+    assert(@sp.sharing?)
+    assert_raise(IOError) { @sp.share(name) }
+    reader = SerialPort::SharedReader.new(name)
+    assert_equal(0, reader.lost)
+    data = reader.read(64, 0)
+    assert(data.nil? || data.size <= 64)
+    @sp.unshare
+    assert(!@sp.sharing?)
+    reader.read(64, 0) while reader.pending > 0
+    assert_raise(EOFError) { reader.read(64, 0) }
+    reader.close
+    assert(reader.closed?)
+    assert_raise(IOError) { reader.read }
+    assert_raise(Errno::ENOENT) { SerialPort::SharedReader.new(name) } if File::directory?("/dev")
+  end
+
+  def test_share_keeps_other_files
+    return unless File::directory?("/dev")
+    name = File.join(Dir.tmpdir, "test_serialport.#{$$}.txt")
+    File.open(name, "w") { |f| f.write("keep me") }
+    @sp = SerialPort.new(@device)
+    assert_raise(Errno::EEXIST) { @sp.share(name, 4096) }
+    assert(!@sp.sharing?)
+    assert_equal("keep me", File.read(name))
+  ensure
+    File.unlink(name) if name and File.exist?(name)
+  end
+
+  def test_share_keeps_live_segments
+    return unless File::directory?("/dev")
+    name = File.join(Dir.tmpdir, "test_serialport.#{$$}.live.shm")
+    @sp = SerialPort.new(@device)
+    @sp.share(name, 4096)
+    other = SerialPort.new(@device)
+    assert_raise(IOError) { other.share(name, 4096) }
+    assert(!other.sharing?)
+    SerialPort::SharedReader.new(name).close
+    # unshare leaves the path alone once it names another file
+    File.unlink(name)
+    File.open(name, "w") { |f| f.write("keep me") }
+    @sp.unshare
+    assert_equal("keep me", File.read(name))
+  ensure
+    other.close if other
+    File.unlink(name) if name and File.exist?(name)
+  end
+
+  def test_nonblock
+    assert_raise(ArgumentError) { SerialPort.new(@device, :nonblock => true, :rx_thread => true) }
+    @sp = SerialPort.new(@device, :nonblock => true)
+    if File::directory?("/dev")
+      assert(@sp.fcntl(Fcntl::F_GETFL) & Fcntl::O_NONBLOCK != 0)
+    end
+    start = Time.now
+    data = @sp.sysread_timeout(64, 50)
+    assert(data.nil? || data.size <= 64)
+    assert(Time.now - start < 1) if data.nil?
+    assert_equal(2, @sp.syswrite_timeout("ok", 1000))
+  end
+end